@@ -1,99 +1,6409 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <chrono>
 #include <zlib.h>
 #include <filesystem>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <string_view>
+#include <random>
+#include <cstring>
+#include <cmath>
+#include <cctype>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <type_traits>
+#include <deque>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <condition_variable>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <grp.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace fs = std::filesystem;
 using namespace std;
 using namespace std::chrono;
 
-mutex mtx;
+enum class QosClass { Normal, Low, Idle };
 
+struct ToolSettings {
+    bool blockMode = false;        // chunk-parallel compression with a sidecar block index
+    size_t blockSize = 1024 * 1024;
+    bool autoStrategy = true;      // pick deflate strategy/memLevel per block from its statistics
+    bool layoutOrdering = false;   // read files in on-disk order, limited readers per device
+    int readersPerDevice = 1;
+    size_t readAheadBytes = 256 * 1024 * 1024;
+    QosClass qosClass = QosClass::Normal;   // CPU/I/O scheduling class for worker threads
+    bool parallelInflate = false;  // speculative chunk-parallel inflate of single-stream files
+    size_t inflateChunkSize = 4 * 1024 * 1024;
+    size_t indexSpan = 1024 * 1024;        // uncompressed bytes between seek-index checkpoints
+    bool tokenFilters = false;     // block mode cuts blocks on lines and indexes their tokens for search
+    bool timeIndex = false;        // block mode cuts blocks on lines and indexes their timestamp range
+    uint32_t parityShards = 0;     // Reed-Solomon parity shards per 16 archive shards in block mode, 0 = off
+    string tracePath;              // batch jobs append their shape (no contents) here, empty = off
+    bool smallFileFastPath = true; // compress files under smallFileLimit with one read, deflate and write
+};
+
+ToolSettings settings;
+
+enum class LogLevel { Debug, Info, Warn, Error };
+
+struct LogRecord {
+    int64_t timestampUs;
+    LogLevel level;
+    uint16_t length;
+    char text[230];
+};
+
+// Single-producer ring owned by one thread at a time; the drain thread is the only consumer.
+struct LogBuffer {
+    static const size_t capacity = 1024;
+    array<LogRecord, capacity> records;
+    atomic<uint64_t> head{0};
+    atomic<uint64_t> tail{0};
+    atomic<bool> owned{false};
+    LogBuffer* next = nullptr;
+    int id = 0;
+};
+
+class AsyncLogger {
+public:
+    ~AsyncLogger() {
+        stop();
+        LogBuffer* buffer = buffers.load();
+        while (buffer) {
+            LogBuffer* next = buffer->next;
+            delete buffer;
+            buffer = next;
+        }
+    }
+
+    void start() {
+        if (running.exchange(true)) return;
+        drainer = thread([this]() { drainLoop(); });
+    }
+
+    void stop() {
+        if (!running.exchange(false)) return;
+        drainer.join();
+        drainOnce();
+    }
+
+    void setMinLevel(LogLevel level) { minLevel.store(level); }
+    LogLevel getMinLevel() const { return minLevel.load(); }
+    void setJson(bool enabled) { json.store(enabled); }
+    bool isJson() const { return json.load(); }
+    uint64_t droppedCount() const { return dropped.load(); }
+
+    bool enabled(LogLevel level) const {
+        return level >= minLevel.load(memory_order_relaxed);
+    }
+
+    LogRecord* beginRecord(LogLevel level) {
+        LogBuffer* buffer = localBuffer();
+        uint64_t head = buffer->head.load(memory_order_relaxed);
+        if (head - buffer->tail.load(memory_order_acquire) >= LogBuffer::capacity) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+        LogRecord& record = buffer->records[head % LogBuffer::capacity];
+        record.timestampUs = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+        record.level = level;
+        record.length = 0;
+        return &record;
+    }
+
+    void commitRecord() {
+        LogBuffer* buffer = localBuffer();
+        buffer->head.store(buffer->head.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+    // Waits until everything enqueued so far has been written; never called from workers.
+    void flush() {
+        uint64_t target = 0;
+        for (LogBuffer* b = buffers.load(memory_order_acquire); b; b = b->next) {
+            target += b->head.load(memory_order_acquire);
+        }
+        if (!running.load()) {
+            drainOnce();
+            return;
+        }
+        while (written.load(memory_order_acquire) < target) {
+            this_thread::sleep_for(milliseconds(1));
+        }
+        uint64_t lost = dropped.exchange(0);
+        if (lost > 0) {
+            cerr << "Logger dropped " << lost << " messages under load" << endl;
+        }
+    }
+
+private:
+    struct Lease {
+        LogBuffer* buffer = nullptr;
+        ~Lease() {
+            if (buffer) buffer->owned.store(false, memory_order_release);
+        }
+    };
+
+    LogBuffer* localBuffer() {
+        thread_local Lease lease;
+        if (lease.buffer) return lease.buffer;
+
+        for (LogBuffer* b = buffers.load(memory_order_acquire); b; b = b->next) {
+            bool expected = false;
+            if (b->owned.compare_exchange_strong(expected, true, memory_order_acq_rel)) {
+                lease.buffer = b;
+                return b;
+            }
+        }
+
+        LogBuffer* b = new LogBuffer();
+        b->owned.store(true);
+        b->id = nextId.fetch_add(1);
+        b->next = buffers.load(memory_order_relaxed);
+        while (!buffers.compare_exchange_weak(b->next, b, memory_order_release, memory_order_relaxed)) {
+        }
+        lease.buffer = b;
+        return b;
+    }
+
+    static void appendJsonString(string& out, const char* text, size_t length) {
+        out += '"';
+        for (size_t i = 0; i < length; ++i) {
+            char c = text[i];
+            switch (c) {
+                case '"': out += "\\\""; break;
+                case '\\': out += "\\\\"; break;
+                case '\n': out += "\\n"; break;
+                case '\t': out += "\\t"; break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        char escaped[8];
+                        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                        out += escaped;
+                    } else {
+                        out += c;
+                    }
+            }
+        }
+        out += '"';
+    }
+
+    bool drainOnce() {
+        static const char* levelNames[] = {"debug", "info", "warn", "error"};
+        string out, err;
+        uint64_t total = 0;
+        bool asJson = json.load();
+
+        for (LogBuffer* b = buffers.load(memory_order_acquire); b; b = b->next) {
+            uint64_t tail = b->tail.load(memory_order_relaxed);
+            uint64_t head = b->head.load(memory_order_acquire);
+            for (; tail < head; ++tail) {
+                const LogRecord& record = b->records[tail % LogBuffer::capacity];
+                if (asJson) {
+                    out += "{\"ts\":" + to_string(record.timestampUs) + ",\"level\":\"" +
+                           levelNames[static_cast<int>(record.level)] + "\",\"thread\":" + to_string(b->id) + ",\"msg\":";
+                    appendJsonString(out, record.text, record.length);
+                    out += "}\n";
+                } else {
+                    string& target = record.level >= LogLevel::Warn ? err : out;
+                    target.append(record.text, record.length);
+                    target += '\n';
+                }
+            }
+            b->tail.store(tail, memory_order_release);
+            total += tail;
+        }
+
+        if (!out.empty()) cout.write(out.data(), out.size()).flush();
+        if (!err.empty()) cerr.write(err.data(), err.size()).flush();
+        written.store(total, memory_order_release);
+        return !out.empty() || !err.empty();
+    }
+
+    void drainLoop() {
+        while (running.load()) {
+            if (!drainOnce()) {
+                this_thread::sleep_for(milliseconds(2));
+            }
+        }
+    }
+
+    atomic<LogBuffer*> buffers{nullptr};
+    atomic<int> nextId{0};
+    atomic<bool> running{false};
+    atomic<LogLevel> minLevel{LogLevel::Info};
+    atomic<bool> json{false};
+    atomic<uint64_t> dropped{0};
+    atomic<uint64_t> written{0};
+    thread drainer;
+};
+
+AsyncLogger logger;
+
+inline void appendLogField(LogRecord& record, string_view text) {
+    size_t room = sizeof(record.text) - record.length;
+    size_t n = min(room, text.size());
+    memcpy(record.text + record.length, text.data(), n);
+    record.length = static_cast<uint16_t>(record.length + n);
+}
+
+inline void appendLogField(LogRecord& record, const char* text) {
+    appendLogField(record, string_view(text));
+}
+
+inline void appendLogField(LogRecord& record, const string& text) {
+    appendLogField(record, string_view(text));
+}
+
+inline void appendLogField(LogRecord& record, char c) {
+    appendLogField(record, string_view(&c, 1));
+}
+
+template<typename T, typename = enable_if_t<is_arithmetic_v<T>>>
+inline void appendLogField(LogRecord& record, T value) {
+    char digits[32];
+    int n = is_floating_point_v<T> ? snprintf(digits, sizeof(digits), "%.2f", static_cast<double>(value))
+          : is_signed_v<T> ? snprintf(digits, sizeof(digits), "%lld", static_cast<long long>(value))
+          : snprintf(digits, sizeof(digits), "%llu", static_cast<unsigned long long>(value));
+    appendLogField(record, string_view(digits, static_cast<size_t>(max(0, n))));
+}
+
+template<typename... Args>
+void logMessage(LogLevel level, const Args&... args) {
+    if (!logger.enabled(level)) return;
+    LogRecord* record = logger.beginRecord(level);
+    if (!record) return;
+    (appendLogField(*record, args), ...);
+    logger.commitRecord();
+}
+
+
+struct CompressionTask {
+    string inputPath;
+    string outputPath;
+    bool compress;
+    int level;
+};
+
+// Distinct path pieces stored once, back to back, and referred to by id. Lookups go
+// through an open-addressed table of ids, so no string or node is allocated per piece.
+class PathArena {
+public:
+    uint32_t intern(string_view piece) {
+        if ((count() + 1) * 4 > slots.size() * 3) rehash(max<size_t>(1024, slots.size() * 2));
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash<string_view>{}(piece) & mask;; i = (i + 1) & mask) {
+            if (slots[i] == emptySlot) {
+                uint32_t id = static_cast<uint32_t>(count());
+                bytes.append(piece.data(), piece.size());
+                starts.push_back(bytes.size());
+                slots[i] = id;
+                return id;
+            }
+            if (get(slots[i]) == piece) return slots[i];
+        }
+    }
+
+    string_view get(uint32_t id) const {
+        return string_view(bytes.data() + starts[id], static_cast<size_t>(starts[id + 1] - starts[id]));
+    }
+
+    size_t count() const { return starts.size() - 1; }
+    size_t memoryBytes() const {
+        return bytes.capacity() + starts.capacity() * sizeof(uint64_t) + slots.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    static constexpr uint32_t emptySlot = UINT32_MAX;
+
+    void rehash(size_t slotCount) {
+        slots.assign(slotCount, emptySlot);
+        size_t mask = slotCount - 1;
+        for (uint32_t id = 0; id < count(); ++id) {
+            size_t i = hash<string_view>{}(get(id)) & mask;
+            while (slots[i] != emptySlot) i = (i + 1) & mask;
+            slots[i] = id;
+        }
+    }
+
+    string bytes;
+    vector<uint64_t> starts{0};
+    vector<uint32_t> slots;
+};
+
+// How a task's output file name is derived from the name it was given.
+enum class OutputName : uint8_t { Same, AppendGz, StripExtension };
+
+// Task list for very large batches. A task is a few ids into a shared PathArena, with
+// directory prefixes (kept with their trailing '/') and file names interned separately,
+// and its paths are only assembled when a worker picks it up.
+class TaskList {
+public:
+    uint32_t intern(string_view piece) { return paths.intern(piece); }
+
+    // Adds a task for the file at `inputPath`, written under the interned `outputDir`.
+    void add(string_view inputPath, uint32_t outputDir, OutputName rule, bool compress, int level) {
+        size_t cut = inputPath.rfind('/') + 1;
+        uint32_t name = paths.intern(inputPath.substr(cut));
+        tasks.push_back({directory(inputPath.substr(0, cut)), name, outputDir, name, rule, compress,
+                         static_cast<int8_t>(level)});
+    }
+
+    void add(string_view inputPath, string_view outputPath, bool compress, int level = Z_DEFAULT_COMPRESSION) {
+        size_t cut = inputPath.rfind('/') + 1;
+        size_t outputCut = outputPath.rfind('/') + 1;
+        tasks.push_back({directory(inputPath.substr(0, cut)), paths.intern(inputPath.substr(cut)),
+                         paths.intern(outputPath.substr(0, outputCut)), paths.intern(outputPath.substr(outputCut)),
+                         OutputName::Same, compress, static_cast<int8_t>(level)});
+    }
+
+    size_t size() const { return tasks.size(); }
+    bool empty() const { return tasks.empty(); }
+    bool compress(size_t i) const { return tasks[i].compress; }
+    int level(size_t i) const { return tasks[i].level; }
+    string_view inputDir(size_t i) const { return paths.get(tasks[i].inputDir); }
+
+    void inputPath(size_t i, string& out) const {
+        out.assign(paths.get(tasks[i].inputDir));
+        out.append(paths.get(tasks[i].inputName));
+    }
+
+    void outputPath(size_t i, string& out) const {
+        const Task& task = tasks[i];
+        string_view name = paths.get(task.outputName);
+        if (task.rule == OutputName::StripExtension) {
+            // Matches fs::path::stem(): a leading dot does not start an extension.
+            size_t dot = name.rfind('.');
+            if (dot != string_view::npos && dot != 0 && name != "..") name = name.substr(0, dot);
+        }
+        out.assign(paths.get(task.outputDir));
+        out.append(name);
+        if (task.rule == OutputName::AppendGz) out.append(".gz");
+    }
+
+    CompressionTask operator[](size_t i) const {
+        CompressionTask task{string(), string(), tasks[i].compress, tasks[i].level};
+        inputPath(i, task.inputPath);
+        outputPath(i, task.outputPath);
+        return task;
+    }
+
+    size_t memoryBytes() const { return tasks.capacity() * sizeof(Task) + paths.memoryBytes(); }
+
+private:
+    struct Task {
+        uint32_t inputDir;
+        uint32_t inputName;
+        uint32_t outputDir;
+        uint32_t outputName;
+        OutputName rule;
+        bool compress;
+        int8_t level;
+    };
+
+    // Consecutive tasks usually share a directory, so the last one is checked first.
+    uint32_t directory(string_view prefix) {
+        if (!hasLastDir || paths.get(lastDir) != prefix) {
+            lastDir = paths.intern(prefix);
+            hasLastDir = true;
+        }
+        return lastDir;
+    }
+
+    PathArena paths;
+    vector<Task> tasks;
+    uint32_t lastDir = 0;
+    bool hasLastDir = false;
+};
+
+// Bytes currently allocated from the heap, or 0 where the allocator cannot report it.
+size_t heapBytesInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+
+// Shared token bucket; a rate of zero means unlimited. Callers reserve tokens and
+// sleep off any debt outside the lock, so the rate can be changed while workers run.
+class TokenBucket {
+public:
+    void setRate(double perSecond) {
+        lock_guard<mutex> lock(m);
+        rate.store(max(0.0, perSecond));
+        tokens = min(tokens, burstCapacity());
+        last = steady_clock::now();
+    }
+
+    double getRate() const { return rate.load(); }
+
+    void consume(double amount) {
+        if (rate.load(memory_order_relaxed) <= 0) return;
+        double wait = 0;
+        {
+            lock_guard<mutex> lock(m);
+            double current = rate.load();
+            if (current <= 0) return;
+            auto now = steady_clock::now();
+            tokens = min(burstCapacity(), tokens + duration<double>(now - last).count() * current);
+            last = now;
+            tokens -= amount;
+            if (tokens < 0) wait = -tokens / current;
+        }
+        if (wait > 0) {
+            this_thread::sleep_for(duration<double>(wait));
+        }
+    }
+
+private:
+    double burstCapacity() const { return rate.load() * 0.25; }
+
+    mutex m;
+    atomic<double> rate{0};
+    double tokens = 0;
+    steady_clock::time_point last = steady_clock::now();
+};
+
+// The limits can also be changed while a job runs through a control file, checked at most
+// twice a second and reloaded when it changes: lines of "read <MB/s>", "write <MB/s>" and
+// "ops <per second>".
+struct IoThrottle {
+    TokenBucket readBytes;
+    TokenBucket writeBytes;
+    TokenBucket operations;
+
+    void onRead(size_t bytes) {
+        pollControlFile();
+        operations.consume(1);
+        readBytes.consume(static_cast<double>(bytes));
+    }
+
+    void onWrite(size_t bytes) {
+        pollControlFile();
+        operations.consume(1);
+        writeBytes.consume(static_cast<double>(bytes));
+    }
+
+    void setControlFile(const string& path) {
+        lock_guard<mutex> lock(controlMutex);
+        controlPath = path;
+        controlStamp = {-1, -1};
+        nextPoll.store(path.empty() ? INT64_MAX : 0);
+    }
+
+    string getControlFile() {
+        lock_guard<mutex> lock(controlMutex);
+        return controlPath;
+    }
+
+private:
+    void pollControlFile() {
+        int64_t now = steady_clock::now().time_since_epoch().count();
+        if (now < nextPoll.load(memory_order_relaxed)) return;
+        unique_lock<mutex> lock(controlMutex, try_to_lock);
+        if (!lock.owns_lock() || now < nextPoll.load()) return;
+        nextPoll.store(now + duration_cast<steady_clock::duration>(milliseconds(500)).count());
+
+        struct stat st;
+        if (stat(controlPath.c_str(), &st) != 0) return;
+        pair<int64_t, int64_t> stamp(st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+        if (stamp == controlStamp) return;
+        controlStamp = stamp;
+
+        ifstream in(controlPath);
+        string key;
+        double value;
+        while (in >> key >> value) {
+            if (key == "read") readBytes.setRate(value * 1024 * 1024);
+            else if (key == "write") writeBytes.setRate(value * 1024 * 1024);
+            else if (key == "ops") operations.setRate(value);
+            else logMessage(LogLevel::Warn, "Unknown I/O limit in ", controlPath, ": ", key);
+        }
+        logMessage(LogLevel::Info, "I/O limits reloaded from ", controlPath);
+    }
+
+    mutex controlMutex;
+    string controlPath;
+    pair<int64_t, int64_t> controlStamp{-1, -1};
+    atomic<int64_t> nextPoll{INT64_MAX};
+};
+
+IoThrottle ioThrottle;
+
+// Applies the configured CPU and I/O class to the calling worker thread.
+void applyWorkerQos() {
+#ifdef __linux__
+    const int ioprioWhoProcess = 1;
+    const int ioprioClassShift = 13;
+    const int ioprioClassBestEffort = 2;
+    const int ioprioClassIdle = 3;
+
+    switch (settings.qosClass) {
+        case QosClass::Low:
+            syscall(SYS_ioprio_set, ioprioWhoProcess, 0, (ioprioClassBestEffort << ioprioClassShift) | 7);
+            setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+            break;
+        case QosClass::Idle: {
+            syscall(SYS_ioprio_set, ioprioWhoProcess, 0, ioprioClassIdle << ioprioClassShift);
+            sched_param param = {};
+            pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+            break;
+        }
+        case QosClass::Normal:
+            break;
+    }
+#endif
+}
+
+enum class SimdLevel { Scalar, Sse42, Avx2, Avx512 };
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Sse42: return "sse4.2";
+        case SimdLevel::Avx2: return "avx2";
+        case SimdLevel::Avx512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+// Counts positions whose byte equals the one before it.
+size_t countRepeatedBytesScalar(const unsigned char* data, size_t size) {
+    size_t count = 0;
+    for (size_t i = 1; i < size; ++i) {
+        count += data[i] == data[i - 1];
+    }
+    return count;
+}
+
+bool isAllZeroScalar(const unsigned char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i]) return false;
+    }
+    return true;
+}
+
+// Sets bit i of masks[t] when block[i] equals targets[t], for one 64-byte block.
+void matchBytes64Scalar(const unsigned char* block, const unsigned char* targets, int count, uint64_t* masks) {
+    for (int t = 0; t < count; ++t) {
+        uint64_t mask = 0;
+        for (int i = 0; i < 64; ++i) {
+            mask |= static_cast<uint64_t>(block[i] == targets[t]) << i;
+        }
+        masks[t] = mask;
+    }
+}
+
+// dst ^= c * src over GF(2^8), where table holds c times each low nibble followed by c
+// times each high nibble.
+void gfMulAddScalar(const unsigned char* table, const unsigned char* src, unsigned char* dst, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        dst[i] ^= table[src[i] & 0x0f] ^ table[16 + (src[i] >> 4)];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2,popcnt")))
+size_t countRepeatedBytesSse42(const unsigned char* data, size_t size) {
+    size_t count = 0;
+    size_t i = 1;
+    for (; i + 16 <= size; i += 16) {
+        __m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        __m128i prev = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i - 1));
+        count += _mm_popcnt_u32(static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(cur, prev))));
+    }
+    return count + (i < size ? countRepeatedBytesScalar(data + i - 1, size - i + 1) : 0);
+}
+
+__attribute__((target("sse4.2")))
+bool isAllZeroSse42(const unsigned char* data, size_t size) {
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        if (!_mm_testz_si128(v, v)) return false;
+    }
+    return isAllZeroScalar(data + i, size - i);
+}
+
+__attribute__((target("sse4.2")))
+void matchBytes64Sse42(const unsigned char* block, const unsigned char* targets, int count, uint64_t* masks) {
+    __m128i v[4];
+    for (int j = 0; j < 4; ++j) v[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * j));
+    for (int t = 0; t < count; ++t) {
+        __m128i needle = _mm_set1_epi8(static_cast<char>(targets[t]));
+        uint64_t mask = 0;
+        for (int j = 0; j < 4; ++j) {
+            mask |= static_cast<uint64_t>(static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v[j], needle))))
+                    << (16 * j);
+        }
+        masks[t] = mask;
+    }
+}
+
+__attribute__((target("sse4.2")))
+void gfMulAddSse42(const unsigned char* table, const unsigned char* src, unsigned char* dst, size_t size) {
+    const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table));
+    const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + 16));
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(v, nibble)),
+                                        _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(d, product));
+    }
+    gfMulAddScalar(table, src + i, dst + i, size - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t countRepeatedBytesAvx2(const unsigned char* data, size_t size) {
+    size_t count = 0;
+    size_t i = 1;
+    for (; i + 32 <= size; i += 32) {
+        __m256i cur = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        __m256i prev = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i - 1));
+        count += _mm_popcnt_u32(static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, prev))));
+    }
+    return count + (i < size ? countRepeatedBytesScalar(data + i - 1, size - i + 1) : 0);
+}
+
+__attribute__((target("avx2")))
+bool isAllZeroAvx2(const unsigned char* data, size_t size) {
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        if (!_mm256_testz_si256(v, v)) return false;
+    }
+    return isAllZeroScalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+void matchBytes64Avx2(const unsigned char* block, const unsigned char* targets, int count, uint64_t* masks) {
+    __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+    __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + 32));
+    for (int t = 0; t < count; ++t) {
+        __m256i needle = _mm256_set1_epi8(static_cast<char>(targets[t]));
+        uint64_t low = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle)));
+        uint64_t high = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle)));
+        masks[t] = low | (high << 32);
+    }
+}
+
+__attribute__((target("avx2")))
+void gfMulAddAvx2(const unsigned char* table, const unsigned char* src, unsigned char* dst, size_t size) {
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table)));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table + 16)));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(v, nibble)),
+                                           _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(d, product));
+    }
+    gfMulAddScalar(table, src + i, dst + i, size - i);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+size_t countRepeatedBytesAvx512(const unsigned char* data, size_t size) {
+    size_t count = 0;
+    size_t i = 1;
+    for (; i + 64 <= size; i += 64) {
+        __m512i cur = _mm512_loadu_si512(data + i);
+        __m512i prev = _mm512_loadu_si512(data + i - 1);
+        count += static_cast<size_t>(_mm_popcnt_u64(_mm512_cmpeq_epi8_mask(cur, prev)));
+    }
+    return count + (i < size ? countRepeatedBytesScalar(data + i - 1, size - i + 1) : 0);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+bool isAllZeroAvx512(const unsigned char* data, size_t size) {
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m512i v = _mm512_loadu_si512(data + i);
+        if (_mm512_test_epi64_mask(v, v)) return false;
+    }
+    return isAllZeroScalar(data + i, size - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void matchBytes64Avx512(const unsigned char* block, const unsigned char* targets, int count, uint64_t* masks) {
+    __m512i v = _mm512_loadu_si512(block);
+    for (int t = 0; t < count; ++t) {
+        masks[t] = _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(static_cast<char>(targets[t])));
+    }
+}
+__attribute__((target("avx512f,avx512bw")))
+void gfMulAddAvx512(const unsigned char* table, const unsigned char* src, unsigned char* dst, size_t size) {
+    unsigned char wide[128];
+    for (int lane = 0; lane < 4; ++lane) {
+        memcpy(wide + 16 * lane, table, 16);
+        memcpy(wide + 64 + 16 * lane, table + 16, 16);
+    }
+    const __m512i low = _mm512_loadu_si512(wide);
+    const __m512i high = _mm512_loadu_si512(wide + 64);
+    const __m512i nibble = _mm512_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m512i v = _mm512_loadu_si512(src + i);
+        __m512i product = _mm512_xor_si512(_mm512_shuffle_epi8(low, _mm512_and_si512(v, nibble)),
+                                           _mm512_shuffle_epi8(high, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble)));
+        _mm512_storeu_si512(dst + i, _mm512_xor_si512(_mm512_loadu_si512(dst + i), product));
+    }
+    gfMulAddScalar(table, src + i, dst + i, size - i);
+}
+#endif
+
+struct SimdKernels {
+    SimdLevel level = SimdLevel::Scalar;
+    size_t (*countRepeatedBytes)(const unsigned char*, size_t) = countRepeatedBytesScalar;
+    bool (*isAllZero)(const unsigned char*, size_t) = isAllZeroScalar;
+    void (*matchBytes64)(const unsigned char*, const unsigned char*, int, uint64_t*) = matchBytes64Scalar;
+    void (*gfMulAdd)(const unsigned char*, const unsigned char*, unsigned char*, size_t) = gfMulAddScalar;
+};
+
+SimdKernels simd;
+
+SimdLevel detectSimdLevel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) return SimdLevel::Avx512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::Avx2;
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) return SimdLevel::Sse42;
+#endif
+    return SimdLevel::Scalar;
+}
+
+SimdKernels kernelsFor(SimdLevel level) {
+    SimdKernels kernels;
+#if defined(__x86_64__) || defined(__i386__)
+    kernels.level = level;
+    switch (level) {
+        case SimdLevel::Avx512:
+            kernels.countRepeatedBytes = countRepeatedBytesAvx512;
+            kernels.isAllZero = isAllZeroAvx512;
+            kernels.matchBytes64 = matchBytes64Avx512;
+            kernels.gfMulAdd = gfMulAddAvx512;
+            break;
+        case SimdLevel::Avx2:
+            kernels.countRepeatedBytes = countRepeatedBytesAvx2;
+            kernels.isAllZero = isAllZeroAvx2;
+            kernels.matchBytes64 = matchBytes64Avx2;
+            kernels.gfMulAdd = gfMulAddAvx2;
+            break;
+        case SimdLevel::Sse42:
+            kernels.countRepeatedBytes = countRepeatedBytesSse42;
+            kernels.isAllZero = isAllZeroSse42;
+            kernels.matchBytes64 = matchBytes64Sse42;
+            kernels.gfMulAdd = gfMulAddSse42;
+            break;
+        case SimdLevel::Scalar:
+            break;
+    }
+#else
+    (void)level;
+#endif
+    return kernels;
+}
+
+// Selects the kernels once; a requested level above what the CPU supports is clamped.
+void initSimdDispatch(SimdLevel requested) {
+    SimdLevel level = min(requested, detectSimdLevel());
+    simd = kernelsFor(level);
+}
+
+SimdLevel parseSimdLevel(const string& name) {
+    if (name == "scalar") return SimdLevel::Scalar;
+    if (name == "sse4.2") return SimdLevel::Sse42;
+    if (name == "avx2") return SimdLevel::Avx2;
+    return SimdLevel::Avx512;
+}
+
+template<typename Func>
+void parallelFor(size_t count, int numThreads, Func f) {
+    atomic<size_t> next{0};
+    auto worker = [&](int workerId) {
+        if (workerId != 0) applyWorkerQos();
+        while (true) {
+            size_t index = next.fetch_add(1);
+            if (index >= count) return;
+            f(index, workerId);
+        }
+    };
+
+    int spawn = max(1, min<int>(numThreads, static_cast<int>(count)));
+    vector<thread> threads;
+    for (int i = 1; i < spawn; ++i) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+// Deflate streams owned by one worker, reset between uses instead of re-initialised.
+class DeflateContextCache {
+public:
+    DeflateContextCache() = default;
+    DeflateContextCache(const DeflateContextCache&) = delete;
+    DeflateContextCache& operator=(const DeflateContextCache&) = delete;
+
+    ~DeflateContextCache() {
+        for (auto& entry : streams) {
+            deflateEnd(entry.second.get());
+        }
+    }
+
+    z_stream* acquire(int level, int windowBits = MAX_WBITS, int memLevel = 8, int strategy = Z_DEFAULT_STRATEGY) {
+        auto key = make_tuple(level, windowBits, memLevel);
+        auto it = streams.find(key);
+        if (it != streams.end()) {
+            deflateReset(it->second.get());
+            deflateParams(it->second.get(), level, strategy);
+            return it->second.get();
+        }
+
+        auto zs = make_unique<z_stream>();
+        if (deflateInit2(zs.get(), level, Z_DEFLATED, windowBits, memLevel, strategy) != Z_OK) {
+            return nullptr;
+        }
+        z_stream* raw = zs.get();
+        streams.emplace(key, move(zs));
+        return raw;
+    }
+
+private:
+    map<tuple<int, int, int>, unique_ptr<z_stream>> streams;
+};
+
+// Per-chunk pipeline stages. Each configuration of filter -> codec -> checksum -> sink
+// is its own template instantiation, so the hot loop carries no runtime mode checks.
+struct IdentityFilter {
+    void apply(char*, size_t) {}
+};
+
+struct DeflateCodec {
+    z_stream zs = {};
+    bool streamEnded = false;
+    bool init(int level) { return deflateInit(&zs, level) == Z_OK; }
+    int step(bool lastInput) {
+        int ret = deflate(&zs, lastInput ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) streamEnded = true;
+        return ret;
+    }
+    bool finished() const { return streamEnded; }
+    void end() { deflateEnd(&zs); }
+};
+
+// Concatenated gzip members (or zlib streams) are decoded back to back, like gzip -d.
+// Bytes after a complete member that do not start another one are skipped with a warning,
+// as gzip does with trailing garbage; a member cut short leaves the codec unfinished.
+struct InflateCodec {
+    z_stream zs = {};
+    bool streamEnded = false;
+    bool memberDone = false;
+    bool trailing = false;
+    bool init(int) { return inflateInit2(&zs, MAX_WBITS + 32) == Z_OK; }
+    int step(bool) {
+        if (trailing) {
+            zs.avail_in = 0;
+            return Z_STREAM_END;
+        }
+        int ret;
+        do {
+            if (streamEnded && zs.avail_in > 0) {
+                inflateReset(&zs);
+                streamEnded = false;
+            }
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_DATA_ERROR && memberDone && zs.total_out == 0) {
+                logMessage(LogLevel::Warn, "Ignoring trailing garbage after compressed data");
+                trailing = streamEnded = true;
+                zs.avail_in = 0;
+                return Z_STREAM_END;
+            }
+            if (ret == Z_STREAM_END) streamEnded = memberDone = true;
+        } while (ret == Z_STREAM_END && zs.avail_in > 0 && zs.avail_out > 0);
+        return ret;
+    }
+    bool finished() const { return streamEnded; }
+    void end() { inflateEnd(&zs); }
+};
+
+struct NoChecksum {
+    void update(const char*, size_t) {}
+};
+
+struct Crc32Checksum {
+    uLong crc = crc32(0L, Z_NULL, 0);
+    void update(const char* data, size_t size) {
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(size));
+    }
+};
+
+// Pipeline sinks take each output chunk in order; returning false stops the pipeline.
+struct StreamSink {
+    ostream& out;
+    bool write(const char* data, size_t size) {
+        ioThrottle.onWrite(size);
+        out.write(data, size);
+        return true;
+    }
+};
+
+struct CountingSink {
+    size_t bytes = 0;
+    bool write(const char*, size_t size) {
+        bytes += size;
+        return true;
+    }
+};
+
+class MemoryStreamBuf : public streambuf {
+public:
+    MemoryStreamBuf(const char* data, size_t size) {
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+};
+
+template<typename Filter, typename Codec, typename Checksum, typename Sink>
+bool runChunkPipeline(istream& in, Sink& sink, Checksum& checksum, int level, bool chargeReads) {
+    Filter filter;
+    Codec codec;
+    if (!codec.init(level)) return false;
+
+    vector<char> inBuffer(1024 * 1024);
+    vector<char> outBuffer(1024 * 1024);
+    bool ok = true;
+
+    while (ok) {
+        in.read(inBuffer.data(), inBuffer.size());
+        size_t bytesRead = static_cast<size_t>(in.gcount());
+        bool lastInput = in.peek() == istream::traits_type::eof();
+        if (bytesRead == 0 && !lastInput) break;
+        if (chargeReads) ioThrottle.onRead(bytesRead);
+
+        filter.apply(inBuffer.data(), bytesRead);
+        codec.zs.next_in = reinterpret_cast<Bytef*>(inBuffer.data());
+        codec.zs.avail_in = static_cast<uInt>(bytesRead);
+
+        do {
+            codec.zs.next_out = reinterpret_cast<Bytef*>(outBuffer.data());
+            codec.zs.avail_out = static_cast<uInt>(outBuffer.size());
+
+            int ret = codec.step(lastInput);
+            if (ret == Z_STREAM_ERROR || ret == Z_DATA_ERROR || ret == Z_NEED_DICT || ret == Z_MEM_ERROR) {
+                ok = false;
+                break;
+            }
+
+            size_t produced = outBuffer.size() - codec.zs.avail_out;
+            checksum.update(outBuffer.data(), produced);
+            if (!sink.write(outBuffer.data(), produced)) {
+                ok = false;
+                break;
+            }
+        } while (codec.zs.avail_out == 0);
+
+        if (lastInput) break;
+    }
+
+    // Input that ends (or fails to read) before the stream does is truncated.
+    ok = ok && codec.finished();
+    codec.end();
+    return ok;
+}
+
+bool processStream(istream& inFile, const string& inputPath, const string& outputPath, bool compress, int level,
+                   bool chargeReads = true) {
+    ofstream outFile(outputPath, ios::binary);
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return false;
+    }
+
+    StreamSink sink{outFile};
+    bool ok;
+    if (logger.enabled(LogLevel::Debug)) {
+        Crc32Checksum checksum;
+        ok = compress ? runChunkPipeline<IdentityFilter, DeflateCodec>(inFile, sink, checksum, level, chargeReads)
+                      : runChunkPipeline<IdentityFilter, InflateCodec>(inFile, sink, checksum, level, chargeReads);
+        logMessage(LogLevel::Debug, "crc32 of ", outputPath, ": ", checksum.crc);
+    } else {
+        NoChecksum checksum;
+        ok = compress ? runChunkPipeline<IdentityFilter, DeflateCodec>(inFile, sink, checksum, level, chargeReads)
+                      : runChunkPipeline<IdentityFilter, InflateCodec>(inFile, sink, checksum, level, chargeReads);
+    }
+
+    if (!ok || !outFile.flush()) {
+        // A partial output would pass for a complete one.
+        outFile.close();
+        error_code ec;
+        fs::remove(outputPath, ec);
+        logMessage(LogLevel::Error, "Error during compression/decompression: ", inputPath);
+        return false;
+    }
+
+    logMessage(LogLevel::Info, "Processed: ", inputPath, " -> ", outputPath);
+    return true;
+}
+
+const size_t smallFileLimit = 64 * 1024;
+
+// Compresses a file below smallFileLimit without the streaming loop: one read into a
+// per-thread buffer, one deflate call into a deflateBound-sized buffer and one write,
+// on the thread's reused deflate stream. The output matches the streaming path byte
+// for byte. Returns false, having written nothing, when the streaming path should take
+// the file instead: it grew past its stat size or could not be read. Otherwise `ok`
+// tells whether the output was written.
+bool compressSmallFile(const string& inputPath, const string& outputPath, size_t size, int level, bool& ok) {
+    struct SmallFileState {
+        vector<char> input = vector<char>(smallFileLimit + 1);
+        vector<char> output;
+        DeflateContextCache contexts;
+    };
+    thread_local SmallFileState state;
+
+    int inFd = ::open(inputPath.c_str(), O_RDONLY);
+    if (inFd < 0) {
+        logMessage(LogLevel::Error, "Error opening input file: ", inputPath);
+        ok = false;
+        return true;
+    }
+    // Asking for one byte more than stat reported returns the whole file in one call
+    // and tells a grown file apart.
+    size_t filled = 0;
+    ssize_t got;
+    do {
+        got = ::read(inFd, state.input.data() + filled, size + 1 - filled);
+        if (got > 0) filled += static_cast<size_t>(got);
+    } while (got > 0 && filled < size);
+    close(inFd);
+    if (got < 0 || filled > size) return false;
+    ioThrottle.onRead(filled);
+
+    z_stream* zs = state.contexts.acquire(level);
+    if (!zs) {
+        logMessage(LogLevel::Error, "Error during compression/decompression");
+        ok = false;
+        return true;
+    }
+    state.output.resize(deflateBound(zs, static_cast<uLong>(filled)));
+    zs->next_in = reinterpret_cast<Bytef*>(state.input.data());
+    zs->avail_in = static_cast<uInt>(filled);
+    zs->next_out = reinterpret_cast<Bytef*>(state.output.data());
+    zs->avail_out = static_cast<uInt>(state.output.size());
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        logMessage(LogLevel::Error, "Error during compression/decompression");
+        ok = false;
+        return true;
+    }
+    size_t produced = state.output.size() - zs->avail_out;
+
+    int outFd = ::open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (outFd < 0) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        ok = false;
+        return true;
+    }
+    ioThrottle.onWrite(produced);
+    size_t written = 0;
+    while (written < produced) {
+        ssize_t n = ::write(outFd, state.output.data() + written, produced - written);
+        if (n <= 0) break;
+        written += static_cast<size_t>(n);
+    }
+    close(outFd);
+    if (written < produced) {
+        unlink(outputPath.c_str());
+        logMessage(LogLevel::Error, "Error writing output file: ", outputPath);
+        ok = false;
+        return true;
+    }
+
+    if (logger.enabled(LogLevel::Debug)) {
+        Crc32Checksum checksum;
+        checksum.update(state.output.data(), produced);
+        logMessage(LogLevel::Debug, "crc32 of ", outputPath, ": ", checksum.crc);
+    }
+    logMessage(LogLevel::Info, "Processed: ", inputPath, " -> ", outputPath);
+    ok = true;
+    return true;
+}
+
+bool processFile(const string& inputPath, const string& outputPath, bool compress, int level = Z_DEFAULT_COMPRESSION) {
+    struct stat st;
+    bool ok;
+    if (compress && settings.smallFileFastPath && stat(inputPath.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+        static_cast<size_t>(st.st_size) < smallFileLimit &&
+        compressSmallFile(inputPath, outputPath, static_cast<size_t>(st.st_size), level, ok)) {
+        return ok;
+    }
+
+    ifstream inFile(inputPath, ios::binary);
+    if (!inFile) {
+        logMessage(LogLevel::Error, "Error opening input file: ", inputPath);
+        return false;
+    }
+    return processStream(inFile, inputPath, outputPath, compress, level);
+}
+
+struct ChunkStats {
+    double entropy = 0;        // bits per byte over the sampled windows
+    double runFraction = 0;    // bytes equal to their predecessor
+    double matchDensity = 0;   // sampled 4-byte sequences already seen nearby
+};
+
+struct DeflateChoice {
+    int strategy;
+    int memLevel;
+};
+
+ChunkStats analyzeChunk(const char* data, size_t size) {
+    ChunkStats stats;
+    if (size == 0) return stats;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+
+    if (simd.isAllZero(bytes, size)) {
+        stats.runFraction = 1.0;
+        return stats;
+    }
+    stats.runFraction = static_cast<double>(simd.countRepeatedBytes(bytes, size)) / size;
+
+    const size_t window = 512;
+    const size_t stride = size <= 64 * 1024 ? window : 8 * 1024;
+    uint32_t histogram[4][256] = {};
+    vector<uint32_t> seen(4096, 0);
+    size_t sampled = 0, probes = 0, matches = 0;
+
+    for (size_t start = 0; start < size; start += stride) {
+        size_t end = min(size, start + window);
+        size_t i = start;
+        for (; i + 4 <= end; i += 4) {
+            histogram[0][bytes[i]]++;
+            histogram[1][bytes[i + 1]]++;
+            histogram[2][bytes[i + 2]]++;
+            histogram[3][bytes[i + 3]]++;
+        }
+        for (; i < end; ++i) {
+            histogram[0][bytes[i]]++;
+        }
+        sampled += end - start;
+
+        for (size_t j = start; j + 4 <= end; j += 2) {
+            uint32_t gram;
+            memcpy(&gram, bytes + j, 4);
+            uint32_t slot = (gram * 2654435761u) >> 20;
+            matches += seen[slot] == gram;
+            seen[slot] = gram;
+            probes++;
+        }
+    }
+
+    for (int b = 0; b < 256; ++b) {
+        uint32_t n = histogram[0][b] + histogram[1][b] + histogram[2][b] + histogram[3][b];
+        if (n == 0) continue;
+        double p = static_cast<double>(n) / sampled;
+        stats.entropy -= p * log2(p);
+    }
+    stats.matchDensity = probes ? static_cast<double>(matches) / probes : 0;
+    return stats;
+}
+
+DeflateChoice chooseStrategy(const ChunkStats& stats) {
+    if (stats.runFraction > 0.6) {
+        return {Z_RLE, 8};
+    }
+    if (stats.entropy > 7.2 && stats.matchDensity < 0.05) {
+        return {Z_HUFFMAN_ONLY, 8};
+    }
+    if (stats.entropy < 6.0 && stats.matchDensity < 0.3) {
+        return {Z_FILTERED, 8};
+    }
+    return {Z_DEFAULT_STRATEGY, stats.matchDensity > 0.5 ? 9 : 8};
+}
+
+const char* strategyName(int strategy) {
+    switch (strategy) {
+        case Z_FILTERED: return "filtered";
+        case Z_HUFFMAN_ONLY: return "huffman";
+        case Z_RLE: return "rle";
+        case Z_FIXED: return "fixed";
+        default: return "default";
+    }
+}
+
+array<atomic<size_t>, 5> strategyMix;
+
+const size_t deflateWindowSize = 32768;
+
+enum BlockEntryMode : uint8_t {
+    independentBlock = 0,   // raw deflate that needs no history (block-mode archives)
+    windowCheckpoint = 1,   // mid-stream block boundary, resumed with a saved 32 KB window
+    streamStart = 2         // start of a zlib stream or gzip member, header included
+};
+
+struct BlockIndexEntry {
+    uint64_t compressedOffset;
+    uint64_t uncompressedOffset;
+    uint32_t compressedSize;
+    uint32_t uncompressedSize;
+    uint8_t strategy;
+    uint8_t mode = independentBlock;
+    uint8_t bits = 0;                // bits of the first byte already consumed by the previous block
+    vector<uint8_t> window;          // deflate-compressed 32 KB history for windowCheckpoint
+    vector<uint8_t> tokenFilter;     // Bloom filter of the block's tokens, empty when the block must be read
+    int64_t minTime = INT64_MAX;     // range of timestamps (ms) of lines starting in the block,
+    int64_t maxTime = INT64_MIN;     // empty when minTime > maxTime
+};
+
+struct BlockIndex {
+    uint64_t totalIn = 0;
+    uint64_t totalOut = 0;
+    vector<BlockIndexEntry> blocks;
+};
+
+const char blockIndexMagic[4] = {'C', 'T', 'B', 'I'};
+const uint32_t blockIndexVersion = 4;
+
+template<typename T>
+void writeRaw(ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+bool readRaw(istream& in, T& value) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+bool writeBlockIndex(const string& path, const BlockIndex& index) {
+    ofstream out(path, ios::binary);
+    if (!out) return false;
+    out.write(blockIndexMagic, sizeof(blockIndexMagic));
+    writeRaw(out, blockIndexVersion);
+    writeRaw(out, index.totalIn);
+    writeRaw(out, index.totalOut);
+    writeRaw(out, static_cast<uint64_t>(index.blocks.size()));
+    for (const auto& block : index.blocks) {
+        writeRaw(out, block.compressedOffset);
+        writeRaw(out, block.uncompressedOffset);
+        writeRaw(out, block.compressedSize);
+        writeRaw(out, block.uncompressedSize);
+        writeRaw(out, block.strategy);
+        writeRaw(out, block.mode);
+        writeRaw(out, block.bits);
+        writeRaw(out, static_cast<uint32_t>(block.window.size()));
+        out.write(reinterpret_cast<const char*>(block.window.data()), block.window.size());
+        writeRaw(out, static_cast<uint32_t>(block.tokenFilter.size()));
+        out.write(reinterpret_cast<const char*>(block.tokenFilter.data()), block.tokenFilter.size());
+        writeRaw(out, block.minTime);
+        writeRaw(out, block.maxTime);
+    }
+    out.close();
+    return !out.fail();
+}
+
+bool readBlockIndex(const string& path, BlockIndex& index) {
+    ifstream in(path, ios::binary);
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, blockIndexMagic, sizeof(magic)) != 0) return false;
+    if (!readRaw(in, version) || version < 1 || version > blockIndexVersion) return false;
+    if (!readRaw(in, index.totalIn) || !readRaw(in, index.totalOut) || !readRaw(in, count)) return false;
+
+    index.blocks.resize(count);
+    for (auto& block : index.blocks) {
+        if (!readRaw(in, block.compressedOffset) || !readRaw(in, block.uncompressedOffset) ||
+            !readRaw(in, block.compressedSize) || !readRaw(in, block.uncompressedSize) ||
+            !readRaw(in, block.strategy)) {
+            return false;
+        }
+        if (version < 2) continue;
+
+        uint32_t windowSize;
+        if (!readRaw(in, block.mode) || !readRaw(in, block.bits) || !readRaw(in, windowSize) || windowSize > 65536) {
+            return false;
+        }
+        block.window.resize(windowSize);
+        if (!in.read(reinterpret_cast<char*>(block.window.data()), windowSize)) return false;
+        if (version < 3) continue;
+
+        uint32_t filterSize;
+        if (!readRaw(in, filterSize) || filterSize > (1u << 24)) return false;
+        block.tokenFilter.resize(filterSize);
+        if (!in.read(reinterpret_cast<char*>(block.tokenFilter.data()), filterSize)) return false;
+        if (version < 4) continue;
+
+        if (!readRaw(in, block.minTime) || !readRaw(in, block.maxTime)) return false;
+    }
+    return true;
+}
+
+string blockIndexPath(const string& archivePath) {
+    return archivePath + ".idx";
+}
+
+// GF(2^8) over the 0x11d polynomial, as used by most Reed-Solomon erasure codes.
+struct GaloisTables {
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    GaloisTables() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; ++i) {
+            exp[i] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;
+        }
+        for (int i = 255; i < 512; ++i) exp[i] = exp[i - 255];
+        log[0] = 0;
+    }
+};
+
+const GaloisTables& galois() {
+    static const GaloisTables tables;
+    return tables;
+}
+
+uint8_t gfMul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    const GaloisTables& gf = galois();
+    return gf.exp[gf.log[a] + gf.log[b]];
+}
+
+uint8_t gfInverse(uint8_t a) {
+    const GaloisTables& gf = galois();
+    return gf.exp[255 - gf.log[a]];
+}
+
+// Products of c with every low and high nibble, the table layout simd.gfMulAdd takes.
+array<uint8_t, 32> gfNibbleTable(uint8_t c) {
+    array<uint8_t, 32> table;
+    for (int x = 0; x < 16; ++x) {
+        table[x] = gfMul(c, static_cast<uint8_t>(x));
+        table[16 + x] = gfMul(c, static_cast<uint8_t>(x << 4));
+    }
+    return table;
+}
+
+// Systematic Reed-Solomon code over fixed-size shards. Parity row i is the sum of
+// data shards weighted by a Cauchy matrix, 1 / (x_i + y_j), every square submatrix of
+// which is invertible, so any parityShards lost shards of a group can be rebuilt.
+struct ParityCode {
+    uint32_t shardSize;
+    uint32_t dataShards;
+    uint32_t parityShards;
+    vector<uint8_t> matrix;                 // parityShards x dataShards coefficients
+    vector<array<uint8_t, 32>> tables;      // nibble tables for the same coefficients
+
+    ParityCode(uint32_t shardSize, uint32_t dataShards, uint32_t parityShards)
+        : shardSize(shardSize), dataShards(dataShards), parityShards(parityShards) {
+        for (uint32_t i = 0; i < parityShards; ++i) {
+            for (uint32_t j = 0; j < dataShards; ++j) {
+                matrix.push_back(gfInverse(static_cast<uint8_t>((dataShards + i) ^ j)));
+                tables.push_back(gfNibbleTable(matrix.back()));
+            }
+        }
+    }
+
+    uint8_t coefficient(uint32_t row, uint32_t column) const { return matrix[row * dataShards + column]; }
+
+    // Fills the parity shards of one group and the crc32 of every data and parity shard.
+    void encode(const uint8_t* data, uint8_t* parity, uint32_t* crcs) const {
+        memset(parity, 0, static_cast<size_t>(parityShards) * shardSize);
+        for (uint32_t i = 0; i < parityShards; ++i) {
+            for (uint32_t j = 0; j < dataShards; ++j) {
+                simd.gfMulAdd(tables[i * dataShards + j].data(), data + static_cast<size_t>(j) * shardSize,
+                              parity + static_cast<size_t>(i) * shardSize, shardSize);
+            }
+        }
+        for (uint32_t s = 0; s < dataShards + parityShards; ++s) {
+            const uint8_t* shard = s < dataShards ? data + static_cast<size_t>(s) * shardSize
+                                                  : parity + static_cast<size_t>(s - dataShards) * shardSize;
+            crcs[s] = static_cast<uint32_t>(crc32(crc32(0L, Z_NULL, 0), shard, shardSize));
+        }
+    }
+};
+
+// Parity sidecar (.par): the archive is cut into shardSize shards, zero-padded at the
+// end, and each group of dataShards shards is followed in the sidecar by the crc32 of
+// its data and parity shards and then the parity shards themselves.
+const char parityMagic[4] = {'C', 'T', 'R', 'S'};
+const uint32_t parityVersion = 1;
+const uint32_t parityShardSize = 64 * 1024;
+const uint32_t parityDataShards = 16;
+const uint64_t parityHeaderSize = 28;
+
+string parityPath(const string& archivePath) {
+    return archivePath + ".par";
+}
+
+// Computes parity while an archive is written: bytes are gathered into groups, and
+// batches of groups are encoded in parallel and appended to the sidecar in order.
+class ParityWriter {
+public:
+    ParityWriter(const string& path, uint32_t parityShards, int numThreads)
+        : out(path, ios::binary), code(parityShardSize, parityDataShards, parityShards), numThreads(numThreads),
+          groups(static_cast<size_t>(max(1, numThreads)) * 2) {
+        out.write(parityMagic, sizeof(parityMagic));
+        writeRaw(out, parityVersion);
+        writeRaw(out, code.shardSize);
+        writeRaw(out, code.dataShards);
+        writeRaw(out, code.parityShards);
+        writeRaw(out, archiveSize);
+    }
+
+    void append(const char* data, size_t size) {
+        const size_t groupBytes = static_cast<size_t>(code.shardSize) * code.dataShards;
+        archiveSize += size;
+        while (size > 0) {
+            Group& group = groups[filled];
+            if (group.data.size() != groupBytes) group.data.resize(groupBytes);
+            size_t n = min(size, groupBytes - groupPos);
+            memcpy(group.data.data() + groupPos, data, n);
+            groupPos += n;
+            data += n;
+            size -= n;
+            if (groupPos == groupBytes) {
+                groupPos = 0;
+                if (++filled == groups.size()) encodeBatch();
+            }
+        }
+    }
+
+    bool finish() {
+        if (groupPos > 0) {
+            Group& group = groups[filled];
+            fill(group.data.begin() + static_cast<ptrdiff_t>(groupPos), group.data.end(), 0);
+            groupPos = 0;
+            filled++;
+        }
+        encodeBatch();
+        out.seekp(static_cast<streamoff>(parityHeaderSize - sizeof(archiveSize)));
+        writeRaw(out, archiveSize);
+        out.flush();
+        return static_cast<bool>(out);
+    }
+
+private:
+    struct Group {
+        vector<uint8_t> data;
+        vector<uint8_t> parity;
+        vector<uint32_t> crcs;
+    };
+
+    void encodeBatch() {
+        parallelFor(filled, numThreads, [&](size_t g, int) {
+            Group& group = groups[g];
+            group.parity.resize(static_cast<size_t>(code.shardSize) * code.parityShards);
+            group.crcs.resize(code.dataShards + code.parityShards);
+            code.encode(group.data.data(), group.parity.data(), group.crcs.data());
+        });
+        for (size_t g = 0; g < filled; ++g) {
+            out.write(reinterpret_cast<const char*>(groups[g].crcs.data()), groups[g].crcs.size() * sizeof(uint32_t));
+            out.write(reinterpret_cast<const char*>(groups[g].parity.data()), groups[g].parity.size());
+        }
+        filled = 0;
+    }
+
+    ofstream out;
+    ParityCode code;
+    int numThreads;
+    vector<Group> groups;
+    size_t filled = 0;
+    size_t groupPos = 0;
+    uint64_t archiveSize = 0;
+};
+
+// Writes a parity sidecar for an existing archive.
+bool createArchiveParity(const string& archivePath, uint32_t parityShards, int numThreads) {
+    ifstream in(archivePath, ios::binary);
+    if (!in) {
+        logMessage(LogLevel::Error, "Error opening input file: ", archivePath);
+        return false;
+    }
+    ParityWriter parity(parityPath(archivePath), parityShards, numThreads);
+    vector<char> buffer(4 * 1024 * 1024);
+    while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
+        ioThrottle.onRead(static_cast<size_t>(in.gcount()));
+        parity.append(buffer.data(), static_cast<size_t>(in.gcount()));
+    }
+    if (in.bad() || !parity.finish()) {
+        logMessage(LogLevel::Error, "Error writing output file: ", parityPath(archivePath));
+        return false;
+    }
+    logMessage(LogLevel::Info, "Parity written: ", parityPath(archivePath));
+    return true;
+}
+
+// Inverts a square matrix over GF(2^8) in place by Gauss-Jordan elimination.
+bool gfInvertMatrix(vector<uint8_t>& m, size_t n) {
+    vector<uint8_t> inverse(n * n, 0);
+    for (size_t i = 0; i < n; ++i) inverse[i * n + i] = 1;
+    for (size_t col = 0; col < n; ++col) {
+        size_t pivot = col;
+        while (pivot < n && m[pivot * n + col] == 0) pivot++;
+        if (pivot == n) return false;
+        for (size_t k = 0; k < n; ++k) {
+            swap(m[col * n + k], m[pivot * n + k]);
+            swap(inverse[col * n + k], inverse[pivot * n + k]);
+        }
+        uint8_t scale = gfInverse(m[col * n + col]);
+        for (size_t k = 0; k < n; ++k) {
+            m[col * n + k] = gfMul(m[col * n + k], scale);
+            inverse[col * n + k] = gfMul(inverse[col * n + k], scale);
+        }
+        for (size_t row = 0; row < n; ++row) {
+            uint8_t factor = m[row * n + col];
+            if (row == col || factor == 0) continue;
+            for (size_t k = 0; k < n; ++k) {
+                m[row * n + k] ^= gfMul(factor, m[col * n + k]);
+                inverse[row * n + k] ^= gfMul(factor, inverse[col * n + k]);
+            }
+        }
+    }
+    m = move(inverse);
+    return true;
+}
+
+struct ParityReport {
+    uint64_t groups = 0;
+    uint64_t damagedShards = 0;       // data or parity shards whose crc32 did not match
+    uint64_t repairedShards = 0;
+    uint64_t unrecoverableGroups = 0;
+};
+
+// Checks every shard of the archive and its sidecar against the stored crc32s and
+// rebuilds damaged ones in place, one group per worker. A group is recoverable while
+// no more of its shards are damaged than it has parity shards.
+bool repairArchive(const string& archivePath, int numThreads, ParityReport& report) {
+    int parityFd = open(parityPath(archivePath).c_str(), O_RDWR);
+    int archiveFd = open(archivePath.c_str(), O_RDWR);
+    if (parityFd < 0 || archiveFd < 0) {
+        logMessage(LogLevel::Error, "Error opening input file: ", parityFd < 0 ? parityPath(archivePath) : archivePath);
+        if (parityFd >= 0) close(parityFd);
+        if (archiveFd >= 0) close(archiveFd);
+        return false;
+    }
+
+    char header[parityHeaderSize];
+    uint32_t version, shardSize, dataShards, parityShards;
+    uint64_t archiveSize;
+    bool headerOk = pread(parityFd, header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) &&
+                    memcmp(header, parityMagic, sizeof(parityMagic)) == 0;
+    if (headerOk) {
+        memcpy(&version, header + 4, 4);
+        memcpy(&shardSize, header + 8, 4);
+        memcpy(&dataShards, header + 12, 4);
+        memcpy(&parityShards, header + 16, 4);
+        memcpy(&archiveSize, header + 20, 8);
+        headerOk = version == parityVersion && shardSize > 0 && dataShards > 0 && parityShards > 0 &&
+                   dataShards + parityShards <= 256;
+    }
+    if (!headerOk) {
+        logMessage(LogLevel::Error, "Not a parity file: ", parityPath(archivePath));
+        close(parityFd);
+        close(archiveFd);
+        return false;
+    }
+
+    ParityCode code(shardSize, dataShards, parityShards);
+    const uint32_t totalShards = dataShards + parityShards;
+    const size_t groupBytes = static_cast<size_t>(shardSize) * dataShards;
+    const uint64_t groupCount = (archiveSize + groupBytes - 1) / groupBytes;
+    const uint64_t recordSize = totalShards * sizeof(uint32_t) + static_cast<uint64_t>(parityShards) * shardSize;
+    report.groups = groupCount;
+
+    struct Scratch {
+        vector<uint8_t> shards;     // data shards followed by parity shards
+        vector<uint8_t> rebuilt;
+        vector<uint32_t> stored;
+        vector<uint32_t> actual;
+    };
+    vector<Scratch> scratch(max(1, numThreads));
+    atomic<uint64_t> damaged{0}, repaired{0}, unrecoverable{0};
+    atomic<bool> ioFailed{false};
+
+    parallelFor(groupCount, numThreads, [&](size_t g, int workerId) {
+        Scratch& s = scratch[workerId];
+        s.shards.assign(static_cast<size_t>(totalShards) * shardSize, 0);
+        s.stored.resize(totalShards);
+        s.actual.resize(totalShards);
+        uint8_t* data = s.shards.data();
+        uint8_t* parity = data + groupBytes;
+
+        const uint64_t groupOffset = g * groupBytes;
+        size_t groupLength = static_cast<size_t>(min<uint64_t>(groupBytes, archiveSize - groupOffset));
+        ssize_t got = pread(archiveFd, data, groupLength, static_cast<off_t>(groupOffset));
+        if (got > 0) ioThrottle.onRead(static_cast<size_t>(got));
+        const uint64_t recordOffset = parityHeaderSize + g * recordSize;
+        if (pread(parityFd, s.stored.data(), totalShards * sizeof(uint32_t), static_cast<off_t>(recordOffset)) !=
+                static_cast<ssize_t>(totalShards * sizeof(uint32_t)) ||
+            pread(parityFd, parity, static_cast<size_t>(parityShards) * shardSize,
+                  static_cast<off_t>(recordOffset + totalShards * sizeof(uint32_t))) < 0) {
+            ioFailed = true;
+            return;
+        }
+
+        vector<uint32_t> lost;
+        vector<uint32_t> intactParity;
+        for (uint32_t k = 0; k < totalShards; ++k) {
+            const uint8_t* shard = data + static_cast<size_t>(k) * shardSize;
+            s.actual[k] = static_cast<uint32_t>(crc32(crc32(0L, Z_NULL, 0), shard, shardSize));
+            if (s.actual[k] != s.stored[k]) {
+                lost.push_back(k);
+            } else if (k >= dataShards) {
+                intactParity.push_back(k - dataShards);
+            }
+        }
+        if (lost.empty()) return;
+        damaged += lost.size();
+        if (lost.size() > parityShards) {
+            unrecoverable++;
+            logMessage(LogLevel::Error, "Unrecoverable parity group ", g, ": ", lost.size(), " damaged shards");
+            return;
+        }
+
+        // Solve for the lost data shards from as many intact parity rows.
+        vector<uint32_t> lostData;
+        for (uint32_t k : lost) {
+            if (k < dataShards) lostData.push_back(k);
+        }
+        size_t n = lostData.size();
+        if (n > 0) {
+            vector<uint8_t> m(n * n);
+            for (size_t r = 0; r < n; ++r) {
+                for (size_t c = 0; c < n; ++c) m[r * n + c] = code.coefficient(intactParity[r], lostData[c]);
+            }
+            gfInvertMatrix(m, n);
+
+            // rhs_r = parity row minus the contribution of the intact data shards.
+            s.rebuilt.assign(n * shardSize, 0);
+            vector<uint8_t> rhs(n * shardSize);
+            for (size_t r = 0; r < n; ++r) {
+                uint8_t* row = rhs.data() + r * shardSize;
+                memcpy(row, parity + static_cast<size_t>(intactParity[r]) * shardSize, shardSize);
+                for (uint32_t j = 0; j < dataShards; ++j) {
+                    if (find(lostData.begin(), lostData.end(), j) != lostData.end()) continue;
+                    simd.gfMulAdd(code.tables[intactParity[r] * dataShards + j].data(),
+                                  data + static_cast<size_t>(j) * shardSize, row, shardSize);
+                }
+            }
+            for (size_t c = 0; c < n; ++c) {
+                uint8_t* out = data + static_cast<size_t>(lostData[c]) * shardSize;
+                memset(out, 0, shardSize);
+                for (size_t r = 0; r < n; ++r) {
+                    simd.gfMulAdd(gfNibbleTable(m[c * n + r]).data(), rhs.data() + r * shardSize, out, shardSize);
+                }
+                uint32_t crc = static_cast<uint32_t>(crc32(crc32(0L, Z_NULL, 0), out, shardSize));
+                if (crc != s.stored[lostData[c]]) {
+                    unrecoverable++;
+                    logMessage(LogLevel::Error, "Parity group ", g, " did not rebuild to its checksum");
+                    return;
+                }
+            }
+        }
+
+        // Rewrite repaired data, then re-encode so damaged parity shards are restored too.
+        for (uint32_t k : lostData) {
+            uint64_t offset = groupOffset + static_cast<uint64_t>(k) * shardSize;
+            if (offset >= archiveSize) continue;
+            size_t length = static_cast<size_t>(min<uint64_t>(shardSize, archiveSize - offset));
+            if (pwrite(archiveFd, data + static_cast<size_t>(k) * shardSize, length, static_cast<off_t>(offset)) !=
+                static_cast<ssize_t>(length)) {
+                ioFailed = true;
+                return;
+            }
+            ioThrottle.onWrite(length);
+        }
+        if (lostData.size() < lost.size()) {
+            code.encode(data, parity, s.actual.data());
+            if (pwrite(parityFd, parity, static_cast<size_t>(parityShards) * shardSize,
+                       static_cast<off_t>(recordOffset + totalShards * sizeof(uint32_t))) < 0) {
+                ioFailed = true;
+                return;
+            }
+        }
+        repaired += lost.size();
+    });
+
+    struct stat st;
+    if (!ioFailed && fstat(archiveFd, &st) == 0 && static_cast<uint64_t>(st.st_size) > archiveSize) {
+        // Bytes past the protected length are not part of the archive.
+        if (ftruncate(archiveFd, static_cast<off_t>(archiveSize)) != 0) ioFailed = true;
+    }
+    close(parityFd);
+    close(archiveFd);
+
+    report.damagedShards = damaged;
+    report.repairedShards = repaired;
+    report.unrecoverableGroups = unrecoverable;
+    if (ioFailed) {
+        logMessage(LogLevel::Error, "I/O error while repairing: ", archivePath);
+        return false;
+    }
+    return unrecoverable == 0;
+}
+
+bool isLogTokenChar(char c) {
+    return isalnum(static_cast<unsigned char>(c)) || c == '_';
+}
+
+// FNV-1a with a final avalanche; token filters are stored, so the hash must not
+// depend on the standard library.
+uint64_t tokenHash(const char* data, size_t size) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Calls f(hash) for every maximal run of token characters.
+template<typename Func>
+void forEachToken(const char* data, size_t size, Func f) {
+    size_t i = 0;
+    while (i < size) {
+        while (i < size && !isLogTokenChar(data[i])) i++;
+        size_t start = i;
+        while (i < size && isLogTokenChar(data[i])) i++;
+        if (i > start) f(tokenHash(data + start, i - start));
+    }
+}
+
+const int tokenFilterHashes = 7;
+
+// Bloom filter over a block's distinct tokens at about 10 bits each (1% false
+// positives): a power-of-two bit array probed by double hashing.
+vector<uint8_t> buildTokenFilter(const char* data, size_t size) {
+    vector<uint64_t> hashes;
+    forEachToken(data, size, [&](uint64_t h) { hashes.push_back(h); });
+    sort(hashes.begin(), hashes.end());
+    hashes.erase(unique(hashes.begin(), hashes.end()), hashes.end());
+
+    size_t bytes = 64;
+    while (bytes * 8 < hashes.size() * 10 && bytes < (1u << 24)) bytes *= 2;
+    vector<uint8_t> filter(bytes, 0);
+    const uint64_t mask = bytes * 8 - 1;
+    for (uint64_t h : hashes) {
+        uint64_t step = (h >> 32) | 1;
+        for (int k = 0; k < tokenFilterHashes; ++k) {
+            uint64_t bit = (h + k * step) & mask;
+            filter[bit >> 3] |= static_cast<uint8_t>(1u << (bit & 7));
+        }
+    }
+    return filter;
+}
+
+bool tokenFilterMayContain(const vector<uint8_t>& filter, uint64_t h) {
+    if (filter.empty()) return true;
+    const uint64_t mask = filter.size() * 8 - 1;
+    uint64_t step = (h >> 32) | 1;
+    for (int k = 0; k < tokenFilterHashes; ++k) {
+        uint64_t bit = (h + k * step) & mask;
+        if (!(filter[bit >> 3] & (1u << (bit & 7)))) return false;
+    }
+    return true;
+}
+
+int64_t daysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = static_cast<unsigned>(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+void civilFromDays(int64_t z, int64_t& y, unsigned& m, unsigned& d) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = static_cast<unsigned>(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = static_cast<int64_t>(yoe) + era * 400 + (m <= 2);
+}
+
+// Parses a timestamp at the start of `s` in ISO 8601 / RFC 3339 form
+// ("2024-03-01T14:05:09.123+01:00", space or T, zone optional) or common log
+// format ("01/Mar/2024:14:05:09 +0100"), as milliseconds since the epoch. Times
+// without a zone ("Z" included) are taken as UTC, so they compare consistently.
+bool parseTimestampAt(const char* s, size_t size, int64_t& millis) {
+    size_t pos = 0;
+    auto number = [&](int digits, int& value) {
+        if (pos + digits > size) return false;
+        value = 0;
+        for (int i = 0; i < digits; ++i) {
+            char c = s[pos + i];
+            if (c < '0' || c > '9') return false;
+            value = value * 10 + (c - '0');
+        }
+        pos += digits;
+        return true;
+    };
+    auto literal = [&](char c) { return pos < size && s[pos] == c ? (pos++, true) : false; };
+
+    int year, month, day, hour, minute, second;
+    bool clf = false;
+    if (number(4, year)) {
+        char sep = pos < size ? s[pos] : 0;
+        if ((sep != '-' && sep != '/') || !literal(sep) || !number(2, month) || !literal(sep) || !number(2, day)) {
+            return false;
+        }
+        if (!literal('T') && !literal(' ')) return false;
+    } else {
+        static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        pos = 0;
+        if (!number(2, day) || !literal('/') || pos + 4 > size) return false;
+        const char* found = search(months, months + 36, s + pos, s + pos + 3);
+        if (found == months + 36 || (found - months) % 3 != 0) return false;
+        month = static_cast<int>(found - months) / 3 + 1;
+        pos += 3;
+        if (!literal('/') || !number(4, year) || !literal(':')) return false;
+        clf = true;
+    }
+    if (!number(2, hour) || !literal(':') || !number(2, minute) || !literal(':') || !number(2, second)) return false;
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) return false;
+
+    int fraction = 0;
+    if (!clf && (literal('.') || literal(','))) {
+        int digits = 0;
+        while (pos < size && s[pos] >= '0' && s[pos] <= '9') {
+            if (digits++ < 3) fraction = fraction * 10 + (s[pos] - '0');
+            pos++;
+        }
+        if (digits == 0) return false;
+        for (; digits < 3; ++digits) fraction *= 10;
+    }
+
+    int offsetMinutes = 0;
+    size_t zone = pos < size && s[pos] == ' ' ? pos + 1 : pos;
+    if (zone < size && (s[zone] == '+' || s[zone] == '-')) {
+        int sign = s[zone] == '-' ? -1 : 1;
+        int zoneHours, zoneMinutes;
+        pos = zone + 1;
+        if (number(2, zoneHours) && (literal(':'), number(2, zoneMinutes))) {
+            offsetMinutes = sign * (zoneHours * 60 + zoneMinutes);
+        }
+    }
+
+    int64_t seconds = daysFromCivil(year, static_cast<unsigned>(month), static_cast<unsigned>(day)) * 86400 +
+                      hour * 3600 + minute * 60 + second - offsetMinutes * 60;
+    millis = seconds * 1000 + fraction;
+    return true;
+}
+
+// Finds the first timestamp within the head of a log line. Candidates start at the
+// beginning of a digit run, which skips prefixes such as levels, hosts or "[".
+bool parseLineTimestamp(const char* line, size_t size, int64_t& millis) {
+    const size_t scan = min<size_t>(size, 64);
+    for (size_t i = 0; i < scan; ++i) {
+        if (line[i] < '0' || line[i] > '9' || (i > 0 && line[i - 1] >= '0' && line[i - 1] <= '9')) continue;
+        if (parseTimestampAt(line + i, size - i, millis)) return true;
+    }
+    return false;
+}
+
+// Range of line timestamps in a block of whole lines. The first line is reported
+// separately, since it is only a line of its own when the block starts one.
+struct TimeRange {
+    int64_t minTime = INT64_MAX;
+    int64_t maxTime = INT64_MIN;
+
+    bool empty() const { return minTime > maxTime; }
+    void add(int64_t t) {
+        minTime = min(minTime, t);
+        maxTime = max(maxTime, t);
+    }
+    void add(const TimeRange& other) {
+        minTime = min(minTime, other.minTime);
+        maxTime = max(maxTime, other.maxTime);
+    }
+    bool overlaps(int64_t from, int64_t to) const { return !empty() && minTime < to && maxTime >= from; }
+};
+
+void scanBlockTimes(const char* data, size_t size, TimeRange& firstLine, TimeRange& rest) {
+    for (size_t pos = 0; pos < size;) {
+        const char* end = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+        size_t length = end ? static_cast<size_t>(end - (data + pos)) : size - pos;
+        int64_t t;
+        if (parseLineTimestamp(data + pos, length, t)) (pos == 0 ? firstLine : rest).add(t);
+        pos += length + 1;
+    }
+}
+
+void writeZlibHeader(ostream& out, int level) {
+    int headerLevel = level == Z_DEFAULT_COMPRESSION ? 6 : level;
+    unsigned char cmf = 0x78;
+    unsigned char flg = (headerLevel < 2 ? 0 : headerLevel < 6 ? 1 : headerLevel == 6 ? 2 : 3) << 6;
+    flg += 31 - (cmf * 256 + flg) % 31;
+    out.put(static_cast<char>(cmf));
+    out.put(static_cast<char>(flg));
+}
+
+// Compresses one raw deflate block that needs no history, ending on a byte boundary
+// (or with the final-block bit set when last).
+bool deflateIndependentBlock(DeflateContextCache& contexts, int level, const char* input, size_t inputSize, bool last,
+                             vector<char>& output, int& strategy) {
+    DeflateChoice choice = {Z_DEFAULT_STRATEGY, 8};
+    if (settings.autoStrategy) {
+        choice = chooseStrategy(analyzeChunk(input, inputSize));
+    }
+    strategy = choice.strategy;
+
+    z_stream* zs = contexts.acquire(level, -MAX_WBITS, choice.memLevel, choice.strategy);
+    if (!zs) return false;
+
+    output.resize(deflateBound(zs, static_cast<uLong>(inputSize)) + 16);
+    zs->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input));
+    zs->avail_in = static_cast<uInt>(inputSize);
+    zs->next_out = reinterpret_cast<Bytef*>(output.data());
+    zs->avail_out = static_cast<uInt>(output.size());
+    int ret = deflate(zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+    output.resize(output.size() - zs->avail_out);
+    return last ? ret == Z_STREAM_END : (ret == Z_OK && zs->avail_in == 0);
+}
+
+// Each block is an independent raw deflate stream ending on a byte boundary, so the
+// concatenation is one valid zlib stream and every block can be inflated on its own.
+bool compressFileBlocks(const string& inputPath, const string& outputPath, int level, int numThreads) {
+    ifstream inFile(inputPath, ios::binary);
+    if (!inFile) {
+        logMessage(LogLevel::Error, "Error opening input file: ", inputPath);
+        return false;
+    }
+
+    ofstream outFile(outputPath, ios::binary);
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return false;
+    }
+
+    // Everything written to the archive also feeds the parity sidecar when one is enabled.
+    unique_ptr<ParityWriter> parity;
+    if (settings.parityShards > 0) {
+        parity = make_unique<ParityWriter>(parityPath(outputPath), settings.parityShards, numThreads);
+    }
+    auto emit = [&](const char* data, size_t size) {
+        outFile.write(data, size);
+        if (parity) parity->append(data, size);
+    };
+    // A partial archive, or one next to a stale index, would pass for a complete one.
+    auto fail = [&](const char* reason, const string& path) {
+        outFile.close();
+        parity.reset();
+        error_code ec;
+        fs::remove(outputPath, ec);
+        fs::remove(blockIndexPath(outputPath), ec);
+        fs::remove(parityPath(outputPath), ec);
+        logMessage(LogLevel::Error, reason, path);
+        return false;
+    };
+
+    ostringstream zlibHeader;
+    writeZlibHeader(zlibHeader, level);
+    emit(zlibHeader.str().data(), zlibHeader.str().size());
+
+    struct Block {
+        vector<char> input;
+        vector<char> output;
+        vector<uint8_t> tokenFilter;
+        TimeRange firstLineTime;
+        TimeRange time;
+        uLong adler;
+        int strategy;
+        bool last;
+        bool ok;
+    };
+
+    const size_t blockSize = settings.blockSize;
+    const size_t batchBlocks = static_cast<size_t>(max(1, numThreads)) * 4;
+    vector<Block> batch(batchBlocks);
+    vector<DeflateContextCache> contexts(max(1, numThreads));
+
+    // Token filters and time ranges need whole lines per block: blocks are cut after
+    // their last newline and the rest of the line starts the next block.
+    const bool lineAligned = settings.tokenFilters || settings.timeIndex;
+    vector<char> carry;
+    bool blockStartsLine = true;
+
+    BlockIndex index;
+    uLong adler = adler32(0L, Z_NULL, 0);
+    uint64_t compressedOffset = 2;
+    bool done = false;
+
+    while (!done) {
+        size_t filled = 0;
+        while (filled < batchBlocks && !done) {
+            Block& block = batch[filled];
+            block.input.resize(blockSize);
+            size_t carried = carry.size();
+            memcpy(block.input.data(), carry.data(), carried);
+            carry.clear();
+            inFile.read(block.input.data() + carried, static_cast<streamsize>(blockSize - carried));
+            ioThrottle.onRead(static_cast<size_t>(inFile.gcount()));
+            block.input.resize(carried + static_cast<size_t>(inFile.gcount()));
+            done = inFile.peek() == ifstream::traits_type::eof();
+            if (lineAligned && !done) {
+                auto lineEnd = find(block.input.rbegin(), block.input.rend(), '\n');
+                if (lineEnd != block.input.rend()) {
+                    carry.assign(lineEnd.base(), block.input.end());
+                    block.input.erase(lineEnd.base(), block.input.end());
+                }
+            }
+            block.last = done;
+            if (!block.input.empty() || done) filled++;
+        }
+
+        parallelFor(filled, numThreads, [&](size_t i, int workerId) {
+            Block& block = batch[i];
+            block.adler = adler32(adler32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(block.input.data()),
+                                  static_cast<uInt>(block.input.size()));
+            block.ok = deflateIndependentBlock(contexts[workerId], level, block.input.data(), block.input.size(),
+                                               block.last, block.output, block.strategy);
+            if (settings.tokenFilters) block.tokenFilter = buildTokenFilter(block.input.data(), block.input.size());
+            block.firstLineTime = block.time = TimeRange();
+            if (settings.timeIndex) {
+                scanBlockTimes(block.input.data(), block.input.size(), block.firstLineTime, block.time);
+            }
+        });
+
+        for (size_t i = 0; i < filled; ++i) {
+            Block& block = batch[i];
+            if (!block.ok) return fail("Error during compression/decompression: ", inputPath);
+            ioThrottle.onWrite(block.output.size());
+            emit(block.output.data(), block.output.size());
+            adler = adler32_combine(adler, block.adler, static_cast<z_off_t>(block.input.size()));
+
+            BlockIndexEntry entry;
+            entry.compressedOffset = compressedOffset;
+            entry.uncompressedOffset = index.totalIn;
+            entry.compressedSize = static_cast<uint32_t>(block.output.size());
+            entry.uncompressedSize = static_cast<uint32_t>(block.input.size());
+            entry.strategy = static_cast<uint8_t>(block.strategy);
+            // A line longer than a block straddles the boundary, so neither side can be skipped.
+            if (blockStartsLine) {
+                entry.tokenFilter = move(block.tokenFilter);
+                block.time.add(block.firstLineTime);
+            } else if (!index.blocks.empty()) {
+                index.blocks.back().tokenFilter.clear();
+            }
+            entry.minTime = block.time.minTime;
+            entry.maxTime = block.time.maxTime;
+            blockStartsLine = block.input.empty() || block.input.back() == '\n';
+            index.blocks.push_back(move(entry));
+            strategyMix[block.strategy]++;
+
+            compressedOffset += block.output.size();
+            index.totalIn += block.input.size();
+        }
+    }
+
+    char trailer[4];
+    for (int i = 0; i < 4; ++i) {
+        trailer[i] = static_cast<char>((adler >> (24 - 8 * i)) & 0xff);
+    }
+    emit(trailer, sizeof(trailer));
+    index.totalOut = compressedOffset + 4;
+
+    if (!outFile.flush() || !writeBlockIndex(blockIndexPath(outputPath), index) || (parity && !parity->finish())) {
+        return fail("Error writing output file: ", outputPath);
+    }
+
+    logMessage(LogLevel::Info, "Processed: ", inputPath, " -> ", outputPath, " (", index.blocks.size(), " blocks)");
+    return true;
+}
+
+// Sharded LRU of decompressed blocks keyed by (archive, block); each shard has its own lock.
+class BlockCache {
+public:
+    using Block = shared_ptr<const vector<char>>;
+
+    explicit BlockCache(size_t budgetBytes) { setBudget(budgetBytes); }
+
+    void setBudget(size_t budgetBytes) {
+        shardBudget.store(budgetBytes / shardCount);
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard.m);
+            evictLocked(shard);
+        }
+    }
+
+    size_t budget() const { return shardBudget.load() * shardCount; }
+
+    template<typename Loader>
+    Block getOrLoad(const string& archive, uint64_t block, Loader load) {
+        string key = archive + '#' + to_string(block);
+        Shard& shard = shards[hash<string>()(key) % shardCount];
+        {
+            lock_guard<mutex> lock(shard.m);
+            auto it = shard.entries.find(key);
+            if (it != shard.entries.end()) {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+                hits.fetch_add(1, memory_order_relaxed);
+                return it->second->second;
+            }
+        }
+
+        misses.fetch_add(1, memory_order_relaxed);
+        Block data = load();
+        if (!data || data->size() > shardBudget.load()) return data;
+
+        lock_guard<mutex> lock(shard.m);
+        if (shard.entries.count(key)) return data;
+        shard.lru.emplace_front(key, data);
+        shard.entries[key] = shard.lru.begin();
+        shard.bytes += data->size();
+        evictLocked(shard);
+        return data;
+    }
+
+    void clear() {
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard.m);
+            shard.lru.clear();
+            shard.entries.clear();
+            shard.bytes = 0;
+        }
+    }
+
+    size_t cachedBytes() {
+        size_t total = 0;
+        for (auto& shard : shards) {
+            lock_guard<mutex> lock(shard.m);
+            total += shard.bytes;
+        }
+        return total;
+    }
+
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+    atomic<uint64_t> evictions{0};
+
+private:
+    static const size_t shardCount = 16;
+
+    struct Shard {
+        mutex m;
+        list<pair<string, Block>> lru;
+        unordered_map<string, list<pair<string, Block>>::iterator> entries;
+        size_t bytes = 0;
+    };
+
+    void evictLocked(Shard& shard) {
+        size_t limit = shardBudget.load();
+        while (shard.bytes > limit && !shard.lru.empty()) {
+            auto& victim = shard.lru.back();
+            shard.bytes -= victim.second->size();
+            shard.entries.erase(victim.first);
+            shard.lru.pop_back();
+            evictions.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    array<Shard, shardCount> shards;
+    atomic<size_t> shardBudget{0};
+};
+
+BlockCache blockCache(256 * 1024 * 1024);
+
+// Random access into a block-mode archive through its sidecar index.
+class IndexedArchive {
+public:
+    ~IndexedArchive() { close(); }
+
+    bool open(const string& archivePath) {
+        close();
+        path = archivePath;
+        if (!readBlockIndex(blockIndexPath(path), index)) return false;
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) return false;
+        // Cached blocks belong to this version of the file: recompressing, merging or
+        // repairing it in place changes the inode, size or mtime and so the key.
+        cacheKey = path + '#' + to_string(st.st_dev) + ':' + to_string(st.st_ino) + ':' + to_string(st.st_size) +
+                   ':' + to_string(st.st_mtim.tv_sec) + '.' + to_string(st.st_mtim.tv_nsec);
+        return true;
+    }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        index = BlockIndex();
+        cacheKey.clear();
+    }
+
+    const BlockIndex& blockIndex() const { return index; }
+    const string& archivePath() const { return path; }
+
+    size_t blockFor(uint64_t offset) const {
+        auto it = upper_bound(index.blocks.begin(), index.blocks.end(), offset,
+                              [](uint64_t value, const BlockIndexEntry& e) { return value < e.uncompressedOffset; });
+        return it == index.blocks.begin() ? 0 : static_cast<size_t>(it - index.blocks.begin() - 1);
+    }
+
+    BlockCache::Block readBlock(size_t block) const {
+        return blockCache.getOrLoad(cacheKey, block, [&]() { return inflateBlock(block); });
+    }
+
+private:
+    BlockCache::Block inflateBlock(size_t block) const {
+        const BlockIndexEntry& entry = index.blocks[block];
+        vector<char> compressed(entry.compressedSize);
+        ssize_t got = pread(fd, compressed.data(), compressed.size(), static_cast<off_t>(entry.compressedOffset));
+        if (got != static_cast<ssize_t>(compressed.size())) return nullptr;
+        ioThrottle.onRead(compressed.size());
+
+        struct RawInflater {
+            z_stream zs = {};
+            bool ok = inflateInit2(&zs, -MAX_WBITS) == Z_OK;
+            ~RawInflater() { inflateEnd(&zs); }
+        };
+        thread_local RawInflater inflater;
+        if (!inflater.ok) return nullptr;
+        inflateReset2(&inflater.zs, entry.mode == streamStart ? MAX_WBITS + 32 : -MAX_WBITS);
+
+        size_t skip = 0;
+        if (entry.mode == windowCheckpoint) {
+            if (entry.bits) {
+                inflatePrime(&inflater.zs, 8 - entry.bits, static_cast<uint8_t>(compressed[0]) >> entry.bits);
+                skip = 1;
+            }
+            vector<Bytef> window(deflateWindowSize);
+            uLongf windowSize = static_cast<uLongf>(window.size());
+            if (uncompress(window.data(), &windowSize, entry.window.data(), static_cast<uLong>(entry.window.size())) != Z_OK) {
+                return nullptr;
+            }
+            if (windowSize) inflateSetDictionary(&inflater.zs, window.data(), static_cast<uInt>(windowSize));
+        }
+
+        auto output = make_shared<vector<char>>(entry.uncompressedSize);
+        inflater.zs.next_in = reinterpret_cast<Bytef*>(compressed.data() + skip);
+        inflater.zs.avail_in = static_cast<uInt>(compressed.size() - skip);
+        inflater.zs.next_out = reinterpret_cast<Bytef*>(output->data());
+        inflater.zs.avail_out = static_cast<uInt>(output->size());
+        int ret = entry.uncompressedSize ? inflate(&inflater.zs, Z_SYNC_FLUSH) : Z_OK;
+        if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) || inflater.zs.avail_out != 0) {
+            return nullptr;
+        }
+        return output;
+    }
+
+    string path;
+    string cacheKey;
+    int fd = -1;
+    BlockIndex index;
+};
+
+bool extractRange(const string& archivePath, uint64_t offset, uint64_t length, const string& outputPath, int numThreads) {
+    IndexedArchive archive;
+    if (!archive.open(archivePath)) {
+        logMessage(LogLevel::Error, "Error opening indexed archive: ", archivePath);
+        return false;
+    }
+    const BlockIndex& index = archive.blockIndex();
+    uint64_t end = min(index.totalIn, offset + length);
+
+    ofstream outFile(outputPath, ios::binary);
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return false;
+    }
+    if (offset >= end) return true;
+
+    size_t first = archive.blockFor(offset);
+    size_t last = archive.blockFor(end - 1);
+    const size_t batchBlocks = static_cast<size_t>(max(1, numThreads)) * 4;
+    vector<BlockCache::Block> batch(batchBlocks);
+
+    for (size_t start = first; start <= last; start += batchBlocks) {
+        size_t count = min(batchBlocks, last - start + 1);
+        parallelFor(count, numThreads, [&](size_t i, int) {
+            batch[i] = archive.readBlock(start + i);
+        });
+
+        for (size_t i = 0; i < count; ++i) {
+            const BlockIndexEntry& entry = index.blocks[start + i];
+            if (!batch[i]) {
+                logMessage(LogLevel::Error, "Error decompressing block ", start + i, " of ", archivePath);
+                return false;
+            }
+            uint64_t from = max(offset, entry.uncompressedOffset) - entry.uncompressedOffset;
+            uint64_t to = min(end, entry.uncompressedOffset + entry.uncompressedSize) - entry.uncompressedOffset;
+            ioThrottle.onWrite(to - from);
+            outFile.write(batch[i]->data() + from, static_cast<streamsize>(to - from));
+            batch[i].reset();
+        }
+    }
+
+    logMessage(LogLevel::Info, "Extracted bytes ", offset, "-", end, " of ", archivePath, " -> ", outputPath);
+    return static_cast<bool>(outFile);
+}
+
+struct SearchStats {
+    size_t blocks = 0;
+    size_t inflated = 0;
+    size_t matches = 0;
+};
+
+// Writes the lines of an indexed archive that contain `query` as whole words, like
+// grep -Fw. Every token of such a query occurs whole in a matching line, so blocks
+// whose token filter rules one out are skipped without being inflated.
+bool searchArchive(const string& archivePath, const string& query, const string& outputPath, int numThreads,
+                   SearchStats& stats) {
+    IndexedArchive archive;
+    if (!archive.open(archivePath)) {
+        logMessage(LogLevel::Error, "Error opening indexed archive: ", archivePath);
+        return false;
+    }
+    ofstream outFile(outputPath, ios::binary);
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return false;
+    }
+    if (query.empty()) return true;
+
+    vector<uint64_t> queryTokens;
+    forEachToken(query.data(), query.size(), [&](uint64_t h) { queryTokens.push_back(h); });
+    const vector<BlockIndexEntry>& blocks = archive.blockIndex().blocks;
+    vector<size_t> candidates;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        bool possible = all_of(queryTokens.begin(), queryTokens.end(),
+                               [&](uint64_t h) { return tokenFilterMayContain(blocks[i].tokenFilter, h); });
+        if (possible) candidates.push_back(i);
+    }
+    stats.blocks = blocks.size();
+    stats.inflated = candidates.size();
+
+    auto matches = [&](string_view line) {
+        for (size_t pos = line.find(query); pos != string_view::npos; pos = line.find(query, pos + 1)) {
+            bool left = pos == 0 || !isLogTokenChar(line[pos - 1]) || !isLogTokenChar(query.front());
+            size_t end = pos + query.size();
+            bool right = end == line.size() || !isLogTokenChar(line[end]) || !isLogTokenChar(query.back());
+            if (left && right) return true;
+        }
+        return false;
+    };
+    auto emitIfMatch = [&](string_view line) {
+        if (!line.empty() && line.back() == '\n') line.remove_suffix(1);
+        if (line.empty() || !matches(line)) return;
+        outFile.write(line.data(), static_cast<streamsize>(line.size()));
+        outFile.put('\n');
+        stats.matches++;
+    };
+
+    // Lines wholly inside a block are matched in parallel; the partial lines at block
+    // edges are stitched together in order, which only matters for blocks without filters.
+    struct Scanned {
+        BlockCache::Block data;
+        string_view head;          // up to and including the first newline
+        string_view tail;          // after the last newline
+        string interior;           // matching lines between the two, newline-terminated
+        size_t interiorMatches = 0;
+        bool hasNewline = false;
+    };
+    const size_t batchBlocks = static_cast<size_t>(max(1, numThreads)) * 4;
+    vector<Scanned> batch(batchBlocks);
+    string carry;
+    size_t previous = SIZE_MAX;
+
+    for (size_t start = 0; start < candidates.size(); start += batchBlocks) {
+        size_t count = min(batchBlocks, candidates.size() - start);
+        parallelFor(count, numThreads, [&](size_t i, int) {
+            Scanned& s = batch[i];
+            s = Scanned();
+            s.data = archive.readBlock(candidates[start + i]);
+            if (!s.data) return;
+            string_view block(s.data->data(), s.data->size());
+            size_t first = block.find('\n');
+            s.hasNewline = first != string_view::npos;
+            if (!s.hasNewline) return;
+            size_t last = block.rfind('\n');
+            s.head = block.substr(0, first + 1);
+            s.tail = block.substr(last + 1);
+            string_view middle = block.substr(first + 1, last - first);
+            for (size_t pos = 0; pos < middle.size();) {
+                size_t end = middle.find('\n', pos);
+                string_view line = middle.substr(pos, end - pos);
+                if (matches(line)) {
+                    s.interior.append(line.data(), line.size());
+                    s.interior += '\n';
+                    s.interiorMatches++;
+                }
+                pos = end + 1;
+            }
+        });
+
+        for (size_t i = 0; i < count; ++i) {
+            Scanned& s = batch[i];
+            size_t block = candidates[start + i];
+            if (!s.data) {
+                logMessage(LogLevel::Error, "Error decompressing block ", block, " of ", archivePath);
+                return false;
+            }
+            if (block != previous + 1 && !carry.empty()) {
+                emitIfMatch(carry);
+                carry.clear();
+            }
+            previous = block;
+            if (!s.hasNewline) {
+                carry.append(s.data->data(), s.data->size());
+            } else {
+                carry.append(s.head.data(), s.head.size());
+                emitIfMatch(carry);
+                outFile.write(s.interior.data(), static_cast<streamsize>(s.interior.size()));
+                stats.matches += s.interiorMatches;
+                carry.assign(s.tail.data(), s.tail.size());
+            }
+            s = Scanned();
+        }
+    }
+    emitIfMatch(carry);
+
+    logMessage(LogLevel::Info, "Searched ", archivePath, " for \"", query, "\": ", stats.matches, " lines -> ", outputPath);
+    return static_cast<bool>(outFile);
+}
+
+// Writes the lines of an indexed archive whose timestamps fall in [from, to). Lines
+// without a timestamp (stack traces, continuations) belong to the last timestamped
+// line before them. Only blocks whose time range, widened by the range of the last
+// timestamped block before them, overlaps the window are inflated.
+bool extractTimeRange(const string& archivePath, int64_t from, int64_t to, const string& outputPath, int numThreads,
+                      SearchStats& stats) {
+    IndexedArchive archive;
+    if (!archive.open(archivePath)) {
+        logMessage(LogLevel::Error, "Error opening indexed archive: ", archivePath);
+        return false;
+    }
+    const vector<BlockIndexEntry>& blocks = archive.blockIndex().blocks;
+    vector<size_t> candidates;
+    TimeRange inherited;
+    bool indexed = false;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        TimeRange own;
+        own.minTime = blocks[i].minTime;
+        own.maxTime = blocks[i].maxTime;
+        TimeRange effective = own;
+        effective.add(inherited);
+        if (effective.overlaps(from, to)) candidates.push_back(i);
+        if (!own.empty()) {
+            inherited = own;
+            indexed = true;
+        }
+    }
+    if (!indexed) {
+        logMessage(LogLevel::Error, "Archive has no timestamp index: ", archivePath);
+        return false;
+    }
+    ofstream outFile(outputPath, ios::binary);
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return false;
+    }
+    stats.blocks = blocks.size();
+    stats.inflated = candidates.size();
+
+    auto inWindow = [&](int64_t t) { return t >= from && t < to; };
+
+    // Workers decide every line after the block's first timestamped one; the lines
+    // before it depend on the previous block and are decided in order, as are the
+    // partial lines at block edges.
+    struct Scanned {
+        BlockCache::Block data;
+        string_view head;          // up to and including the first newline
+        string_view pending;       // untimed lines after the head, before the first timestamp
+        string_view tail;          // after the last newline
+        string selected;           // lines in the window after `pending`, newline-terminated
+        size_t selectedLines = 0;
+        TimeRange time;            // timestamps after the head; maxTime is only used when set
+        int64_t lastTime = 0;
+        bool hasNewline = false;
+    };
+    const size_t batchBlocks = static_cast<size_t>(max(1, numThreads)) * 4;
+    vector<Scanned> batch(batchBlocks);
+    string carry;
+    bool timed = false;            // whether `current` holds the timestamp lines inherit
+    int64_t current = 0;
+    size_t previous = SIZE_MAX;
+
+    auto emitLine = [&](string_view line) {
+        if (!line.empty() && line.back() == '\n') line.remove_suffix(1);
+        int64_t t;
+        if (parseLineTimestamp(line.data(), line.size(), t)) {
+            current = t;
+            timed = true;
+        }
+        if (!timed || !inWindow(current)) return;
+        outFile.write(line.data(), static_cast<streamsize>(line.size()));
+        outFile.put('\n');
+        stats.matches++;
+    };
+    // Completes a line cut off at the end of a block whose successor was skipped.
+    auto finishCarry = [&](size_t next) {
+        for (; !carry.empty() && next < blocks.size(); ++next) {
+            BlockCache::Block data = archive.readBlock(next);
+            if (!data) return false;
+            const char* newline = static_cast<const char*>(memchr(data->data(), '\n', data->size()));
+            carry.append(data->data(), newline ? static_cast<size_t>(newline - data->data()) : data->size());
+            if (newline) break;
+        }
+        if (!carry.empty()) emitLine(carry);
+        carry.clear();
+        return true;
+    };
+
+    for (size_t start = 0; start < candidates.size(); start += batchBlocks) {
+        size_t count = min(batchBlocks, candidates.size() - start);
+        parallelFor(count, numThreads, [&](size_t i, int) {
+            Scanned& s = batch[i];
+            s = Scanned();
+            s.data = archive.readBlock(candidates[start + i]);
+            if (!s.data) return;
+            string_view block(s.data->data(), s.data->size());
+            size_t first = block.find('\n');
+            s.hasNewline = first != string_view::npos;
+            if (!s.hasNewline) return;
+            size_t last = block.rfind('\n');
+            s.head = block.substr(0, first + 1);
+            s.tail = block.substr(last + 1);
+            string_view middle = block.substr(first + 1, last - first);
+            for (size_t pos = 0; pos < middle.size();) {
+                size_t end = middle.find('\n', pos);
+                string_view line = middle.substr(pos, end - pos);
+                int64_t t;
+                if (parseLineTimestamp(line.data(), line.size(), t)) {
+                    s.time.add(t);
+                    s.lastTime = t;
+                }
+                if (s.time.empty()) {
+                    s.pending = middle.substr(0, end + 1);
+                } else if (inWindow(s.lastTime)) {
+                    s.selected.append(line.data(), line.size());
+                    s.selected += '\n';
+                    s.selectedLines++;
+                }
+                pos = end + 1;
+            }
+        });
+
+        for (size_t i = 0; i < count; ++i) {
+            Scanned& s = batch[i];
+            size_t block = candidates[start + i];
+            if (!s.data) {
+                logMessage(LogLevel::Error, "Error decompressing block ", block, " of ", archivePath);
+                return false;
+            }
+            if (block != previous + 1) {
+                // The skipped blocks lie outside the window, and so does whatever they
+                // would pass on to untimed lines at the start of this one.
+                if (previous != SIZE_MAX && !finishCarry(previous + 1)) {
+                    logMessage(LogLevel::Error, "Error decompressing block ", previous + 1, " of ", archivePath);
+                    return false;
+                }
+                timed = false;
+            }
+            previous = block;
+            if (!s.hasNewline) {
+                carry.append(s.data->data(), s.data->size());
+            } else {
+                carry.append(s.head.data(), s.head.size());
+                emitLine(carry);
+                if (timed && inWindow(current)) {
+                    outFile.write(s.pending.data(), static_cast<streamsize>(s.pending.size()));
+                    stats.matches += static_cast<size_t>(count_if(s.pending.begin(), s.pending.end(),
+                                                                  [](char c) { return c == '\n'; }));
+                }
+                outFile.write(s.selected.data(), static_cast<streamsize>(s.selected.size()));
+                stats.matches += s.selectedLines;
+                if (!s.time.empty()) {
+                    current = s.lastTime;
+                    timed = true;
+                }
+                carry.assign(s.tail.data(), s.tail.size());
+            }
+            s = Scanned();
+        }
+    }
+    if (previous != SIZE_MAX && !finishCarry(previous + 1)) {
+        logMessage(LogLevel::Error, "Error decompressing block ", previous + 1, " of ", archivePath);
+        return false;
+    }
+
+    logMessage(LogLevel::Info, "Extracted ", stats.matches, " lines in the time window from ", archivePath, " -> ",
+               outputPath);
+    return static_cast<bool>(outFile);
+}
+
+// Warms upcoming blocks of an indexed archive on background threads.
+class BlockPrefetcher {
+public:
+    BlockPrefetcher(const IndexedArchive& archive, int threads) : archive(archive) {
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~BlockPrefetcher() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto& t : workers) {
+            t.join();
+        }
+    }
+
+    void request(size_t block) {
+        lock_guard<mutex> lock(m);
+        if (block >= archive.blockIndex().blocks.size() || pending.count(block) || ready.count(block)) return;
+        pending.insert(block);
+        queue.push_back(block);
+        cv.notify_one();
+    }
+
+    // Returns the prefetched block, waiting if it is in flight; null if it was never requested.
+    BlockCache::Block take(size_t block) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]() { return !pending.count(block); });
+        auto it = ready.find(block);
+        if (it == ready.end()) return nullptr;
+        BlockCache::Block data = it->second;
+        ready.erase(it);
+        return data;
+    }
+
+    // Keeps prefetched blocks in [first, last] only, including ones still in flight, so
+    // blocks the reader seeked away from do not pile up.
+    void retain(size_t first, size_t last) {
+        lock_guard<mutex> lock(m);
+        windowFirst = first;
+        windowLast = last;
+        ready.erase(ready.begin(), ready.lower_bound(first));
+        ready.erase(ready.upper_bound(last), ready.end());
+    }
+
+private:
+    void run() {
+        applyWorkerQos();
+        unique_lock<mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [&]() { return stopping || !queue.empty(); });
+            if (stopping) return;
+            size_t block = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            BlockCache::Block data = archive.readBlock(block);
+            lock.lock();
+            if (block >= windowFirst && block <= windowLast) ready[block] = data;
+            pending.erase(block);
+            cv.notify_all();
+        }
+    }
+
+    const IndexedArchive& archive;
+    vector<thread> workers;
+    mutex m;
+    condition_variable cv;
+    deque<size_t> queue;
+    set<size_t> pending;
+    map<size_t, BlockCache::Block> ready;
+    size_t windowFirst = 0;
+    size_t windowLast = SIZE_MAX;
+    bool stopping = false;
+};
+
+// Sink that hands inflated chunks to a reader through a bounded queue; a reader that goes
+// away sets cancelled, which stops the pipeline at its next chunk.
+struct ReadAheadQueueSink {
+    mutex m;
+    condition_variable cv;
+    deque<vector<char>> chunks;
+    size_t maxChunks = 8;
+    bool finished = false;
+    bool failed = false;
+    bool cancelled = false;
+
+    bool write(const char* data, size_t size) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]() { return chunks.size() < maxChunks || cancelled; });
+        if (cancelled) return false;
+        chunks.emplace_back(data, data + size);
+        cv.notify_all();
+        return true;
+    }
+};
+
+// Reads a compressed file as if it were plain: random pread() over block-mode
+// archives, sequential read() for everything, with decompression running ahead.
+class CompressedFileReader {
+public:
+    ~CompressedFileReader() { close(); }
+
+    bool open(const string& path, int prefetchThreads = 2) {
+        close();
+        if (archive.open(path)) {
+            indexed = true;
+            prefetcher = make_unique<BlockPrefetcher>(archive, max(1, prefetchThreads));
+            prefetchDepth = static_cast<size_t>(max(1, prefetchThreads)) * 2;
+            return true;
+        }
+
+        legacyInput.open(path, ios::binary);
+        if (!legacyInput) return false;
+        legacySink = make_unique<ReadAheadQueueSink>();
+        decoder = thread([this]() {
+            NoChecksum checksum;
+            bool ok = runChunkPipeline<IdentityFilter, InflateCodec>(legacyInput, *legacySink, checksum, 0, true);
+            lock_guard<mutex> lock(legacySink->m);
+            legacySink->finished = true;
+            legacySink->failed = !ok;
+            legacySink->cv.notify_all();
+        });
+        return true;
+    }
+
+    void close() {
+        if (decoder.joinable()) {
+            {
+                lock_guard<mutex> lock(legacySink->m);
+                legacySink->cancelled = true;
+            }
+            legacySink->cv.notify_all();
+            decoder.join();
+        }
+        prefetcher.reset();
+        archive.close();
+        legacySink.reset();
+        legacyInput.close();
+        legacyInput.clear();
+        current.clear();
+        currentPos = 0;
+        position = 0;
+        indexed = false;
+    }
+
+    bool isIndexed() const { return indexed; }
+
+    int64_t size() const { return indexed ? static_cast<int64_t>(archive.blockIndex().totalIn) : -1; }
+
+    int64_t pread(char* buffer, size_t length, uint64_t offset) {
+        if (!indexed) return -1;
+        const BlockIndex& index = archive.blockIndex();
+        if (offset >= index.totalIn || length == 0) return 0;
+
+        uint64_t end = min(index.totalIn, offset + length);
+        uint64_t copied = 0;
+        for (size_t b = archive.blockFor(offset); b < index.blocks.size() && offset + copied < end; ++b) {
+            prefetcher->retain(b, b + prefetchDepth);
+            for (size_t ahead = 1; ahead <= prefetchDepth; ++ahead) {
+                prefetcher->request(b + ahead);
+            }
+            BlockCache::Block data = prefetcher->take(b);
+            if (!data) data = archive.readBlock(b);
+            if (!data) return copied ? static_cast<int64_t>(copied) : -1;
+
+            const BlockIndexEntry& entry = index.blocks[b];
+            uint64_t from = offset + copied - entry.uncompressedOffset;
+            uint64_t take = min<uint64_t>(entry.uncompressedSize - from, end - offset - copied);
+            memcpy(buffer + copied, data->data() + from, take);
+            copied += take;
+        }
+        return static_cast<int64_t>(copied);
+    }
+
+    int64_t read(char* buffer, size_t length) {
+        if (indexed) {
+            int64_t got = pread(buffer, length, position);
+            if (got > 0) position += static_cast<uint64_t>(got);
+            return got;
+        }
+
+        size_t copied = 0;
+        while (copied < length) {
+            if (currentPos == current.size()) {
+                unique_lock<mutex> lock(legacySink->m);
+                legacySink->cv.wait(lock, [&]() { return !legacySink->chunks.empty() || legacySink->finished; });
+                if (legacySink->chunks.empty()) {
+                    if (legacySink->failed && copied == 0) return -1;
+                    break;
+                }
+                current = move(legacySink->chunks.front());
+                legacySink->chunks.pop_front();
+                currentPos = 0;
+                legacySink->cv.notify_all();
+            }
+            size_t take = min(length - copied, current.size() - currentPos);
+            memcpy(buffer + copied, current.data() + currentPos, take);
+            currentPos += take;
+            copied += take;
+        }
+        position += copied;
+        return static_cast<int64_t>(copied);
+    }
+
+private:
+    bool indexed = false;
+    IndexedArchive archive;
+    unique_ptr<BlockPrefetcher> prefetcher;
+    size_t prefetchDepth = 0;
+    uint64_t position = 0;
+
+    ifstream legacyInput;
+    unique_ptr<ReadAheadQueueSink> legacySink;
+    thread decoder;
+    vector<char> current;
+    size_t currentPos = 0;
+};
+
+class BufferPool;
+
+struct BufferSlab {
+    BufferPool* pool;
+    unique_ptr<char[]> data;
+    atomic<uint32_t> refs{0};
+    BufferSlab* next = nullptr;
+};
+
+// A view of part of a pooled slab that shares ownership of it. Copies and sub-slices add
+// a reference instead of copying bytes; the slab returns to its pool with the last one.
+class BufferSlice {
+public:
+    BufferSlice() = default;
+    BufferSlice(BufferSlab* slab, size_t offset, size_t length) : slab(slab), offset(offset), length(length) {
+        if (slab) slab->refs.fetch_add(1, memory_order_relaxed);
+    }
+    BufferSlice(const BufferSlice& other) : BufferSlice(other.slab, other.offset, other.length) {}
+    BufferSlice(BufferSlice&& other) noexcept : slab(other.slab), offset(other.offset), length(other.length) {
+        other.slab = nullptr;
+        other.offset = other.length = 0;
+    }
+    BufferSlice& operator=(BufferSlice other) noexcept {
+        swap(slab, other.slab);
+        swap(offset, other.offset);
+        swap(length, other.length);
+        return *this;
+    }
+    ~BufferSlice() { reset(); }
+
+    void reset();
+
+    char* data() const { return slab ? slab->data.get() + offset : nullptr; }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+
+    // Bytes [pos, pos + count) of this slice, sharing the same slab.
+    BufferSlice slice(size_t pos, size_t count) const {
+        return BufferSlice(slab, offset + pos, min(count, length - min(pos, length)));
+    }
+
+private:
+    BufferSlab* slab = nullptr;
+    size_t offset = 0;
+    size_t length = 0;
+};
+
+// Fixed-size slabs recycled between pipeline stages, so data moves from reader to
+// compressor to writer by reference. Releasing a slab pushes it onto a lock-free free
+// list from whichever thread drops the last slice; only acquisition takes a lock, which
+// keeps pops free of ABA. The pool must outlive its slices.
+class BufferPool {
+public:
+    explicit BufferPool(size_t slabSize) : slabSize(slabSize) {}
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool() {
+        BufferSlab* slab = freeList.load();
+        while (slab) {
+            BufferSlab* next = slab->next;
+            delete slab;
+            slab = next;
+        }
+    }
+
+    // Returns a whole slab, reusing a released one when available.
+    BufferSlice acquire() {
+        BufferSlab* slab;
+        {
+            lock_guard<mutex> lock(popMutex);
+            slab = freeList.load(memory_order_acquire);
+            while (slab && !freeList.compare_exchange_weak(slab, slab->next, memory_order_acquire)) {}
+        }
+        if (!slab) {
+            slab = new BufferSlab;
+            slab->pool = this;
+            slab->data.reset(new char[slabSize]);
+            allocated.fetch_add(1, memory_order_relaxed);
+        }
+        size_t now = outstanding.fetch_add(slabSize, memory_order_relaxed) + slabSize;
+        size_t seen = peak.load(memory_order_relaxed);
+        while (now > seen && !peak.compare_exchange_weak(seen, now, memory_order_relaxed)) {}
+        return BufferSlice(slab, 0, slabSize);
+    }
+
+    void release(BufferSlab* slab) {
+        outstanding.fetch_sub(slabSize, memory_order_relaxed);
+        BufferSlab* head = freeList.load(memory_order_relaxed);
+        do {
+            slab->next = head;
+        } while (!freeList.compare_exchange_weak(head, slab, memory_order_release, memory_order_relaxed));
+    }
+
+    size_t capacity() const { return slabSize; }
+    // Bytes held by slabs that still have live slices.
+    size_t outstandingBytes() const { return outstanding.load(memory_order_relaxed); }
+    size_t peakBytes() const { return peak.load(memory_order_relaxed); }
+    size_t slabsAllocated() const { return allocated.load(memory_order_relaxed); }
+
+private:
+    size_t slabSize;
+    mutex popMutex;
+    atomic<BufferSlab*> freeList{nullptr};
+    atomic<size_t> outstanding{0};
+    atomic<size_t> peak{0};
+    atomic<size_t> allocated{0};
+};
+
+inline void BufferSlice::reset() {
+    if (slab && slab->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+        slab->pool->release(slab);
+    }
+    slab = nullptr;
+    offset = length = 0;
+}
+
+// ostream adapter that compresses on background threads: each filled buffer becomes an
+// independent deflate block, and a writer thread emits blocks in order as one zlib stream,
+// the same format block mode writes. The put area is a pooled slab handed to the
+// compressors as is. At most maxInFlight buffers are held, so a writer that outpaces the
+// compressors waits instead of growing memory.
+class DeflatingStreamBuf : public streambuf {
+public:
+    DeflatingStreamBuf(ostream& sink, int level, int numThreads, size_t chunkSize = settings.blockSize)
+        : sink(sink), level(level), chunkSize(chunkSize), maxInFlight(static_cast<size_t>(max(1, numThreads)) * 2),
+          contexts(max(1, numThreads)), pool(chunkSize) {
+        writeZlibHeader(sink, level);
+        buffer = pool.acquire();
+        setp(buffer.data(), buffer.data() + buffer.size());
+        for (int i = 0; i < max(1, numThreads); ++i) {
+            compressors.emplace_back([this, i]() { compressLoop(i); });
+        }
+        writer = thread([this]() { writeLoop(); });
+    }
+
+    ~DeflatingStreamBuf() override { close(); }
+
+    // Ends the stream: compresses what is buffered, writes the trailer and stops the threads.
+    bool close() {
+        if (closed) return ok;
+        submit(true);
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        writer.join();
+        for (auto& t : compressors) {
+            t.join();
+        }
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            sink.put(static_cast<char>((adler >> shift) & 0xff));
+        }
+        sink.flush();
+        closed = true;
+        ok = ok && static_cast<bool>(sink);
+        return ok;
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (closed) return traits_type::eof();
+        submit(false);
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    // flush() and endl do not cut a block: each block is compressed without history, so
+    // a caller flushing per line would get a block per line. Data moves on when a buffer
+    // fills or on close().
+    int sync() override {
+        if (closed) return -1;
+        return ok ? 0 : -1;
+    }
+
+private:
+    struct Chunk {
+        BufferSlice input;
+        vector<char> output;
+        uLong adler = 0;
+        bool last = false;
+        bool done = false;
+        bool ok = false;
+    };
+
+    void submit(bool last) {
+        auto chunk = make_shared<Chunk>();
+        chunk->input = buffer.slice(0, static_cast<size_t>(pptr() - pbase()));
+        chunk->last = last;
+        {
+            unique_lock<mutex> lock(m);
+            cv.wait(lock, [&]() { return inFlight.size() < maxInFlight; });
+            inFlight.push_back(chunk);
+            todo.push_back(chunk);
+            cv.notify_all();
+        }
+        buffer = last ? BufferSlice() : pool.acquire();
+        setp(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    void compressLoop(int workerId) {
+        applyWorkerQos();
+        unique_lock<mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [&]() { return stopping || !todo.empty(); });
+            if (todo.empty()) return;
+            shared_ptr<Chunk> chunk = todo.front();
+            todo.pop_front();
+            lock.unlock();
+            int strategy;
+            chunk->adler = adler32(adler32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(chunk->input.data()),
+                                   static_cast<uInt>(chunk->input.size()));
+            chunk->ok = deflateIndependentBlock(contexts[workerId], level, chunk->input.data(), chunk->input.size(),
+                                                chunk->last, chunk->output, strategy);
+            lock.lock();
+            chunk->done = true;
+            cv.notify_all();
+        }
+    }
+
+    void writeLoop() {
+        unique_lock<mutex> lock(m);
+        while (true) {
+            cv.wait(lock, [&]() { return (!inFlight.empty() && inFlight.front()->done) || (stopping && inFlight.empty()); });
+            if (inFlight.empty()) return;
+            shared_ptr<Chunk> chunk = inFlight.front();
+            inFlight.pop_front();
+            cv.notify_all();
+            lock.unlock();
+            if (!chunk->ok) {
+                logMessage(LogLevel::Error, "Error during compression/decompression");
+                ok = false;
+            }
+            ioThrottle.onWrite(chunk->output.size());
+            sink.write(chunk->output.data(), chunk->output.size());
+            adler = adler32_combine(adler, chunk->adler, static_cast<z_off_t>(chunk->input.size()));
+            chunk.reset();
+            lock.lock();
+        }
+    }
+
+    ostream& sink;
+    int level;
+    size_t chunkSize;
+    size_t maxInFlight;
+    vector<DeflateContextCache> contexts;
+    BufferPool pool;
+    BufferSlice buffer;
+    vector<thread> compressors;
+    thread writer;
+    mutex m;
+    condition_variable cv;
+    deque<shared_ptr<Chunk>> inFlight;
+    deque<shared_ptr<Chunk>> todo;
+    uLong adler = adler32(0L, Z_NULL, 0);
+    bool stopping = false;
+    bool closed = false;
+    atomic<bool> ok{true};
+};
+
+// istream adapter that inflates zlib or gzip input on a worker thread, running up to a
+// few chunks ahead of the reader through the same queue sink the virtual reader uses.
+class InflatingStreamBuf : public streambuf {
+public:
+    explicit InflatingStreamBuf(istream& source) : source(source) {
+        decoder = thread([this]() {
+            applyWorkerQos();
+            NoChecksum checksum;
+            bool ok = runChunkPipeline<IdentityFilter, InflateCodec>(this->source, queue, checksum, 0, true);
+            lock_guard<mutex> lock(queue.m);
+            queue.finished = true;
+            queue.failed = !ok;
+            queue.cv.notify_all();
+        });
+    }
+
+    ~InflatingStreamBuf() override {
+        {
+            lock_guard<mutex> lock(queue.m);
+            queue.cancelled = true;
+        }
+        queue.cv.notify_all();
+        decoder.join();
+    }
+
+    bool failed() {
+        lock_guard<mutex> lock(queue.m);
+        return queue.failed;
+    }
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        unique_lock<mutex> lock(queue.m);
+        do {
+            queue.cv.wait(lock, [&]() { return !queue.chunks.empty() || queue.finished; });
+            if (queue.chunks.empty()) return traits_type::eof();
+            current = move(queue.chunks.front());
+            queue.chunks.pop_front();
+            queue.cv.notify_all();
+        } while (current.empty());
+        setg(current.data(), current.data(), current.data() + current.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    istream& source;
+    ReadAheadQueueSink queue;
+    thread decoder;
+    vector<char> current;
+};
+
+enum class StreamFormat { Unknown, Zlib, Gzip };
+
+// Returns the offset of the deflate data after a zlib or gzip header, or 0 if none is recognised.
+size_t parseStreamHeader(const uint8_t* data, size_t size, StreamFormat& format) {
+    format = StreamFormat::Unknown;
+    if (size >= 10 && data[0] == 0x1f && data[1] == 0x8b && data[2] == 8) {
+        uint8_t flags = data[3];
+        size_t pos = 10;
+        if (flags & 4) {
+            if (pos + 2 > size) return 0;
+            pos += 2 + (data[pos] | (data[pos + 1] << 8));
+        }
+        for (uint8_t bit : {uint8_t(8), uint8_t(16)}) {
+            if (!(flags & bit)) continue;
+            while (pos < size && data[pos] != 0) pos++;
+            pos++;
+        }
+        if (flags & 2) pos += 2;
+        if (pos >= size) return 0;
+        format = StreamFormat::Gzip;
+        return pos;
+    }
+    if (size >= 6 && (data[0] & 0x0f) == 8 && (data[0] >> 4) <= 7 && !(data[1] & 0x20) &&
+        ((data[0] << 8) | data[1]) % 31 == 0) {
+        format = StreamFormat::Zlib;
+        return 2;
+    }
+    return 0;
+}
+
+class DeflateBitReader {
+public:
+    DeflateBitReader(const uint8_t* data, size_t size, uint64_t bitPos) : data(data), size(size), pos(bitPos) {}
+
+    uint32_t peek(unsigned count) const {
+        uint64_t byte = pos >> 3;
+        uint64_t value = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (byte + 8 <= size) {
+            memcpy(&value, data + byte, 8);
+        } else
+#endif
+        {
+            for (unsigned k = 0; k < 8 && byte + k < size; ++k) {
+                value |= static_cast<uint64_t>(data[byte + k]) << (8 * k);
+            }
+        }
+        return static_cast<uint32_t>((value >> (pos & 7)) & ((1ull << count) - 1));
+    }
+
+    void skip(unsigned count) { pos += count; }
+
+    uint32_t bits(unsigned count) {
+        uint32_t value = peek(count);
+        pos += count;
+        return value;
+    }
+
+    bool overrun() const { return pos > static_cast<uint64_t>(size) * 8; }
+
+    const uint8_t* data;
+    size_t size;
+    uint64_t pos;
+};
+
+// Canonical Huffman decoder with a 9-bit lookup table and a bit-serial fallback for longer codes.
+struct DeflateHuffman {
+    static const int fastBits = 9;
+    uint16_t count[16];
+    uint16_t symbols[320];
+    uint16_t fast[1 << fastBits];
+
+    // Rejects over-subscribed and incomplete codes the same way zlib does.
+    bool build(const uint8_t* lengths, int n) {
+        memset(count, 0, sizeof(count));
+        memset(fast, 0, sizeof(fast));
+        for (int i = 0; i < n; ++i) count[lengths[i]]++;
+        count[0] = 0;
+
+        int maxLength = 15;
+        while (maxLength > 0 && count[maxLength] == 0) maxLength--;
+        if (maxLength == 0) return true;
+
+        int left = 1;
+        for (int len = 1; len <= 15; ++len) {
+            left <<= 1;
+            left -= count[len];
+            if (left < 0) return false;
+        }
+        if (left > 0 && maxLength != 1) return false;
+
+        uint16_t offsets[16];
+        offsets[1] = 0;
+        for (int len = 1; len < 15; ++len) offsets[len + 1] = offsets[len] + count[len];
+        for (int i = 0; i < n; ++i) {
+            if (lengths[i]) symbols[offsets[lengths[i]]++] = static_cast<uint16_t>(i);
+        }
+
+        uint32_t code = 0;
+        int index = 0;
+        for (int len = 1; len <= fastBits; ++len) {
+            for (int k = 0; k < count[len]; ++k, ++index, ++code) {
+                uint32_t reversed = 0;
+                for (int b = 0; b < len; ++b) reversed |= ((code >> b) & 1) << (len - 1 - b);
+                for (uint32_t slot = reversed; slot < (1u << fastBits); slot += 1u << len) {
+                    fast[slot] = static_cast<uint16_t>((symbols[index] << 4) | len);
+                }
+            }
+            code <<= 1;
+        }
+        return true;
+    }
+
+    int decode(DeflateBitReader& in) const {
+        uint16_t entry = fast[in.peek(fastBits)];
+        if (entry) {
+            in.skip(entry & 15);
+            return entry >> 4;
+        }
+        uint32_t window = in.peek(15);
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len <= 15; ++len) {
+            code |= (window >> (len - 1)) & 1;
+            int n = count[len];
+            if (code - n < first) {
+                in.skip(len);
+                return symbols[index + (code - first)];
+            }
+            index += n;
+            first = (first + n) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+};
+
+const uint16_t deflateLengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t deflateLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t deflateDistBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                      193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                      6145, 8193, 12289, 16385, 24577};
+const uint8_t deflateDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                      6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+bool readDynamicTables(DeflateBitReader& in, DeflateHuffman& lit, DeflateHuffman& dist) {
+    static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    int nlen = static_cast<int>(in.bits(5)) + 257;
+    int ndist = static_cast<int>(in.bits(5)) + 1;
+    int ncode = static_cast<int>(in.bits(4)) + 4;
+    if (nlen > 286 || ndist > 30) return false;
+
+    uint8_t lengths[320] = {};
+    for (int i = 0; i < ncode; ++i) lengths[order[i]] = static_cast<uint8_t>(in.bits(3));
+    DeflateHuffman codeLengths;
+    if (!codeLengths.build(lengths, 19)) return false;
+
+    memset(lengths, 0, sizeof(lengths));
+    int index = 0;
+    while (index < nlen + ndist) {
+        int symbol = codeLengths.decode(in);
+        if (symbol < 0) return false;
+        if (symbol < 16) {
+            lengths[index++] = static_cast<uint8_t>(symbol);
+            continue;
+        }
+        uint8_t value = 0;
+        int repeat;
+        if (symbol == 16) {
+            if (index == 0) return false;
+            value = lengths[index - 1];
+            repeat = 3 + static_cast<int>(in.bits(2));
+        } else if (symbol == 17) {
+            repeat = 3 + static_cast<int>(in.bits(3));
+        } else {
+            repeat = 11 + static_cast<int>(in.bits(7));
+        }
+        if (index + repeat > nlen + ndist) return false;
+        while (repeat--) lengths[index++] = value;
+    }
+
+    if (lengths[256] == 0) return false;
+    return lit.build(lengths, nlen) && dist.build(lengths + nlen, ndist) && !in.overrun();
+}
+
+void buildFixedTables(DeflateHuffman& lit, DeflateHuffman& dist) {
+    uint8_t lengths[320];
+    for (int i = 0; i < 144; ++i) lengths[i] = 8;
+    for (int i = 144; i < 256; ++i) lengths[i] = 9;
+    for (int i = 256; i < 280; ++i) lengths[i] = 7;
+    for (int i = 280; i < 288; ++i) lengths[i] = 8;
+    lit.build(lengths, 288);
+    for (int i = 0; i < 30; ++i) lengths[i] = 5;
+    dist.build(lengths, 30);
+}
+
+// Output of a deflate range decoded without its preceding window. Symbols below 256
+// are literal bytes; 256 + i stands for byte i of the unknown 32 KB window before it.
+struct SpeculativeChunk {
+    uint64_t startBit = 0;
+    uint64_t endBit = 0;
+    bool finalBlock = false;
+    bool ok = false;
+    vector<uint16_t> symbols;
+};
+
+// Decodes whole blocks from startBit until a block boundary at or past stopBit, or the
+// final block. windowAvailable is how far back references may reach before the chunk.
+// Output is capped at maxSymbols: a chunk that would exceed it ends early at its last
+// block boundary, provided that keeps at least half the cap, and otherwise fails.
+bool decodeDeflateBlocks(const uint8_t* data, size_t size, uint64_t startBit, uint64_t stopBit,
+                         size_t windowAvailable, size_t maxSymbols, SpeculativeChunk& chunk) {
+    DeflateBitReader in(data, size, startBit);
+    DeflateHuffman lit, dist;
+    DeflateHuffman fixedLit, fixedDist;
+    bool fixedBuilt = false;
+    vector<uint16_t>& out = chunk.symbols;
+    size_t n = 0;
+    out.resize(min<size_t>(1 << 20, maxSymbols));
+
+    size_t boundarySymbols = 0;
+    uint64_t boundaryBit = startBit;
+    auto endAtBoundary = [&]() {
+        if (boundarySymbols == 0 || boundarySymbols < maxSymbols / 2) return false;
+        out.resize(boundarySymbols);
+        chunk.endBit = boundaryBit;
+        chunk.ok = true;
+        return true;
+    };
+
+    chunk.startBit = startBit;
+    chunk.finalBlock = false;
+    while (in.pos < stopBit || in.pos == startBit) {
+        bool last = in.bits(1);
+        uint32_t type = in.bits(2);
+
+        if (type == 0) {
+            in.pos = (in.pos + 7) & ~uint64_t(7);
+            uint32_t len = in.bits(16);
+            uint32_t nlen = in.bits(16);
+            if ((len ^ 0xffff) != nlen || in.overrun()) return false;
+            size_t byte = static_cast<size_t>(in.pos >> 3);
+            if (byte + len > size) return false;
+            if (n + len > maxSymbols) return endAtBoundary();
+            if (n + len > out.size()) out.resize(min(maxSymbols, max(out.size() * 2, n + len)));
+            for (uint32_t i = 0; i < len; ++i) out[n++] = data[byte + i];
+            in.pos += static_cast<uint64_t>(len) * 8;
+        } else if (type == 1 || type == 2) {
+            const DeflateHuffman* litCode = &lit;
+            const DeflateHuffman* distCode = &dist;
+            if (type == 1) {
+                if (!fixedBuilt) {
+                    buildFixedTables(fixedLit, fixedDist);
+                    fixedBuilt = true;
+                }
+                litCode = &fixedLit;
+                distCode = &fixedDist;
+            } else if (!readDynamicTables(in, lit, dist)) {
+                return false;
+            }
+
+            while (true) {
+                if (n + 258 > out.size()) {
+                    if (out.size() >= maxSymbols) return endAtBoundary();
+                    out.resize(min(maxSymbols, out.size() * 2));
+                }
+                int symbol = litCode->decode(in);
+                if (symbol < 0) return false;
+                if (symbol < 256) {
+                    out[n++] = static_cast<uint16_t>(symbol);
+                    continue;
+                }
+                if (symbol == 256) break;
+                symbol -= 257;
+                if (symbol >= 29) return false;
+                uint32_t length = deflateLengthBase[symbol] + in.bits(deflateLengthExtra[symbol]);
+                int distSymbol = distCode->decode(in);
+                if (distSymbol < 0 || distSymbol >= 30) return false;
+                uint32_t distance = deflateDistBase[distSymbol] + in.bits(deflateDistExtra[distSymbol]);
+                if (distance > n + windowAvailable) return false;
+
+                for (uint32_t k = 0; k < length; ++k, ++n) {
+                    if (distance <= n) {
+                        out[n] = out[n - distance];
+                    } else {
+                        out[n] = static_cast<uint16_t>(256 + deflateWindowSize - (distance - n));
+                    }
+                }
+            }
+        } else {
+            return false;
+        }
+
+        if (in.overrun()) return false;
+        if (last) {
+            chunk.finalBlock = true;
+            break;
+        }
+        boundarySymbols = n;
+        boundaryBit = in.pos;
+    }
+
+    out.resize(n);
+    chunk.endBit = in.pos;
+    chunk.ok = true;
+    return true;
+}
+
+// Looks for the first plausible dynamic block header in [fromBit, toBit) whose decoding
+// survives until the next chunk, the way rapidgzip seeds its speculative workers.
+void decodeSpeculativeChunk(const uint8_t* data, size_t size, uint64_t fromBit, uint64_t toBit,
+                            uint64_t stopBit, size_t maxSymbols, SpeculativeChunk& chunk) {
+    DeflateHuffman lit, dist;
+    for (uint64_t bit = fromBit; bit < toBit; ++bit) {
+        DeflateBitReader probe(data, size, bit);
+        uint32_t head = probe.peek(13);
+        if (((head >> 1) & 3) != 2) continue;
+        if (((head >> 3) & 31) > 29 || ((head >> 8) & 31) > 29) continue;
+        probe.skip(3);
+        if (!readDynamicTables(probe, lit, dist)) continue;
+        if (decodeDeflateBlocks(data, size, bit, stopBit, deflateWindowSize, maxSymbols, chunk)) return;
+    }
+    chunk.ok = false;
+    chunk.symbols.clear();
+}
+
+// Serially inflates with zlib from a block boundary and a known window until the first
+// boundary at or past stopBit. Used to bridge chunks whose speculation did not line up.
+template<typename Emit>
+bool inflateFromBoundary(const uint8_t* data, size_t size, uint64_t startBit, const vector<uint8_t>& window,
+                         uint64_t stopBit, Emit emit, uint64_t& endBit, bool& finalBlock,
+                         uint64_t* lastBoundary = nullptr) {
+    z_stream zs = {};
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return false;
+
+    size_t byte = static_cast<size_t>(startBit >> 3);
+    int used = static_cast<int>(startBit & 7);
+    if (used) {
+        inflatePrime(&zs, 8 - used, data[byte] >> used);
+        byte++;
+    }
+    if (!window.empty()) {
+        inflateSetDictionary(&zs, window.data(), static_cast<uInt>(window.size()));
+    }
+
+    vector<uint8_t> outBuffer(256 * 1024);
+    const uint8_t* cursor = data + byte;
+    bool ok = false;
+    finalBlock = false;
+
+    while (true) {
+        if (zs.avail_in == 0) {
+            size_t remaining = static_cast<size_t>(data + size - cursor);
+            if (remaining == 0) break;
+            zs.next_in = const_cast<Bytef*>(cursor);
+            zs.avail_in = static_cast<uInt>(min<size_t>(remaining, 1u << 30));
+            cursor += zs.avail_in;
+        }
+        zs.next_out = outBuffer.data();
+        zs.avail_out = static_cast<uInt>(outBuffer.size());
+        int ret = inflate(&zs, Z_BLOCK);
+        emit(outBuffer.data(), outBuffer.size() - zs.avail_out);
+
+        uint64_t position = static_cast<uint64_t>(zs.next_in - data) * 8 - (zs.data_type & 7);
+        // Z_BLOCK reports the end of the final block as a boundary with the last-block bit set.
+        if (ret == Z_STREAM_END || (zs.data_type & 192) == 192) {
+            endBit = position;
+            finalBlock = true;
+            ok = true;
+            break;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) break;
+        if ((zs.data_type & 128) && lastBoundary) *lastBoundary = position;
+        if ((zs.data_type & 128) && position >= stopBit && position > startBit) {
+            endBit = position;
+            ok = true;
+            break;
+        }
+        if (ret == Z_BUF_ERROR && zs.avail_in == 0 && cursor == data + size) break;
+    }
+
+    inflateEnd(&zs);
+    return ok;
+}
+
+struct MappedFile {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    int fd = -1;
+
+    bool open(const string& path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) return false;
+        size = static_cast<size_t>(st.st_size);
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) return false;
+        data = static_cast<const uint8_t*>(mapped);
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    ~MappedFile() {
+        if (data) munmap(const_cast<uint8_t*>(data), size);
+        if (fd >= 0) close(fd);
+    }
+};
+
+uint32_t readLittleEndian32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+uint32_t readBigEndian32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+enum class ParallelInflateResult { Unsuitable, Ok, Failed };
+
+// Speculative chunk-parallel inflate of the single zlib or gzip stream at data[0]. On
+// success endOffset is just past the stream's trailer, which has been verified.
+ParallelInflateResult inflateStreamParallel(const uint8_t* data, size_t size, ostream& outFile, int numThreads,
+                                            uint64_t& totalOut, size_t& endOffset, size_t& speculated, size_t& bridged) {
+    StreamFormat format;
+    size_t headerSize = parseStreamHeader(data, size, format);
+    if (format == StreamFormat::Unknown || numThreads < 2 || size < settings.inflateChunkSize * 2) {
+        return ParallelInflateResult::Unsuitable;
+    }
+
+    const bool gzip = format == StreamFormat::Gzip;
+    uLong check = gzip ? crc32(0L, Z_NULL, 0) : adler32(0L, Z_NULL, 0);
+    uint64_t produced = 0;
+    vector<uint8_t> window;
+
+    auto emitBytes = [&](const uint8_t* bytes, size_t count) {
+        if (count == 0) return;
+        check = gzip ? crc32(check, bytes, static_cast<uInt>(count)) : adler32(check, bytes, static_cast<uInt>(count));
+        ioThrottle.onWrite(count);
+        outFile.write(reinterpret_cast<const char*>(bytes), static_cast<streamsize>(count));
+        produced += count;
+        if (count >= deflateWindowSize) {
+            window.assign(bytes + count - deflateWindowSize, bytes + count);
+        } else {
+            window.insert(window.end(), bytes, bytes + count);
+            if (window.size() > deflateWindowSize) window.erase(window.begin(), window.end() - deflateWindowSize);
+        }
+    };
+
+    const uint64_t dataEndBit = static_cast<uint64_t>(size) * 8;
+    uint64_t position = static_cast<uint64_t>(headerSize) * 8;
+    bool finished = false;
+    const size_t maxRoundChunks = static_cast<size_t>(numThreads) * 2;
+    vector<SpeculativeChunk> chunks(maxRoundChunks);
+    // Every round holds its chunks' symbols within the read-ahead budget. Chunks are sized
+    // from that budget and the expansion seen so far, with headroom, so they normally fit;
+    // when a chunk does not, it ends at its last block boundary and the gap is bridged.
+    const size_t minChunkBytes = 64 * 1024;
+    const size_t roundSymbols = max<size_t>(maxRoundChunks * 64 * 1024, settings.readAheadBytes / sizeof(uint16_t));
+    double expansion = 4.0;
+
+    while (!finished) {
+        uint64_t roundStart = position;
+        uint64_t roundProduced = produced;
+        const double planned = expansion * 1.5;
+        const size_t affordable = static_cast<size_t>(static_cast<double>(roundSymbols) / (minChunkBytes * planned));
+        const size_t roundChunks = min(maxRoundChunks, max<size_t>(2, affordable));
+        const size_t maxSymbols = roundSymbols / roundChunks;
+        const size_t chunkBytes = min(settings.inflateChunkSize,
+                                      max<size_t>(4096, static_cast<size_t>(static_cast<double>(maxSymbols) / planned)));
+        vector<uint64_t> bounds(roundChunks + 1);
+        for (size_t i = 0; i <= roundChunks; ++i) {
+            bounds[i] = min(dataEndBit, roundStart + static_cast<uint64_t>(i) * chunkBytes * 8);
+        }
+
+        parallelFor(roundChunks, numThreads, [&](size_t i, int) {
+            SpeculativeChunk& chunk = chunks[i];
+            chunk.ok = false;
+            if (bounds[i] >= dataEndBit) return;
+            if (i == 0) {
+                decodeDeflateBlocks(data, size, roundStart, bounds[1],
+                                    roundStart == headerSize * 8 ? 0 : deflateWindowSize, maxSymbols, chunk);
+            } else {
+                decodeSpeculativeChunk(data, size, bounds[i], bounds[i + 1], bounds[i + 1], maxSymbols, chunk);
+            }
+        });
+
+        for (size_t i = 0; i < roundChunks && !finished; ++i) {
+            SpeculativeChunk& chunk = chunks[i];
+            uint64_t endBit;
+            bool finalBlock;
+            // The previous chunk ended early: bridge up to where this one starts.
+            if (chunk.ok && chunk.startBit > position) {
+                vector<uint8_t> bridgeWindow = window;
+                if (!inflateFromBoundary(data, size, position, bridgeWindow, chunk.startBit, emitBytes, endBit,
+                                         finalBlock)) {
+                    return ParallelInflateResult::Failed;
+                }
+                position = endBit;
+                finished = finalBlock;
+                bridged++;
+                if (finished) break;
+            }
+            if (chunk.ok && chunk.startBit == position) {
+                vector<uint8_t> resolved(chunk.symbols.size());
+                const vector<uint8_t>& known = window;
+                size_t pad = deflateWindowSize - known.size();
+                bool valid = true;
+                for (size_t k = 0; k < chunk.symbols.size(); ++k) {
+                    uint16_t symbol = chunk.symbols[k];
+                    if (symbol < 256) {
+                        resolved[k] = static_cast<uint8_t>(symbol);
+                    } else if (symbol - 256u >= pad) {
+                        resolved[k] = known[symbol - 256 - pad];
+                    } else {
+                        valid = false;
+                        break;
+                    }
+                }
+                if (valid) {
+                    emitBytes(resolved.data(), resolved.size());
+                    position = chunk.endBit;
+                    finished = chunk.finalBlock;
+                    speculated++;
+                    vector<uint16_t>().swap(chunk.symbols);
+                    continue;
+                }
+            }
+
+            uint64_t stop = i + 1 < roundChunks ? max(bounds[i + 1], position + 1) : position + 1;
+            vector<uint8_t> bridgeWindow = window;
+            if (!inflateFromBoundary(data, size, position, bridgeWindow, stop, emitBytes, endBit, finalBlock)) {
+                return ParallelInflateResult::Failed;
+            }
+            position = endBit;
+            finished = finalBlock;
+            bridged++;
+            vector<uint16_t>().swap(chunk.symbols);
+        }
+
+        if (position > roundStart) {
+            expansion = max(1.0, static_cast<double>(produced - roundProduced) * 8 /
+                                     static_cast<double>(position - roundStart));
+        }
+        if (!finished && position >= dataEndBit) break;
+    }
+
+    size_t trailer = static_cast<size_t>((position + 7) / 8);
+    bool verified = finished;
+    if (verified && gzip) {
+        verified = trailer + 8 <= size && readLittleEndian32(data + trailer) == check &&
+                   readLittleEndian32(data + trailer + 4) == static_cast<uint32_t>(produced);
+        endOffset = trailer + 8;
+    } else if (verified) {
+        verified = trailer + 4 <= size && readBigEndian32(data + trailer) == check;
+        endOffset = trailer + 4;
+    }
+    totalOut += produced;
+    return verified ? ParallelInflateResult::Ok : ParallelInflateResult::Failed;
+}
+
+// Serial zlib inflate of the single zlib or gzip stream at data[0]; zlib checks the trailer.
+bool inflateStreamSerial(const uint8_t* data, size_t size, ostream& outFile, uint64_t& totalOut, size_t& endOffset) {
+    z_stream zs = {};
+    if (inflateInit2(&zs, MAX_WBITS + 32) != Z_OK) return false;
+    vector<char> outBuffer(1024 * 1024);
+    const uint8_t* cursor = data;
+    int ret = Z_OK;
+
+    while (ret != Z_STREAM_END) {
+        if (zs.avail_in == 0) {
+            size_t remaining = static_cast<size_t>(data + size - cursor);
+            if (remaining == 0) break;
+            zs.next_in = const_cast<Bytef*>(cursor);
+            zs.avail_in = static_cast<uInt>(min<size_t>(remaining, 1u << 30));
+            cursor += zs.avail_in;
+        }
+        zs.next_out = reinterpret_cast<Bytef*>(outBuffer.data());
+        zs.avail_out = static_cast<uInt>(outBuffer.size());
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) break;
+        size_t produced = outBuffer.size() - zs.avail_out;
+        ioThrottle.onWrite(produced);
+        outFile.write(outBuffer.data(), static_cast<streamsize>(produced));
+        totalOut += produced;
+    }
+
+    endOffset = static_cast<size_t>(zs.next_in - data);
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+// Candidate gzip member starts: magic, deflate method and no reserved flag bits.
+vector<size_t> scanGzipMembers(const uint8_t* data, size_t size, int numThreads) {
+    const size_t slice = 16 * 1024 * 1024;
+    size_t slices = (size + slice - 1) / slice;
+    vector<vector<size_t>> found(slices);
+    parallelFor(slices, numThreads, [&](size_t s, int) {
+        size_t end = min(size, (s + 1) * slice);
+        const uint8_t* p = data + s * slice;
+        while (p < data + end) {
+            p = static_cast<const uint8_t*>(memchr(p, 0x1f, static_cast<size_t>(data + end - p)));
+            if (!p) break;
+            size_t offset = static_cast<size_t>(p - data);
+            if (offset + 10 <= size && p[1] == 0x8b && p[2] == 8 && (p[3] & 0xe0) == 0) {
+                found[s].push_back(offset);
+            }
+            p++;
+        }
+    });
+
+    vector<size_t> candidates;
+    for (auto& list : found) {
+        candidates.insert(candidates.end(), list.begin(), list.end());
+    }
+    return candidates;
+}
+
+// One candidate member. The output buffer is kept across batches and only ever grows, so
+// trials on small members neither allocate nor zero-fill; `produced` is its used length.
+struct MemberTrial {
+    size_t offset = 0;
+    size_t sizeHint = 0;
+    size_t end = 0;
+    size_t produced = 0;
+    bool ok = false;
+    bool tooLarge = false;
+    vector<char> output;
+};
+
+// Fully inflates one candidate member into memory and checks its CRC32 and ISIZE. The
+// output starts at the hint and doubles up to cap.
+void trialInflateMember(const uint8_t* data, size_t size, size_t cap, MemberTrial& trial) {
+    z_stream zs = {};
+    trial.ok = false;
+    trial.tooLarge = false;
+    trial.produced = 0;
+    if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK) return;
+
+    zs.next_in = const_cast<Bytef*>(data + trial.offset);
+    zs.avail_in = static_cast<uInt>(min<size_t>(size - trial.offset, 1u << 30));
+    size_t limit = min(cap, max<size_t>(4096, trial.sizeHint));
+    if (trial.output.size() < limit) trial.output.resize(limit);
+    limit = min(cap, trial.output.size());
+    size_t& produced = trial.produced;
+    int ret = Z_OK;
+
+    while (ret == Z_OK) {
+        if (produced == limit) {
+            if (produced >= cap) {
+                trial.tooLarge = true;
+                break;
+            }
+            limit = min(cap, produced * 2);
+            if (trial.output.size() < limit) trial.output.resize(limit);
+        }
+        zs.next_out = reinterpret_cast<Bytef*>(trial.output.data() + produced);
+        zs.avail_out = static_cast<uInt>(limit - produced);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        produced = limit - zs.avail_out;
+        if (ret == Z_BUF_ERROR && zs.avail_out != 0) break;
+        if (ret == Z_BUF_ERROR) ret = Z_OK;
+    }
+
+    if (ret == Z_STREAM_END) {
+        trial.end = static_cast<size_t>(zs.next_in - data);
+        uLong crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(trial.output.data()),
+                          static_cast<uInt>(produced));
+        trial.ok = readLittleEndian32(data + trial.end - 8) == crc &&
+                   readLittleEndian32(data + trial.end - 4) == static_cast<uint32_t>(produced);
+    }
+    inflateEnd(&zs);
+}
+
+// Decompresses a zlib stream or a (possibly multi-member) gzip file using every worker.
+// Returns false when the input is not zlib/gzip so the caller can use the plain path.
+bool decompressFileParallel(const string& inputPath, const string& outputPath, int numThreads) {
+    MappedFile input;
+    if (!input.open(inputPath)) return false;
+    StreamFormat format;
+    parseStreamHeader(input.data, input.size, format);
+    if (format == StreamFormat::Unknown) return false;
+
+    ofstream outFile(outputPath, ios::binary);
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return true;
+    }
+
+    uint64_t totalOut = 0;
+    size_t speculated = 0, bridged = 0, members = 0;
+    bool ok = true;
+
+    // One stream starting at pos: speculative parallel first, serial zlib if that is
+    // unsuitable or fails verification (its partial output is overwritten).
+    auto inflateOneStream = [&](size_t pos, size_t& end) {
+        streampos start = outFile.tellp();
+        uint64_t before = totalOut;
+        ParallelInflateResult result = inflateStreamParallel(input.data + pos, input.size - pos, outFile, numThreads,
+                                                             totalOut, end, speculated, bridged);
+        if (result == ParallelInflateResult::Ok) {
+            end += pos;
+            return true;
+        }
+        if (result == ParallelInflateResult::Failed) {
+            logMessage(LogLevel::Warn, "Parallel inflate check failed for ", inputPath, ", retrying serially");
+            outFile.seekp(start);
+            totalOut = before;
+        }
+        bool serialOk = inflateStreamSerial(input.data + pos, input.size - pos, outFile, totalOut, end);
+        end += pos;
+        return serialOk;
+    };
+
+    if (format == StreamFormat::Zlib) {
+        size_t end;
+        ok = inflateOneStream(0, end);
+        members = 1;
+    } else {
+        vector<size_t> candidates = scanGzipMembers(input.data, input.size, numThreads);
+        const size_t batchSize = static_cast<size_t>(max(1, numThreads)) * 2;
+        const size_t memberCap = 32 * 1024 * 1024;
+        size_t pos = 0;
+        auto next = candidates.begin();
+        vector<MemberTrial> trials;
+
+        while (ok && pos < input.size) {
+            if (input.size - pos < 10 || input.data[pos] != 0x1f || input.data[pos + 1] != 0x8b) {
+                if (!simd.isAllZero(input.data + pos, input.size - pos)) {
+                    logMessage(LogLevel::Warn, "Ignoring trailing garbage after gzip data in ", inputPath);
+                }
+                break;
+            }
+
+            next = lower_bound(next, candidates.end(), pos);
+            size_t count = 0;
+            auto addTrial = [&](size_t offset) {
+                if (trials.size() == count) trials.emplace_back();
+                MemberTrial& trial = trials[count++];
+                trial.offset = offset;
+                // The member most likely ends where the next candidate starts, so its
+                // trailer's ISIZE sizes the output; otherwise assume 4x expansion.
+                auto following = upper_bound(next, candidates.end(), offset);
+                size_t until = following == candidates.end() ? input.size : *following;
+                uint32_t isize = until - offset >= 18 ? readLittleEndian32(input.data + until - 4) : 0;
+                trial.sizeHint = isize && isize <= memberCap ? isize : min(memberCap, (until - offset) * 4);
+            };
+            if (next == candidates.end() || *next != pos) addTrial(pos);
+            for (auto it = next; it != candidates.end() && count < batchSize; ++it) addTrial(*it);
+
+            if (count == 1) {
+                size_t end;
+                ok = inflateOneStream(pos, end);
+                pos = end;
+                members++;
+                continue;
+            }
+
+            parallelFor(count, numThreads, [&](size_t i, int) {
+                trialInflateMember(input.data, input.size, memberCap, trials[i]);
+            });
+
+            for (size_t i = 0; i < count; ++i) {
+                const MemberTrial& trial = trials[i];
+                if (trial.offset != pos) continue;
+                if (trial.ok) {
+                    ioThrottle.onWrite(trial.produced);
+                    outFile.write(trial.output.data(), static_cast<streamsize>(trial.produced));
+                    totalOut += trial.produced;
+                    pos = trial.end;
+                } else if (trial.tooLarge) {
+                    ok = inflateOneStream(pos, pos);
+                } else {
+                    ok = false;
+                }
+                members++;
+                if (!ok) break;
+            }
+        }
+    }
+
+    outFile.close();
+    if (ok) {
+        fs::resize_file(outputPath, totalOut);
+        logMessage(LogLevel::Info, "Processed: ", inputPath, " -> ", outputPath, " (", members, " members, ",
+                   speculated, " speculative, ", bridged, " bridged chunks)");
+    } else {
+        error_code ec;
+        fs::remove(outputPath, ec);
+        logMessage(LogLevel::Error, "Error during compression/decompression: ", inputPath);
+    }
+    return true;
+}
+
+// One sequential pass over an existing zlib/gzip file, recording a checkpoint with
+// its 32 KB window roughly every span output bytes (the zran technique).
+bool buildSeekIndex(const string& inputPath, size_t span, BlockIndex& index) {
+    ifstream inFile(inputPath, ios::binary);
+    if (!inFile) return false;
+
+    z_stream zs = {};
+    if (inflateInit2(&zs, MAX_WBITS + 32) != Z_OK) return false;
+
+    vector<char> input(1024 * 1024);
+    vector<uint8_t> window(deflateWindowSize);
+    uint64_t totalIn = 0, totalOut = 0, memberOut = 0, lastCheckpoint = 0;
+    bool ok = false;
+
+    index.blocks.clear();
+    BlockIndexEntry start = {};
+    start.mode = streamStart;
+    index.blocks.push_back(start);
+
+    zs.avail_out = 0;
+    while (true) {
+        if (zs.avail_in == 0) {
+            inFile.read(input.data(), input.size());
+            zs.avail_in = static_cast<uInt>(inFile.gcount());
+            zs.next_in = reinterpret_cast<Bytef*>(input.data());
+            ioThrottle.onRead(zs.avail_in);
+            if (zs.avail_in == 0) break;
+        }
+        if (zs.avail_out == 0) {
+            zs.next_out = window.data();
+            zs.avail_out = static_cast<uInt>(window.size());
+        }
+
+        uInt inBefore = zs.avail_in, outBefore = zs.avail_out;
+        int ret = inflate(&zs, Z_BLOCK);
+        totalIn += inBefore - zs.avail_in;
+        totalOut += outBefore - zs.avail_out;
+        memberOut += outBefore - zs.avail_out;
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+            if (memberOut == 0 && index.blocks.size() > 1 && index.blocks.back().mode == streamStart &&
+                index.blocks.back().compressedOffset + 16 > totalIn) {
+                index.blocks.pop_back();
+                ok = true;
+            }
+            break;
+        }
+
+        if (ret == Z_STREAM_END) {
+            ok = true;
+            if (zs.avail_in == 0 && inFile.peek() == ifstream::traits_type::eof()) break;
+            if (zs.avail_in > 0 && zs.next_in[0] != 0x1f && zs.next_in[0] != 0x78) break;
+            inflateReset(&zs);
+            BlockIndexEntry member = {};
+            member.mode = streamStart;
+            member.compressedOffset = totalIn;
+            member.uncompressedOffset = totalOut;
+            index.blocks.push_back(member);
+            memberOut = 0;
+            lastCheckpoint = totalOut;
+            ok = false;
+            continue;
+        }
+
+        bool atBoundary = (zs.data_type & 128) && !(zs.data_type & 64);
+        if (atBoundary && totalOut - lastCheckpoint >= span) {
+            uint64_t startBit = totalIn * 8 - (zs.data_type & 7);
+            BlockIndexEntry checkpoint = {};
+            checkpoint.mode = windowCheckpoint;
+            checkpoint.compressedOffset = startBit / 8;
+            checkpoint.bits = static_cast<uint8_t>(startBit % 8);
+            checkpoint.uncompressedOffset = totalOut;
+
+            size_t have = static_cast<size_t>(min<uint64_t>(memberOut, deflateWindowSize));
+            size_t cursor = window.size() - zs.avail_out;
+            vector<uint8_t> history(have);
+            for (size_t i = 0; i < have; ++i) {
+                history[i] = window[(cursor + window.size() - have + i) % window.size()];
+            }
+            uLongf packedSize = compressBound(static_cast<uLong>(have));
+            checkpoint.window.resize(packedSize);
+            compress2(checkpoint.window.data(), &packedSize, history.data(), static_cast<uLong>(have), 9);
+            checkpoint.window.resize(packedSize);
+
+            index.blocks.push_back(move(checkpoint));
+            lastCheckpoint = totalOut;
+        }
+    }
+    inflateEnd(&zs);
+    if (!ok) return false;
+
+    index.totalIn = totalOut;
+    index.totalOut = totalIn;
+    for (size_t i = 0; i < index.blocks.size(); ++i) {
+        BlockIndexEntry& entry = index.blocks[i];
+        bool last = i + 1 == index.blocks.size();
+        uint64_t nextIn = last ? totalIn : index.blocks[i + 1].compressedOffset + 1;
+        uint64_t nextOut = last ? totalOut : index.blocks[i + 1].uncompressedOffset;
+        entry.compressedSize = static_cast<uint32_t>(min<uint64_t>(nextIn, totalIn) - entry.compressedOffset);
+        entry.uncompressedSize = static_cast<uint32_t>(nextOut - entry.uncompressedOffset);
+    }
+    return true;
+}
+
+void buildSeekIndexes(const vector<string>& inputs, int numThreads) {
+    size_t span = settings.indexSpan;
+    parallelFor(inputs.size(), numThreads, [&](size_t i, int) {
+        BlockIndex index;
+        if (!buildSeekIndex(inputs[i], span, index)) {
+            logMessage(LogLevel::Error, "Error indexing compressed file: ", inputs[i]);
+            return;
+        }
+        if (!writeBlockIndex(blockIndexPath(inputs[i]), index)) {
+            logMessage(LogLevel::Error, "Error writing output file: ", blockIndexPath(inputs[i]));
+            return;
+        }
+        logMessage(LogLevel::Info, "Indexed: ", inputs[i], " (", index.blocks.size(), " checkpoints)");
+    });
+    logger.flush();
+}
+
+void copyRange(ostream& out, const uint8_t* data, size_t size) {
+    const size_t piece = 1024 * 1024;
+    for (size_t done = 0; done < size; done += piece) {
+        size_t n = min(piece, size - done);
+        ioThrottle.onWrite(n);
+        out.write(reinterpret_cast<const char*>(data + done), static_cast<streamsize>(n));
+    }
+}
+
+struct MergeInput {
+    string path;
+    MappedFile file;
+    StreamFormat format = StreamFormat::Unknown;
+    size_t headerSize = 0;
+    BlockIndex index;
+    bool indexed = false;
+};
+
+// Joins compressed files without recompressing. gzip inputs become consecutive members;
+// zlib and raw deflate streams are stitched into one stream by clearing each final-block
+// bit, closing it with an empty stored block and combining the adler32 trailers. Only the
+// last indexed block of each input is inflated to find its final block. When every input
+// has a sidecar index, the merged index is written by shifting offsets.
+bool mergeArchives(const vector<string>& inputPaths, const string& outputPath) {
+    vector<unique_ptr<MergeInput>> inputs;
+    for (const auto& path : inputPaths) {
+        // The inputs stay mapped while the output is written, so truncating one of them
+        // would fault the merge and lose its data.
+        error_code ec;
+        if (fs::equivalent(path, outputPath, ec)) {
+            logMessage(LogLevel::Error, "Output file is one of the inputs: ", outputPath);
+            return false;
+        }
+        auto input = make_unique<MergeInput>();
+        input->path = path;
+        if (!input->file.open(path)) {
+            logMessage(LogLevel::Error, "Error opening input file: ", path);
+            return false;
+        }
+        input->headerSize = parseStreamHeader(input->file.data, input->file.size, input->format);
+        input->indexed = readBlockIndex(blockIndexPath(path), input->index);
+        if (!inputs.empty() && input->format != inputs.front()->format) {
+            logMessage(LogLevel::Error, "Cannot merge archives of different formats: ", path);
+            return false;
+        }
+        inputs.push_back(move(input));
+    }
+    if (inputs.empty()) return false;
+
+    ofstream outFile(outputPath, ios::binary);
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return false;
+    }
+
+    const StreamFormat format = inputs.front()->format;
+    const bool zlib = format == StreamFormat::Zlib;
+    bool allIndexed = true;
+    for (const auto& input : inputs) allIndexed &= input->indexed;
+    BlockIndex merged;
+    uint64_t base = 0;
+
+    if (format == StreamFormat::Gzip) {
+        for (const auto& input : inputs) {
+            copyRange(outFile, input->file.data, input->file.size);
+            for (auto entry : input->index.blocks) {
+                entry.compressedOffset += base;
+                entry.uncompressedOffset += merged.totalIn;
+                merged.blocks.push_back(move(entry));
+            }
+            merged.totalIn += input->index.totalIn;
+            base += input->file.size;
+        }
+    } else {
+        uLong adler = adler32(0L, Z_NULL, 0);
+        if (zlib) {
+            copyRange(outFile, inputs.front()->file.data, 2);
+            base = 2;
+        }
+
+        for (size_t k = 0; k < inputs.size(); ++k) {
+            MergeInput& input = *inputs[k];
+            const uint8_t* data = input.file.data;
+            uint64_t startBit = static_cast<uint64_t>(input.headerSize) * 8;
+            vector<uint8_t> window;
+
+            if (input.indexed && !input.index.blocks.empty()) {
+                const BlockIndexEntry& last = input.index.blocks.back();
+                if (last.mode != streamStart) startBit = last.compressedOffset * 8 + last.bits;
+                if (last.mode == windowCheckpoint) {
+                    window.resize(deflateWindowSize);
+                    uLongf windowSize = static_cast<uLongf>(window.size());
+                    if (uncompress(window.data(), &windowSize, last.window.data(),
+                                   static_cast<uLong>(last.window.size())) != Z_OK) {
+                        return false;
+                    }
+                    window.resize(windowSize);
+                }
+            }
+
+            uint64_t inflated = 0;
+            uint64_t finalHeaderBit = startBit;
+            uint64_t endBit = 0;
+            bool finalBlock = false;
+            auto countBytes = [&](const uint8_t*, size_t n) { inflated += n; };
+            if (!inflateFromBoundary(data, input.file.size, startBit, window, UINT64_MAX, countBytes, endBit,
+                                     finalBlock, &finalHeaderBit)) {
+                logMessage(LogLevel::Error, "Error locating final deflate block in ", input.path);
+                return false;
+            }
+            uint64_t length = input.indexed ? input.index.totalIn : inflated;
+            size_t endByte = static_cast<size_t>((endBit + 7) / 8);
+            if (zlib) {
+                if (endByte + 4 > input.file.size) return false;
+                adler = adler32_combine(adler, readBigEndian32(data + endByte), static_cast<z_off_t>(length));
+            }
+
+            // Everything before the byte holding the final block's header is copied untouched.
+            size_t begin = input.headerSize;
+            size_t flagByte = static_cast<size_t>(finalHeaderBit / 8);
+            bool lastInput = k + 1 == inputs.size();
+            vector<uint8_t> tail(data + flagByte, data + endByte);
+            if (!lastInput) {
+                tail[0] &= static_cast<uint8_t>(~(1u << (finalHeaderBit % 8)));
+                unsigned endBits = static_cast<unsigned>(endBit % 8);
+                if (endBits) tail.back() &= static_cast<uint8_t>((1u << endBits) - 1);
+                if (endBits == 0 || endBits > 5) tail.push_back(0);
+                tail.insert(tail.end(), {0x00, 0x00, 0xff, 0xff});
+            }
+            copyRange(outFile, data + begin, flagByte - begin);
+            copyRange(outFile, tail.data(), tail.size());
+
+            size_t mergedBefore = merged.blocks.size();
+            for (auto entry : input.index.blocks) {
+                if (k > 0 && entry.mode == streamStart) {
+                    // The stitched stream has no header here and no history before this point.
+                    entry.mode = independentBlock;
+                    entry.compressedOffset = begin;
+                    entry.bits = 0;
+                }
+                entry.compressedOffset = entry.compressedOffset - begin + base;
+                entry.uncompressedOffset += merged.totalIn;
+                merged.blocks.push_back(move(entry));
+            }
+            if (!lastInput && !input.index.blocks.empty()) {
+                merged.blocks.back().compressedSize += static_cast<uint32_t>(tail.size() - (endByte - flagByte));
+                // A line may run across the seam, so the blocks on either side are always searched.
+                merged.blocks.back().tokenFilter.clear();
+            }
+            if (k > 0 && merged.blocks.size() > mergedBefore) merged.blocks[mergedBefore].tokenFilter.clear();
+            merged.totalIn += length;
+            base += (flagByte - begin) + tail.size();
+        }
+
+        if (zlib) {
+            uint8_t trailer[4];
+            for (int i = 0; i < 4; ++i) trailer[i] = static_cast<uint8_t>(adler >> (24 - 8 * i));
+            copyRange(outFile, trailer, sizeof(trailer));
+            base += sizeof(trailer);
+        }
+    }
+    merged.totalOut = base;
+
+    outFile.close();
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error writing output file: ", outputPath);
+        return false;
+    }
+    error_code ec;
+    if (!allIndexed) {
+        fs::remove(blockIndexPath(outputPath), ec);
+    } else if (!writeBlockIndex(blockIndexPath(outputPath), merged)) {
+        // A half-written or stale index would misplace every seek into the merged archive.
+        fs::remove(blockIndexPath(outputPath), ec);
+        fs::remove(outputPath, ec);
+        logMessage(LogLevel::Error, "Error writing block index: ", blockIndexPath(outputPath));
+        return false;
+    }
+    logMessage(LogLevel::Info, "Merged ", inputs.size(), " archives into ", outputPath, " (", base, " bytes)");
+    return true;
+}
+
+struct PhysicalLocation {
+    uint64_t device = 0;
+    bool hasExtent = false;   // offset is a physical byte address rather than an inode number
+    uint64_t offset = 0;
+};
+
+PhysicalLocation locateFile(const string& path) {
+    PhysicalLocation location;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return location;
+    location.device = static_cast<uint64_t>(st.st_dev);
+    location.offset = static_cast<uint64_t>(st.st_ino);
+
+#ifdef __linux__
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return location;
+    alignas(struct fiemap) char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] = {};
+    struct fiemap* map = reinterpret_cast<struct fiemap*>(request);
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0) {
+        location.hasExtent = true;
+        location.offset = map->fm_extents[0].fe_physical;
+    }
+    close(fd);
+#endif
+    return location;
+}
+
+// File contents handed from a device reader to a compressor, bounded by a shared byte budget.
+struct ReadAheadFile {
+    CompressionTask task;
+    deque<BufferSlice> chunks;
+    bool finished = false;
+    bool failed = false;
+    bool consumerWaiting = false;
+};
+
+// Readers fill pooled slabs and pass slices of them on, packing consecutive small files
+// into one slab; the budget counts slabs still referenced anywhere downstream.
+class ReadAheadPipeline {
+public:
+    static constexpr size_t slabSize = 1024 * 1024;
+
+    explicit ReadAheadPipeline(size_t budgetBytes) : budget(budgetBytes), pool(slabSize) {}
+
+    void publish(ReadAheadFile* file) {
+        lock_guard<mutex> lock(m);
+        ready.push_back(file);
+        cv.notify_all();
+    }
+
+    // Returns an empty slab to read `file` into. A reader is admitted past the budget when
+    // the file's consumer is starved, so readers never deadlock against compressors waiting
+    // on partially read files.
+    BufferSlice reserve(ReadAheadFile* file) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]() { return pool.outstandingBytes() + slabSize <= budget || file->consumerWaiting; });
+        return pool.acquire();
+    }
+
+    // Reads up to `limit` bytes of `in` into the reader's current slab, taking a fresh one
+    // when too little of it is left, and queues them for the file's consumer. Returns the
+    // number of bytes read.
+    size_t readInto(ReadAheadFile* file, istream& in, BufferSlice& space, size_t limit = SIZE_MAX) {
+        if (space.size() < min<size_t>(limit, 64 * 1024)) {
+            space.reset();
+            space = reserve(file);
+        }
+        in.read(space.data(), static_cast<streamsize>(min(limit, space.size())));
+        size_t bytesRead = static_cast<size_t>(in.gcount());
+        if (bytesRead == 0) return 0;
+        ioThrottle.onRead(bytesRead);
+        push(file, space.slice(0, bytesRead));
+        space = space.slice(bytesRead, space.size() - bytesRead);
+        return bytesRead;
+    }
+
+    void push(ReadAheadFile* file, BufferSlice chunk) {
+        lock_guard<mutex> lock(m);
+        file->chunks.push_back(move(chunk));
+        cv.notify_all();
+    }
+
+    void finish(ReadAheadFile* file, bool failed) {
+        lock_guard<mutex> lock(m);
+        file->finished = true;
+        file->failed = failed;
+        cv.notify_all();
+    }
+
+    void readersDone() {
+        lock_guard<mutex> lock(m);
+        readingComplete = true;
+        cv.notify_all();
+    }
+
+    ReadAheadFile* nextFile() {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]() { return !ready.empty() || readingComplete; });
+        if (ready.empty()) return nullptr;
+        ReadAheadFile* file = ready.front();
+        ready.pop_front();
+        return file;
+    }
+
+    // Replaces `chunk` with the file's next slice, releasing the previous one.
+    bool nextChunk(ReadAheadFile* file, BufferSlice& chunk) {
+        unique_lock<mutex> lock(m);
+        chunk.reset();
+        file->consumerWaiting = true;
+        cv.notify_all();
+        cv.wait(lock, [&]() { return !file->chunks.empty() || file->finished; });
+        file->consumerWaiting = false;
+        if (file->chunks.empty()) return false;
+        chunk = move(file->chunks.front());
+        file->chunks.pop_front();
+        return true;
+    }
+
+    const BufferPool& buffers() const { return pool; }
+
+private:
+    mutex m;
+    condition_variable cv;
+    size_t budget;
+    BufferPool pool;
+    deque<ReadAheadFile*> ready;
+    bool readingComplete = false;
+};
+
+class ReadAheadStreamBuf : public streambuf {
+public:
+    ReadAheadStreamBuf(ReadAheadPipeline& pipeline, ReadAheadFile* file) : pipeline(pipeline), file(file) {}
+
+protected:
+    int_type underflow() override {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        if (!pipeline.nextChunk(file, current) || current.empty()) return traits_type::eof();
+        setg(current.data(), current.data(), current.data() + current.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+private:
+    ReadAheadPipeline& pipeline;
+    ReadAheadFile* file;
+    BufferSlice current;
+};
+
+// Reads files in physical order with a few readers per device while compressors consume
+// the prefetched data, instead of every worker seeking on the same spindle.
+void processFilesByLayout(const TaskList& tasks, int numThreads) {
+    vector<PhysicalLocation> locations(tasks.size());
+    parallelFor(tasks.size(), numThreads, [&](size_t i, int) {
+        string inputPath;
+        tasks.inputPath(i, inputPath);
+        locations[i] = locateFile(inputPath);
+    });
+
+    map<uint64_t, vector<size_t>> byDevice;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        byDevice[locations[i].device].push_back(i);
+    }
+    for (auto& entry : byDevice) {
+        sort(entry.second.begin(), entry.second.end(), [&](size_t a, size_t b) {
+            const auto& la = locations[a];
+            const auto& lb = locations[b];
+            return make_pair(!la.hasExtent, la.offset) < make_pair(!lb.hasExtent, lb.offset);
+        });
+    }
+
+    vector<ReadAheadFile> files(tasks.size());
+    ReadAheadPipeline pipeline(settings.readAheadBytes);
+
+    vector<thread> readers;
+    vector<unique_ptr<atomic<size_t>>> cursors;
+    for (auto& entry : byDevice) {
+        cursors.push_back(make_unique<atomic<size_t>>(0));
+        const vector<size_t>* order = &entry.second;
+        atomic<size_t>* cursor = cursors.back().get();
+        for (int r = 0; r < settings.readersPerDevice; ++r) {
+            readers.emplace_back([&, order, cursor]() {
+                applyWorkerQos();
+                BufferSlice space;
+                while (true) {
+                    size_t position = cursor->fetch_add(1);
+                    if (position >= order->size()) return;
+                    size_t i = (*order)[position];
+                    ReadAheadFile* file = &files[i];
+                    file->task = tasks[i];
+
+                    ifstream inFile(file->task.inputPath, ios::binary);
+                    pipeline.publish(file);
+                    if (!inFile) {
+                        pipeline.finish(file, true);
+                        continue;
+                    }
+                    while (pipeline.readInto(file, inFile, space) > 0) {}
+                    pipeline.finish(file, inFile.bad());
+                }
+            });
+        }
+    }
+
+    vector<thread> compressors;
+    for (int i = 0; i < numThreads; ++i) {
+        compressors.emplace_back([&]() {
+            applyWorkerQos();
+            while (ReadAheadFile* file = pipeline.nextFile()) {
+                ReadAheadStreamBuf buffer(pipeline, file);
+                istream in(&buffer);
+                const CompressionTask& task = file->task;
+                if (in.peek() == istream::traits_type::eof() && file->failed) {
+                    logMessage(LogLevel::Error, "Error opening input file: ", task.inputPath);
+                    continue;
+                }
+                processStream(in, task.inputPath, task.outputPath, task.compress, task.level, false);
+            }
+        });
+    }
+
+    for (auto& t : readers) {
+        t.join();
+    }
+    pipeline.readersDone();
+    for (auto& t : compressors) {
+        t.join();
+    }
+    logMessage(LogLevel::Debug, "Read-ahead peak: ", pipeline.buffers().peakBytes() / (1024 * 1024), " MB in ",
+               pipeline.buffers().slabsAllocated(), " slabs");
+}
+
+struct TarEntry {
+    fs::path path;
+    string name;        // archive member name, directories end with '/'
+    char type;          // '0' regular file, '2' symlink, '5' directory
+    string link;
+    string user, group;
+    struct stat st;
+};
+
+// Walks the directory in name order; entries are stored under the directory's own name,
+// as `tar czf out.tar.gz dir` does.
+vector<TarEntry> collectTarEntries(const string& rootPath) {
+    vector<TarEntry> entries;
+    fs::path root = fs::path(rootPath).lexically_normal();
+    if (root.filename().empty()) root = root.parent_path();
+    fs::path base = root.parent_path();
+    map<uid_t, string> users;
+    map<gid_t, string> groups;
+
+    auto add = [&](const fs::path& path) {
+        TarEntry entry;
+        entry.path = path;
+        entry.name = path.lexically_relative(base).generic_string();
+        if (lstat(path.c_str(), &entry.st) != 0) {
+            logMessage(LogLevel::Warn, "Skipping unreadable entry: ", path.string());
+            return;
+        }
+        if (S_ISDIR(entry.st.st_mode)) {
+            entry.type = '5';
+            entry.name += '/';
+        } else if (S_ISREG(entry.st.st_mode)) {
+            entry.type = '0';
+        } else if (S_ISLNK(entry.st.st_mode)) {
+            entry.type = '2';
+            entry.link = fs::read_symlink(path).string();
+        } else {
+            logMessage(LogLevel::Warn, "Skipping special file: ", path.string());
+            return;
+        }
+        auto user = users.find(entry.st.st_uid);
+        if (user == users.end()) {
+            const passwd* pw = getpwuid(entry.st.st_uid);
+            user = users.emplace(entry.st.st_uid, pw ? pw->pw_name : "").first;
+        }
+        auto group = groups.find(entry.st.st_gid);
+        if (group == groups.end()) {
+            const struct group* gr = getgrgid(entry.st.st_gid);
+            group = groups.emplace(entry.st.st_gid, gr ? gr->gr_name : "").first;
+        }
+        entry.user = user->second.substr(0, 31);
+        entry.group = group->second.substr(0, 31);
+        entries.push_back(move(entry));
+    };
+
+    add(root);
+    vector<fs::path> paths;
+    error_code ec;
+    for (auto it = fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied, ec);
+         it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        paths.push_back(it->path());
+    }
+    sort(paths.begin(), paths.end());
+    for (const auto& path : paths) add(path);
+    return entries;
+}
+
+void appendPaxRecord(string& records, const string& key, const string& value) {
+    size_t length = key.size() + value.size() + 3;
+    length += to_string(length).size();
+    if (to_string(length).size() + key.size() + value.size() + 3 != length) length++;
+    records += to_string(length) + " " + key + "=" + value + "\n";
+}
+
+// Finds where a long name can be split into the 155-byte prefix and 100-byte name fields;
+// split is npos when the name fits as is.
+bool splitUstarName(const string& name, size_t& split) {
+    split = string::npos;
+    if (name.size() <= 100) return true;
+    size_t slash = name.rfind('/', name.size() - 2);
+    while (slash != string::npos && slash > 155) slash = slash ? name.rfind('/', slash - 1) : string::npos;
+    if (slash == string::npos || name.size() - slash - 1 > 100) return false;
+    split = slash;
+    return true;
+}
+
+// Builds a ustar header. Names and link targets that do not fit, and sizes and ids beyond
+// their octal fields, are carried in a preceding pax extended header.
+void appendTarHeader(vector<char>& out, const TarEntry& entry) {
+    auto header = [&](const string& name, char type, uint64_t size, const string& link) {
+        char block[512] = {};
+        auto octal = [&](size_t offset, size_t width, uint64_t value) {
+            char digits[24];
+            snprintf(digits, sizeof(digits), "%0*llo", static_cast<int>(width - 1),
+                     static_cast<unsigned long long>(value));
+            memcpy(block + offset, digits, width - 1);
+        };
+        string field = name;
+        size_t split;
+        if (splitUstarName(field, split) && split != string::npos) {
+            memcpy(block + 345, field.data(), split);
+            field = field.substr(split + 1);
+        }
+        memcpy(block, field.data(), min<size_t>(field.size(), 100));
+        octal(100, 8, entry.st.st_mode & 07777);
+        octal(108, 8, entry.st.st_uid <= 07777777 ? entry.st.st_uid : 0);
+        octal(116, 8, entry.st.st_gid <= 07777777 ? entry.st.st_gid : 0);
+        octal(124, 12, size < 077777777777ull ? size : 0);
+        octal(136, 12, static_cast<uint64_t>(max<time_t>(0, entry.st.st_mtime)));
+        block[156] = type;
+        memcpy(block + 157, link.data(), min<size_t>(link.size(), 100));
+        memcpy(block + 257, "ustar", 6);
+        memcpy(block + 263, "00", 2);
+        memcpy(block + 265, entry.user.data(), entry.user.size());
+        memcpy(block + 297, entry.group.data(), entry.group.size());
+
+        memset(block + 148, ' ', 8);
+        unsigned sum = 0;
+        for (unsigned char c : block) sum += c;
+        snprintf(block + 148, 8, "%06o", sum);
+        out.insert(out.end(), block, block + sizeof(block));
+    };
+
+    uint64_t size = entry.type == '0' ? static_cast<uint64_t>(entry.st.st_size) : 0;
+    size_t split;
+    string records;
+    if (!splitUstarName(entry.name, split)) appendPaxRecord(records, "path", entry.name);
+    if (entry.link.size() > 100) appendPaxRecord(records, "linkpath", entry.link);
+    if (size >= 077777777777ull) appendPaxRecord(records, "size", to_string(size));
+    if (entry.st.st_uid > 07777777) appendPaxRecord(records, "uid", to_string(entry.st.st_uid));
+    if (entry.st.st_gid > 07777777) appendPaxRecord(records, "gid", to_string(entry.st.st_gid));
+    if (!records.empty()) {
+        header("PaxHeaders/" + entry.path.filename().string().substr(0, 80), 'x', records.size(), "");
+        out.insert(out.end(), records.begin(), records.end());
+        out.resize((out.size() + 511) / 512 * 512, 0);
+    }
+    header(entry.name, entry.type, size, entry.link);
+}
+
+// Produces the tar stream in order: headers come from the walk, file contents from the
+// read-ahead pipeline that prefetches them in parallel.
+class TarStreamProducer {
+public:
+    TarStreamProducer(const vector<TarEntry>& entries, vector<ReadAheadFile>& files, ReadAheadPipeline& pipeline)
+        : entries(entries), files(files), pipeline(pipeline) {}
+
+    // Replaces `block` with up to `size` bytes of the stream; returns false once it is complete.
+    bool fill(vector<char>& block, size_t size) {
+        block.clear();
+        while (block.size() < size) {
+            if (stagedPos < staged.size()) {
+                size_t n = min(size - block.size(), staged.size() - stagedPos);
+                block.insert(block.end(), staged.begin() + stagedPos, staged.begin() + stagedPos + n);
+                stagedPos += n;
+                produced += n;
+            } else if (fileRemaining > 0) {
+                if (chunkPos == chunk.size() && !truncated) {
+                    chunkPos = 0;
+                    if (!pipeline.nextChunk(&files[fileIndex], chunk)) {
+                        // The file shrank while being archived; pad it to the size in its header.
+                        logMessage(LogLevel::Warn, "File changed as we read it: ", entries[entryIndex - 1].path.string());
+                        truncated = true;
+                    }
+                }
+                size_t n;
+                if (truncated) {
+                    n = static_cast<size_t>(min<uint64_t>(size - block.size(), fileRemaining));
+                    block.insert(block.end(), n, 0);
+                } else {
+                    n = static_cast<size_t>(min<uint64_t>({size - block.size(), chunk.size() - chunkPos, fileRemaining}));
+                    block.insert(block.end(), chunk.data() + chunkPos, chunk.data() + chunkPos + n);
+                    chunkPos += n;
+                }
+                fileRemaining -= n;
+                produced += n;
+                if (fileRemaining == 0) {
+                    drainFile();
+                    staged.assign((512 - produced % 512) % 512, 0);
+                    stagedPos = 0;
+                }
+            } else if (!stageNext()) {
+                break;
+            }
+        }
+        return !block.empty();
+    }
+
+    // Consumes the remaining prefetched files so readers can finish after a failure.
+    void discardRemaining() {
+        BufferSlice extra;
+        for (; fileIndex < files.size(); ++fileIndex) {
+            while (pipeline.nextChunk(&files[fileIndex], extra)) {}
+        }
+    }
+
+private:
+    // Waits for the reader to finish the current file and moves to the next one.
+    void drainFile() {
+        BufferSlice extra;
+        while (pipeline.nextChunk(&files[fileIndex], extra)) {}
+        if (files[fileIndex].failed) {
+            logMessage(LogLevel::Error, "Error reading input file: ", entries[entryIndex - 1].path.string());
+        }
+        chunk.reset();
+        chunkPos = 0;
+        truncated = false;
+        fileIndex++;
+    }
+
+    bool stageNext() {
+        staged.clear();
+        stagedPos = 0;
+        if (entryIndex < entries.size()) {
+            const TarEntry& entry = entries[entryIndex++];
+            appendTarHeader(staged, entry);
+            if (entry.type == '0') {
+                fileRemaining = static_cast<uint64_t>(entry.st.st_size);
+                if (fileRemaining == 0) drainFile();
+            }
+            return true;
+        }
+        if (trailerStaged) return false;
+        // Two zero blocks end the archive, padded to the default 10 KB record size.
+        trailerStaged = true;
+        staged.assign(1024 + (10240 - (produced + 1024) % 10240) % 10240, 0);
+        return true;
+    }
+
+    const vector<TarEntry>& entries;
+    vector<ReadAheadFile>& files;
+    ReadAheadPipeline& pipeline;
+    size_t entryIndex = 0;
+    size_t fileIndex = 0;
+    uint64_t fileRemaining = 0;
+    uint64_t produced = 0;
+    vector<char> staged;
+    size_t stagedPos = 0;
+    BufferSlice chunk;
+    size_t chunkPos = 0;
+    bool truncated = false;
+    bool trailerStaged = false;
+};
+
+// Packs a directory into a gzip-compressed tar in one pipeline: readers prefetch file
+// contents in parallel, the tar stream is cut into blocks in order, and blocks are deflated
+// independently in parallel into a single gzip member with a combined crc32. A block
+// index is written alongside, as for block-mode archives.
+bool createTarGz(const string& inputDir, const string& outputPath, int level, int numThreads) {
+    vector<TarEntry> entries = collectTarEntries(inputDir);
+    vector<const TarEntry*> regular;
+    for (const auto& entry : entries) {
+        if (entry.type == '0') regular.push_back(&entry);
+    }
+
+    ofstream outFile(outputPath, ios::binary);
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return false;
+    }
+    const unsigned char gzipHeader[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, static_cast<unsigned char>(level >= 9 ? 2 : level == 1 ? 4 : 0), 3};
+    outFile.write(reinterpret_cast<const char*>(gzipHeader), sizeof(gzipHeader));
+    // A truncated archive, or one next to a stale index, would pass for a complete one.
+    auto fail = [&](const char* reason, const string& path) {
+        outFile.close();
+        error_code ec;
+        fs::remove(outputPath, ec);
+        fs::remove(blockIndexPath(outputPath), ec);
+        logMessage(LogLevel::Error, reason, path);
+        return false;
+    };
+
+    vector<ReadAheadFile> files(regular.size());
+    ReadAheadPipeline pipeline(settings.readAheadBytes);
+    atomic<size_t> cursor{0};
+
+    // Readers claim files in archive order, so the file the packer waits on is always owned
+    // by a reader that the pipeline admits past the budget.
+    vector<thread> readers;
+    for (int r = 0; r < max(1, numThreads); ++r) {
+        readers.emplace_back([&]() {
+            applyWorkerQos();
+            BufferSlice space;
+            while (true) {
+                size_t i = cursor.fetch_add(1);
+                if (i >= regular.size()) return;
+                ifstream inFile(regular[i]->path, ios::binary);
+                if (!inFile) {
+                    pipeline.finish(&files[i], true);
+                    continue;
+                }
+                // Only the size recorded in the header is read; growth after the walk is ignored.
+                uint64_t remaining = static_cast<uint64_t>(regular[i]->st.st_size);
+                while (remaining > 0) {
+                    size_t bytesRead = pipeline.readInto(&files[i], inFile, space,
+                                                         static_cast<size_t>(min<uint64_t>(remaining, SIZE_MAX)));
+                    if (bytesRead == 0) break;
+                    remaining -= bytesRead;
+                }
+                pipeline.finish(&files[i], inFile.bad());
+            }
+        });
+    }
+
+    struct Block {
+        vector<char> input;
+        vector<char> output;
+        uLong crc;
+        int strategy;
+        bool last;
+        bool ok;
+    };
+
+    TarStreamProducer producer(entries, files, pipeline);
+    const size_t blockSize = settings.blockSize;
+    const size_t batchBlocks = static_cast<size_t>(max(1, numThreads)) * 4;
+    vector<Block> batch(batchBlocks + 1);
+    vector<DeflateContextCache> contexts(max(1, numThreads));
+
+    BlockIndex index;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint64_t compressedOffset = sizeof(gzipHeader);
+    bool ok = true;
+
+    // One block is read ahead so the final block is known before it is compressed.
+    bool more = producer.fill(batch[0].input, blockSize);
+    bool done = !more;
+    while (!done && ok) {
+        size_t filled = 0;
+        while (filled < batchBlocks && !done) {
+            Block& block = batch[filled];
+            more = producer.fill(batch[filled + 1].input, blockSize);
+            block.last = !more;
+            done = !more;
+            filled++;
+        }
+
+        parallelFor(filled, numThreads, [&](size_t i, int workerId) {
+            Block& block = batch[i];
+            block.crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(block.input.data()),
+                              static_cast<uInt>(block.input.size()));
+            block.ok = deflateIndependentBlock(contexts[workerId], level, block.input.data(), block.input.size(),
+                                               block.last, block.output, block.strategy);
+        });
+
+        for (size_t i = 0; i < filled; ++i) {
+            Block& block = batch[i];
+            if (!block.ok) {
+                ok = false;
+                break;
+            }
+            ioThrottle.onWrite(block.output.size());
+            outFile.write(block.output.data(), block.output.size());
+            crc = crc32_combine(crc, block.crc, static_cast<z_off_t>(block.input.size()));
+
+            BlockIndexEntry entry;
+            entry.compressedOffset = compressedOffset;
+            entry.uncompressedOffset = index.totalIn;
+            entry.compressedSize = static_cast<uint32_t>(block.output.size());
+            entry.uncompressedSize = static_cast<uint32_t>(block.input.size());
+            entry.strategy = static_cast<uint8_t>(block.strategy);
+            index.blocks.push_back(entry);
+            strategyMix[block.strategy]++;
+
+            compressedOffset += block.output.size();
+            index.totalIn += block.input.size();
+        }
+        swap(batch[0].input, batch[filled].input);
+    }
+
+    if (!ok) producer.discardRemaining();
+    for (auto& t : readers) {
+        t.join();
+    }
+    logMessage(LogLevel::Debug, "Read-ahead peak: ", pipeline.buffers().peakBytes() / (1024 * 1024), " MB in ",
+               pipeline.buffers().slabsAllocated(), " slabs");
+    if (!ok) return fail("Error during compression/decompression: ", inputDir);
+
+    uint32_t trailer[2] = {static_cast<uint32_t>(crc), static_cast<uint32_t>(index.totalIn)};
+    for (uint32_t value : trailer) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            outFile.put(static_cast<char>((value >> shift) & 0xff));
+        }
+    }
+    index.totalOut = compressedOffset + 8;
+
+    if (!outFile.flush() || !writeBlockIndex(blockIndexPath(outputPath), index)) {
+        return fail("Error writing output file: ", outputPath);
+    }
+
+    logMessage(LogLevel::Info, "Archived: ", inputDir, " -> ", outputPath, " (", entries.size(), " entries, ",
+               index.blocks.size(), " blocks)");
+    return true;
+}
+
+// Descriptor of an output directory; descriptors opened past the cache budget are owned
+// by the handle and closed with it.
+class DirectoryHandle {
+public:
+    DirectoryHandle() = default;
+    DirectoryHandle(int fd, bool owned) : fd(fd), owned(owned) {}
+    DirectoryHandle(DirectoryHandle&& other) noexcept : fd(other.fd), owned(other.owned) { other.owned = false; }
+    DirectoryHandle(const DirectoryHandle&) = delete;
+    DirectoryHandle& operator=(const DirectoryHandle&) = delete;
+    ~DirectoryHandle() {
+        if (owned) close(fd);
+    }
+
+    int get() const { return fd; }
+    explicit operator bool() const { return fd >= 0; }
+
+private:
+    int fd = -1;
+    bool owned = false;
+};
+
+// Creates each output directory once and keeps descriptors for the directories in use, so
+// writers resolve only the last path component. Every component below the root is opened
+// with O_NOFOLLOW relative to its parent, so a symlink planted by the archive is never
+// followed; past the descriptor limit the walk starts again from the nearest cached parent.
+class DirectoryCache {
+public:
+    explicit DirectoryCache(string root) : root(move(root)) {
+        rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+            maxDescriptors = static_cast<size_t>(limit.rlim_cur / 4);
+        }
+    }
+
+    ~DirectoryCache() {
+        for (auto& entry : directories) {
+            close(entry.second);
+        }
+    }
+
+    // Returns the directory, created if missing, or an invalid handle when it cannot be
+    // opened without following a symlink.
+    DirectoryHandle open(const string& relative) {
+        lock_guard<mutex> lock(m);
+        return openLocked(relative);
+    }
+
+    // Splits a member name into its directory and last component.
+    static pair<string, string> split(const string& name) {
+        size_t slash = name.rfind('/');
+        if (slash == string::npos) return {"", name};
+        return {name.substr(0, slash), name.substr(slash + 1)};
+    }
+
+    string fullPath(const string& relative) const {
+        return relative.empty() ? root : root + "/" + relative;
+    }
+
+    size_t createdCount() const {
+        return created;
+    }
+
+private:
+    DirectoryHandle openLocked(const string& relative) {
+        auto found = directories.find(relative);
+        if (found != directories.end()) return DirectoryHandle(found->second, false);
+
+        int fd;
+        if (relative.empty()) {
+            if (mkdir(root.c_str(), 0755) == 0) created++;
+            fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        } else {
+            auto parts = split(relative);
+            DirectoryHandle parent = openLocked(parts.first);
+            if (!parent) return DirectoryHandle();
+            if (mkdirat(parent.get(), parts.second.c_str(), 0755) == 0) created++;
+            fd = openat(parent.get(), parts.second.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        if (fd < 0) return DirectoryHandle();
+        if (!relative.empty() && directories.size() >= maxDescriptors) return DirectoryHandle(fd, true);
+        directories.emplace(relative, fd);
+        return DirectoryHandle(fd, false);
+    }
+
+    string root;
+    mutex m;
+    unordered_map<string, int> directories;
+    size_t maxDescriptors = 256;
+    size_t created = 0;
+};
+
+// Signalled once a member's file is closed, so a later member with the same name can wait.
+struct MemberClosed {
+    mutex m;
+    condition_variable cv;
+    bool closed = false;
+
+    void signal() {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        cv.notify_all();
+    }
+
+    void wait() {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]() { return closed; });
+    }
+
+    bool done() {
+        lock_guard<mutex> lock(m);
+        return closed;
+    }
+};
+
+// One regular archive member being written. Whichever writer gets the first piece creates
+// it, and the writer dropping the last reference applies mode and mtime and closes it.
+// A member whose name appeared earlier in the archive (tar -r, tar -u) is created only
+// after the earlier copy is closed, so the last copy wins as it does with tar.
+struct ExtractedFile {
+    string name;
+    mode_t mode;
+    time_t mtime;
+    DirectoryCache* directories;
+    once_flag created;
+    int fd = -1;
+    atomic<bool> failed{false};
+    atomic<bool> reported{false};
+    shared_ptr<MemberClosed> closed = make_shared<MemberClosed>();
+    shared_ptr<MemberClosed> previous;
+
+    void create() {
+        // Pieces are handed out in archive order, so the earlier copy's last piece is
+        // already with another writer and this wait always ends.
+        if (previous) previous->wait();
+        auto parts = DirectoryCache::split(name);
+        DirectoryHandle dir = directories->open(parts.first);
+        if (!dir) {
+            failed = true;
+            return;
+        }
+        const char* target = parts.second.c_str();
+        fd = openat(dir.get(), target, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0 && (errno == ELOOP || errno == EISDIR)) {
+            unlinkat(dir.get(), target, 0);
+            fd = openat(dir.get(), target, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+        }
+        failed = fd < 0;
+    }
+
+    ~ExtractedFile() {
+        if (fd >= 0) {
+            timespec times[2] = {{mtime, 0}, {mtime, 0}};
+            fchmod(fd, mode);
+            futimens(fd, times);
+            close(fd);
+        }
+        closed->signal();
+    }
+};
+
+struct ExtractJob {
+    shared_ptr<ExtractedFile> file;
+    uint64_t offset = 0;
+    vector<char> data;
+};
+
+// Hands decoded pieces to the writer pool, holding the decoder back once the bytes in
+// flight reach the budget.
+class ExtractQueue {
+public:
+    explicit ExtractQueue(size_t budgetBytes) : budget(budgetBytes) {}
+
+    void push(ExtractJob job) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]() { return inFlight == 0 || inFlight + job.data.size() <= budget; });
+        inFlight += job.data.size();
+        jobs.push_back(move(job));
+        cv.notify_all();
+    }
+
+    bool pop(ExtractJob& job) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&]() { return !jobs.empty() || closed; });
+        if (jobs.empty()) return false;
+        job = move(jobs.front());
+        jobs.pop_front();
+        return true;
+    }
+
+    void complete(size_t bytes) {
+        lock_guard<mutex> lock(m);
+        inFlight -= bytes;
+        cv.notify_all();
+    }
+
+    void close() {
+        lock_guard<mutex> lock(m);
+        closed = true;
+        cv.notify_all();
+    }
+
+private:
+    mutex m;
+    condition_variable cv;
+    deque<ExtractJob> jobs;
+    size_t budget;
+    size_t inFlight = 0;
+    bool closed = false;
+};
+
+// Parses an absolute or relative archive path into a relative one, refusing '..'.
+bool sanitizeMemberName(const string& raw, string& name) {
+    name.clear();
+    size_t pos = 0;
+    while (pos <= raw.size()) {
+        size_t slash = raw.find('/', pos);
+        if (slash == string::npos) slash = raw.size();
+        string component = raw.substr(pos, slash - pos);
+        pos = slash + 1;
+        if (component.empty() || component == ".") continue;
+        if (component == "..") return false;
+        if (!name.empty()) name += '/';
+        name += component;
+    }
+    return !name.empty();
+}
+
+uint64_t parseTarNumber(const char* field, size_t width) {
+    uint64_t value = 0;
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        value = static_cast<unsigned char>(field[0]) & 0x7f;
+        for (size_t i = 1; i < width; ++i) value = (value << 8) | static_cast<unsigned char>(field[i]);
+        return value;
+    }
+    for (size_t i = 0; i < width && field[i]; ++i) {
+        if (field[i] >= '0' && field[i] <= '7') value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+// Pipeline sink that parses the decompressed tar stream and turns every member into jobs
+// for the writer pool. Symlinks, hard links and directory metadata are applied after the
+// writers finish, as GNU tar does: later members would otherwise change them or not exist
+// yet, and no regular member can be written through a symlink from the archive.
+class TarExtractSink {
+public:
+    TarExtractSink(DirectoryCache& directories, ExtractQueue& queue) : directories(directories), queue(queue) {}
+
+    bool write(const char* data, size_t size) {
+        while (size > 0 && state != State::End && !broken) {
+            size_t n;
+            if (state == State::Header) {
+                n = min(size, sizeof(header) - headerFill);
+                memcpy(header + headerFill, data, n);
+                headerFill += n;
+                if (headerFill == sizeof(header)) {
+                    headerFill = 0;
+                    parseHeader();
+                }
+            } else if (state == State::Padding) {
+                n = static_cast<size_t>(min<uint64_t>(size, padding));
+                padding -= n;
+                if (padding == 0) state = State::Header;
+            } else {
+                n = static_cast<size_t>(min<uint64_t>(size, remaining));
+                consumePayload(data, n);
+                remaining -= n;
+                if (remaining == 0) finishPayload();
+            }
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool finish() {
+        for (const auto& link : hardLinks) {
+            auto path = DirectoryCache::split(link.first);
+            auto target = DirectoryCache::split(link.second);
+            DirectoryHandle pathDir = directories.open(path.first);
+            DirectoryHandle targetDir = directories.open(target.first);
+            if (pathDir) unlinkat(pathDir.get(), path.second.c_str(), 0);
+            if (!pathDir || !targetDir ||
+                linkat(targetDir.get(), target.second.c_str(), pathDir.get(), path.second.c_str(), 0) != 0) {
+                logMessage(LogLevel::Error, "Error creating hard link: ", directories.fullPath(link.first));
+                broken = true;
+            }
+        }
+        for (const auto& symlink : symlinks) {
+            auto path = DirectoryCache::split(get<0>(symlink));
+            DirectoryHandle dir = directories.open(path.first);
+            if (dir) unlinkat(dir.get(), path.second.c_str(), 0);
+            if (!dir || symlinkat(get<1>(symlink).c_str(), dir.get(), path.second.c_str()) != 0) {
+                logMessage(LogLevel::Error, "Error creating symlink: ", directories.fullPath(get<0>(symlink)));
+                broken = true;
+                continue;
+            }
+            timespec times[2] = {{get<2>(symlink), 0}, {get<2>(symlink), 0}};
+            utimensat(dir.get(), path.second.c_str(), times, AT_SYMLINK_NOFOLLOW);
+        }
+        for (auto it = directoryMeta.rbegin(); it != directoryMeta.rend(); ++it) {
+            DirectoryHandle dir = directories.open(get<0>(*it));
+            if (!dir) continue;
+            timespec times[2] = {{get<2>(*it), 0}, {get<2>(*it), 0}};
+            fchmod(dir.get(), get<1>(*it));
+            futimens(dir.get(), times);
+        }
+        return !broken && (state == State::End || (state == State::Header && headerFill == 0));
+    }
+
+    size_t entries = 0;
+    bool broken = false;
+
+private:
+    enum class State { Header, FileData, Collect, Skip, Padding, End };
+
+    void parseHeader() {
+        bool zero = all_of(begin(header), end(header), [](char c) { return c == 0; });
+        if (zero) {
+            if (++zeroBlocks == 2) state = State::End;
+            return;
+        }
+        zeroBlocks = 0;
+
+        unsigned sum = 0;
+        for (size_t i = 0; i < sizeof(header); ++i) {
+            sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+        }
+        if (sum != parseTarNumber(header + 148, 8)) {
+            logMessage(LogLevel::Error, "Invalid tar header checksum");
+            broken = true;
+            return;
+        }
+
+        string rawName(header, strnlen(header, 100));
+        if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+            rawName = string(header + 345, strnlen(header + 345, 155)) + "/" + rawName;
+        }
+        type = header[156] ? header[156] : '0';
+        remaining = parseTarNumber(header + 124, 12);
+        if (!pendingName.empty()) rawName = pendingName;
+        if (pendingSize != UINT64_MAX) remaining = pendingSize;
+        link = pendingLink.empty() ? string(header + 157, strnlen(header + 157, 100)) : pendingLink;
+        mode = static_cast<mode_t>(parseTarNumber(header + 100, 8) & 07777);
+        mtime = static_cast<time_t>(parseTarNumber(header + 136, 12));
+        padding = (512 - remaining % 512) % 512;
+        collected.clear();
+
+        if (type == 'x' || type == 'L' || type == 'K') {
+            state = State::Collect;
+        } else if (type == 'g') {
+            state = State::Skip;
+        } else {
+            pendingName.clear();
+            pendingLink.clear();
+            pendingSize = UINT64_MAX;
+            state = State::Skip;
+            if (!sanitizeMemberName(rawName, name)) {
+                if (rawName != "./" && rawName != ".") logMessage(LogLevel::Warn, "Skipping unsafe member: ", rawName);
+            } else {
+                startMember();
+            }
+        }
+        if (remaining == 0) finishPayload();
+    }
+
+    void startMember() {
+        entries++;
+        if (type == '5') {
+            if (!directories.open(name)) {
+                logMessage(LogLevel::Error, "Error creating directory: ", directories.fullPath(name));
+                broken = true;
+                return;
+            }
+            directoryMeta.emplace_back(name, mode, mtime);
+            return;
+        }
+        if (type == '2') {
+            symlinks.emplace_back(name, link, mtime);
+            return;
+        }
+        if (type == '1') {
+            string target;
+            if (sanitizeMemberName(link, target)) hardLinks.emplace_back(name, target);
+            return;
+        }
+        if (type != '0' && type != '7') {
+            logMessage(LogLevel::Warn, "Skipping unsupported member type: ", name);
+            return;
+        }
+        current = make_shared<ExtractedFile>();
+        current->name = name;
+        current->mode = mode;
+        current->mtime = mtime;
+        current->directories = &directories;
+        // Only members still in flight matter, and the queue budget bounds those.
+        if (lastCopy.size() >= pruneLastCopyAt) {
+            for (auto it = lastCopy.begin(); it != lastCopy.end();) {
+                it = it->second->done() ? lastCopy.erase(it) : next(it);
+            }
+            pruneLastCopyAt = max<size_t>(1024, lastCopy.size() * 2);
+        }
+        auto earlier = lastCopy.emplace(name, current->closed);
+        if (!earlier.second) {
+            current->previous = move(earlier.first->second);
+            earlier.first->second = current->closed;
+        }
+        offset = 0;
+        state = State::FileData;
+    }
+
+    void consumePayload(const char* data, size_t n) {
+        if (state == State::Collect) {
+            collected.insert(collected.end(), data, data + n);
+        } else if (state == State::FileData) {
+            piece.insert(piece.end(), data, data + n);
+            if (piece.size() >= pieceSize && remaining > n) dispatch(false);
+        }
+    }
+
+    void dispatch(bool last) {
+        ExtractJob job;
+        job.file = last ? move(current) : current;
+        job.offset = offset;
+        offset += piece.size();
+        job.data = move(piece);
+        piece = vector<char>();
+        queue.push(move(job));
+    }
+
+    void finishPayload() {
+        if (state == State::FileData) {
+            dispatch(true);
+        } else if (state == State::Collect) {
+            string text(collected.begin(), collected.end());
+            if (type == 'L') pendingName = text.c_str();
+            if (type == 'K') pendingLink = text.c_str();
+            if (type == 'x') parsePax(text);
+        }
+        state = padding ? State::Padding : State::Header;
+    }
+
+    void parsePax(const string& text) {
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t space = text.find(' ', pos);
+            if (space == string::npos) break;
+            size_t length = strtoull(text.c_str() + pos, nullptr, 10);
+            if (length == 0 || pos + length > text.size()) break;
+            string record = text.substr(space + 1, pos + length - space - 2);
+            size_t equals = record.find('=');
+            if (equals != string::npos) {
+                string key = record.substr(0, equals);
+                string value = record.substr(equals + 1);
+                if (key == "path") pendingName = value;
+                if (key == "linkpath") pendingLink = value;
+                if (key == "size") pendingSize = strtoull(value.c_str(), nullptr, 10);
+            }
+            pos += length;
+        }
+    }
+
+    DirectoryCache& directories;
+    ExtractQueue& queue;
+    const size_t pieceSize = 1024 * 1024;
+    char header[512];
+    size_t headerFill = 0;
+    State state = State::Header;
+    int zeroBlocks = 0;
+    char type = '0';
+    string name, link;
+    mode_t mode = 0644;
+    time_t mtime = 0;
+    uint64_t remaining = 0;
+    uint64_t padding = 0;
+    vector<char> collected;
+    string pendingName, pendingLink;
+    uint64_t pendingSize = UINT64_MAX;
+    shared_ptr<ExtractedFile> current;
+    uint64_t offset = 0;
+    vector<char> piece;
+    vector<tuple<string, mode_t, time_t>> directoryMeta;
+    vector<pair<string, string>> hardLinks;
+    vector<tuple<string, string, time_t>> symlinks;
+    unordered_map<string, shared_ptr<MemberClosed>> lastCopy;
+    size_t pruneLastCopyAt = 1024;
+};
+
+// One decoder inflates and parses the archive while a pool of writers creates, writes,
+// chmods, stamps and closes the members concurrently.
+bool extractTarGz(const string& archivePath, const string& outputDir, int numThreads) {
+    ifstream inFile(archivePath, ios::binary);
+    if (!inFile) {
+        logMessage(LogLevel::Error, "Error opening input file: ", archivePath);
+        return false;
+    }
+
+    error_code ec;
+    fs::create_directories(outputDir, ec);
+    DirectoryCache directories(outputDir);
+    directories.open("");
+    ExtractQueue queue(settings.readAheadBytes);
+    atomic<size_t> failures{0};
+
+    vector<thread> writers;
+    for (int i = 0; i < max(1, numThreads); ++i) {
+        writers.emplace_back([&]() {
+            applyWorkerQos();
+            ExtractJob job;
+            while (queue.pop(job)) {
+                ExtractedFile& file = *job.file;
+                call_once(file.created, [&]() { file.create(); });
+                size_t bytes = job.data.size();
+                if (!file.failed && bytes) {
+                    ioThrottle.onWrite(bytes);
+                    if (pwrite(file.fd, job.data.data(), bytes, static_cast<off_t>(job.offset)) !=
+                        static_cast<ssize_t>(bytes)) {
+                        file.failed = true;
+                    }
+                }
+                if (file.failed && !file.reported.exchange(true)) {
+                    logMessage(LogLevel::Error, "Error writing output file: ", directories.fullPath(file.name));
+                    failures++;
+                }
+                job = ExtractJob();
+                queue.complete(bytes);
+            }
+        });
+    }
+
+    TarExtractSink sink(directories, queue);
+    NoChecksum checksum;
+    bool ok = runChunkPipeline<IdentityFilter, InflateCodec>(inFile, sink, checksum, Z_DEFAULT_COMPRESSION, true);
+    queue.close();
+    for (auto& t : writers) {
+        t.join();
+    }
+    ok = sink.finish() && ok && failures == 0;
+
+    if (!ok) {
+        logMessage(LogLevel::Error, "Error extracting archive: ", archivePath);
+        return false;
+    }
+    logMessage(LogLevel::Info, "Extracted: ", archivePath, " -> ", outputDir, " (", sink.entries, " entries, ",
+               directories.createdCount(), " directories created)");
+    return true;
+}
+
+void writeVarint(vector<char>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+bool readVarint(const char*& cursor, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; cursor < end && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*cursor++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// Values in column streams end with a 0 byte; 0 and 1 bytes inside a value are escaped with 1.
+void appendColumnValue(vector<char>& out, const char* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (static_cast<uint8_t>(data[i]) <= 1) out.push_back(1);
+        out.push_back(data[i]);
+    }
+    out.push_back(0);
+}
+
+bool readColumnValue(const char*& cursor, const char* end, string& out) {
+    while (cursor < end) {
+        char c = *cursor++;
+        if (c == 0) return true;
+        if (c == 1) {
+            if (cursor == end) return false;
+            c = *cursor++;
+        }
+        out.push_back(c);
+    }
+    return false;
+}
+
+uint64_t prefixXor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Calls visit(position) for every byte matching targets[2..count) outside quoted strings,
+// 64 bytes at a time. targets[0] must be the quote and targets[1] the backslash, which
+// escapes quotes only when jsonEscapes is set (CSV doubles its quotes instead).
+template<typename Visit>
+void scanStructural(const char* data, size_t size, const unsigned char* targets, int count, bool jsonEscapes,
+                    Visit visit) {
+    uint64_t inString = 0;
+    bool escapeCarry = false;
+    unsigned char tail[64];
+    uint64_t masks[8];
+
+    for (size_t base = 0; base < size; base += 64) {
+        const unsigned char* block = reinterpret_cast<const unsigned char*>(data + base);
+        size_t n = min<size_t>(64, size - base);
+        if (n < 64) {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, block, n);
+            block = tail;
+        }
+        simd.matchBytes64(block, targets, count, masks);
+
+        uint64_t quotes = masks[0];
+        if (jsonEscapes && (masks[1] || escapeCarry)) {
+            uint64_t escaped = 0;
+            for (int i = 0; i < 64; ++i) {
+                if (escapeCarry) {
+                    escaped |= 1ull << i;
+                    escapeCarry = false;
+                } else if ((masks[1] >> i) & 1) {
+                    escapeCarry = true;
+                }
+            }
+            quotes &= ~escaped;
+        }
+        uint64_t strings = prefixXor(quotes) ^ inString;
+        inString = static_cast<uint64_t>(0) - (strings >> 63);
+
+        uint64_t structural = 0;
+        for (int t = 2; t < count; ++t) structural |= masks[t];
+        structural &= ~strings;
+        if (n < 64) structural &= (1ull << n) - 1;
+        while (structural) {
+            visit(base + static_cast<size_t>(__builtin_ctzll(structural)));
+            structural &= structural - 1;
+        }
+    }
+}
+
+enum class ColumnFormat : uint8_t { Csv = 0, Ndjson = 1, Log = 2 };
+
+const char columnMagic[4] = {'C', 'T', 'C', 'S'};
+const uint32_t columnVersion = 1;
+const size_t columnBlockSize = 8 * 1024 * 1024;
+// A block carries at most one partial record over, so its input stays under two block
+// sizes. CSV fields and lines kept verbatim take at most twice their size in streams, so
+// a block always fits in four; templates and schemas can expand further, and blocks they
+// would push past the limit are split again with every line verbatim.
+const size_t columnBlockStreamLimit = 4 * columnBlockSize;
+const char jsonValueMarker = 2;
+
+// A block of whole records split into independently compressed streams. Stream 0 holds the
+// record shapes (field counts for CSV, schema ids for NDJSON); for NDJSON stream 1 holds the
+// schema dictionary and stream 2 lines kept verbatim, and the column streams follow.
+struct ColumnBlock {
+    vector<char> input;
+    vector<vector<char>> streams;
+    vector<vector<char>> packed;
+    vector<int> strategies;
+    bool terminated = true;
+    bool ok = true;
+
+    size_t streamBytes() const {
+        size_t total = 0;
+        for (const auto& stream : streams) total += stream.size();
+        return total;
+    }
+};
+
+// Returns the offset just past the last newline outside quotes, or 0 if there is none.
+size_t csvRecordEnd(const char* data, size_t size) {
+    const unsigned char targets[3] = {'"', '\\', '\n'};
+    size_t end = 0;
+    scanStructural(data, size, targets, 3, false, [&](size_t pos) { end = pos + 1; });
+    return end;
+}
+
+void splitCsvBlock(ColumnBlock& block, char delimiter) {
+    const char* data = block.input.data();
+    size_t size = block.input.size();
+    block.streams.assign(1, vector<char>());
+    size_t fieldStart = 0;
+    size_t field = 0;
+
+    auto appendField = [&](size_t end) {
+        if (block.streams.size() <= field + 1) block.streams.resize(field + 2);
+        appendColumnValue(block.streams[field + 1], data + fieldStart, end - fieldStart);
+        field++;
+        fieldStart = end + 1;
+    };
+
+    const unsigned char targets[4] = {'"', '\\', static_cast<unsigned char>(delimiter), '\n'};
+    scanStructural(data, size, targets, 4, false, [&](size_t pos) {
+        appendField(pos);
+        if (data[pos] == '\n') {
+            writeVarint(block.streams[0], field);
+            field = 0;
+        }
+    });
+    block.terminated = fieldStart >= size && field == 0;
+    if (!block.terminated) {
+        appendField(size);
+        writeVarint(block.streams[0], field);
+    }
+}
+
+// Splits one line into a skeleton, with a marker where each top-level value was, and the
+// values keyed by their member name. Returns false for anything that is not a single object.
+bool splitJsonLine(const char* line, size_t size, string& skeleton, vector<pair<string, string_view>>& values) {
+    if (memchr(line, jsonValueMarker, size)) return false;
+    const unsigned char targets[8] = {'"', '\\', '{', '}', '[', ']', ':', ','};
+    vector<size_t> structural;
+    scanStructural(line, size, targets, 8, true, [&](size_t pos) { structural.push_back(pos); });
+
+    auto isSpace = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+    auto trim = [&](size_t& from, size_t& to) {
+        while (from < to && isSpace(line[from])) from++;
+        while (to > from && isSpace(line[to - 1])) to--;
+    };
+
+    skeleton.clear();
+    values.clear();
+    int depth = 0;
+    bool closed = false;
+    size_t segment = 0, valueStart = 0, copied = 0;
+    string key;
+
+    for (size_t pos : structural) {
+        char c = line[pos];
+        if (closed) return false;
+        if (depth == 0) {
+            size_t from = 0, to = pos;
+            trim(from, to);
+            if (c != '{' || from != to) return false;
+            depth = 1;
+            segment = pos + 1;
+            continue;
+        }
+        if (depth == 1 && c == ':') {
+            if (!key.empty()) return false;
+            size_t from = segment, to = pos;
+            trim(from, to);
+            if (to - from < 2 || line[from] != '"' || line[to - 1] != '"') return false;
+            key.assign(line + from, to - from);
+            valueStart = pos + 1;
+        } else if (depth == 1 && (c == ',' || c == '}')) {
+            if (key.empty()) {
+                // Only an empty object may close without a member.
+                size_t from = segment, to = pos;
+                trim(from, to);
+                if (c != '}' || from != to || !values.empty()) return false;
+            } else {
+                size_t from = valueStart, to = pos;
+                trim(from, to);
+                if (from == to) return false;
+                skeleton.append(line + copied, from - copied);
+                skeleton.push_back(jsonValueMarker);
+                copied = to;
+                values.emplace_back(move(key), string_view(line + from, to - from));
+                key.clear();
+            }
+            segment = pos + 1;
+            if (c == '}') {
+                depth = 0;
+                closed = true;
+            }
+        } else if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (--depth < 1) return false;
+        }
+    }
+    if (!closed) return false;
+    size_t lastStructural = structural.back() + 1, end = size;
+    trim(lastStructural, end);
+    if (lastStructural != end) return false;
+    skeleton.append(line + copied, size - copied);
+    return true;
+}
+
+void splitNdjsonBlock(ColumnBlock& block, bool verbatim = false) {
+    const char* data = block.input.data();
+    size_t size = block.input.size();
+    block.streams.assign(3, vector<char>());
+    unordered_map<string, size_t> schemas;
+    unordered_map<string, size_t> columns;
+    string skeleton;
+    vector<pair<string, string_view>> values;
+
+    for (size_t start = 0; start < size;) {
+        const char* newline = static_cast<const char*>(memchr(data + start, '\n', size - start));
+        size_t end = newline ? static_cast<size_t>(newline - data) : size;
+        block.terminated = newline != nullptr;
+
+        if (verbatim || !splitJsonLine(data + start, end - start, skeleton, values)) {
+            writeVarint(block.streams[0], 0);
+            appendColumnValue(block.streams[2], data + start, end - start);
+        } else {
+            vector<size_t> ids;
+            for (auto& value : values) {
+                auto column = columns.emplace(value.first, columns.size()).first;
+                if (block.streams.size() <= column->second + 3) block.streams.resize(column->second + 4);
+                appendColumnValue(block.streams[column->second + 3], value.second.data(), value.second.size());
+                ids.push_back(column->second);
+            }
+            // Member names are part of the skeleton, so it alone identifies the schema.
+            auto schema = schemas.find(skeleton);
+            if (schema == schemas.end()) {
+                schema = schemas.emplace(skeleton, schemas.size() + 1).first;
+                appendColumnValue(block.streams[1], skeleton.data(), skeleton.size());
+                writeVarint(block.streams[1], ids.size());
+                for (size_t id : ids) writeVarint(block.streams[1], id);
+            }
+            writeVarint(block.streams[0], schema->second);
+        }
+        start = end + 1;
+    }
+}
+
+bool joinCsvBlock(const vector<vector<char>>& streams, bool terminated, char delimiter, vector<char>& out) {
+    vector<const char*> cursors;
+    for (const auto& stream : streams) cursors.push_back(stream.data());
+    const char* shapes = streams[0].data();
+    const char* shapesEnd = shapes + streams[0].size();
+    string value;
+
+    while (shapes < shapesEnd) {
+        uint64_t fields;
+        if (!readVarint(shapes, shapesEnd, fields) || fields + 1 > streams.size()) return false;
+        for (uint64_t k = 0; k < fields; ++k) {
+            value.clear();
+            const vector<char>& column = streams[k + 1];
+            if (!readColumnValue(cursors[k + 1], column.data() + column.size(), value)) return false;
+            out.insert(out.end(), value.begin(), value.end());
+            if (k + 1 < fields) out.push_back(delimiter);
+        }
+        if (shapes < shapesEnd || terminated) out.push_back('\n');
+    }
+    return true;
+}
+
+bool joinNdjsonBlock(const vector<vector<char>>& streams, bool terminated, vector<char>& out) {
+    if (streams.size() < 3) return false;
+    vector<const char*> cursors;
+    for (const auto& stream : streams) cursors.push_back(stream.data());
+    auto endOf = [&](size_t i) { return streams[i].data() + streams[i].size(); };
+
+    vector<pair<string, vector<uint64_t>>> schemas(1);
+    while (cursors[1] < endOf(1)) {
+        pair<string, vector<uint64_t>> schema;
+        uint64_t count;
+        if (!readColumnValue(cursors[1], endOf(1), schema.first) || !readVarint(cursors[1], endOf(1), count)) {
+            return false;
+        }
+        schema.second.resize(count);
+        for (auto& id : schema.second) {
+            if (!readVarint(cursors[1], endOf(1), id) || id + 3 >= streams.size()) return false;
+        }
+        schemas.push_back(move(schema));
+    }
+
+    string value;
+    while (cursors[0] < endOf(0)) {
+        uint64_t id;
+        if (!readVarint(cursors[0], endOf(0), id) || id >= schemas.size()) return false;
+        value.clear();
+        if (id == 0) {
+            if (!readColumnValue(cursors[2], endOf(2), value)) return false;
+            out.insert(out.end(), value.begin(), value.end());
+        } else {
+            size_t next = 0;
+            for (char c : schemas[id].first) {
+                if (c != jsonValueMarker) {
+                    out.push_back(c);
+                    continue;
+                }
+                size_t column = schemas[id].second[next++] + 3;
+                value.clear();
+                if (!readColumnValue(cursors[column], endOf(column), value)) return false;
+                out.insert(out.end(), value.begin(), value.end());
+            }
+        }
+        if (cursors[0] < endOf(0) || terminated) out.push_back('\n');
+    }
+    return true;
+}
+
+// Log template codec streams: a line becomes a template id plus typed variables. Tokens
+// holding a digit are variables; everything else stays in the template, as in CLP.
+enum LogStream { logTemplateIds, logDictionary, logVerbatim, logIntegers, logTimestamps, logHex, logText, logStreamCount };
+
+const char logMarker = 2;
+
+string renderLogTimestamp(int64_t seconds, char separator) {
+    int64_t days = seconds >= 0 ? seconds / 86400 : (seconds - 86399) / 86400;
+    int64_t rest = seconds - days * 86400;
+    int64_t year;
+    unsigned month, day;
+    civilFromDays(days, year, month, day);
+    char text[96];
+    snprintf(text, sizeof(text), "%04lld-%02u-%02u%c%02lld:%02lld:%02lld", static_cast<long long>(year), month, day,
+             separator, static_cast<long long>(rest / 3600), static_cast<long long>(rest / 60 % 60),
+             static_cast<long long>(rest % 60));
+    return text;
+}
+
+// Parses "YYYY-MM-DD HH:MM:SS" (or with 'T') into epoch seconds, accepting only text that
+// renders back identically.
+bool parseLogTimestamp(const char* text, size_t size, int64_t& seconds) {
+    static const char pattern[] = "dddd-dd-dd?dd:dd:dd";
+    if (size < 19) return false;
+    for (int i = 0; i < 19; ++i) {
+        char c = text[i];
+        bool matches = pattern[i] == 'd' ? isdigit(static_cast<unsigned char>(c)) != 0
+                     : pattern[i] == '?' ? c == ' ' || c == 'T'
+                                         : c == pattern[i];
+        if (!matches) return false;
+    }
+    auto number = [&](int from, int width) {
+        int value = 0;
+        for (int i = from; i < from + width; ++i) value = value * 10 + (text[i] - '0');
+        return value;
+    };
+    unsigned month = number(5, 2), day = number(8, 2);
+    if (month < 1 || month > 12 || day < 1 || day > 31) return false;
+    seconds = daysFromCivil(number(0, 4), month, day) * 86400 + number(11, 2) * 3600 + number(14, 2) * 60 +
+              number(17, 2);
+    return renderLogTimestamp(seconds, text[10]) == string(text, 19);
+}
 
-struct CompressionTask {
-    string inputPath;
-    string outputPath;
-    bool compress;
-    int level;
+uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+struct LogVariable {
+    char type;
+    int64_t value;
+    string_view text;
 };
 
+// Builds the template of one line and its variables; false keeps the line verbatim.
+bool splitLogLine(const char* line, size_t size, string& pattern, vector<LogVariable>& variables) {
+    pattern.clear();
+    variables.clear();
+    size_t pos = 0;
+    while (pos < size) {
+        char c = line[pos];
+        if (c == logMarker) return false;
+        if (!isLogTokenChar(c)) {
+            pattern.push_back(c);
+            pos++;
+            continue;
+        }
+        int64_t seconds;
+        if (parseLogTimestamp(line + pos, size - pos, seconds)) {
+            pattern += {logMarker, 'T', line[pos + 10]};
+            variables.push_back({'T', seconds, {}});
+            pos += 19;
+            continue;
+        }
+
+        size_t end = pos;
+        bool digits = true, hasDigit = false, lower = true, upper = true;
+        while (end < size && isLogTokenChar(line[end])) {
+            char t = line[end];
+            bool digit = isdigit(static_cast<unsigned char>(t)) != 0;
+            hasDigit |= digit;
+            digits &= digit;
+            lower &= digit || (t >= 'a' && t <= 'f');
+            upper &= digit || (t >= 'A' && t <= 'F');
+            end++;
+        }
+        string_view token(line + pos, end - pos);
+        pos = end;
+        if (!hasDigit) {
+            pattern.append(token.data(), token.size());
+        } else if (digits && token.size() <= 18 && (token[0] != '0' || token.size() == 1)) {
+            pattern += {logMarker, 'I'};
+            variables.push_back({'I', stoll(string(token)), {}});
+        } else if (digits && token.size() <= 18) {
+            pattern += {logMarker, 'D', static_cast<char>(token.size())};
+            variables.push_back({'D', stoll(string(token)), {}});
+        } else if ((lower || upper) && token.size() >= 8 && token.size() < 256) {
+            pattern += {logMarker, 'H', static_cast<char>(token.size()), lower ? 'x' : 'X'};
+            variables.push_back({'H', 0, token});
+        } else {
+            pattern += {logMarker, 'S'};
+            variables.push_back({'S', 0, token});
+        }
+    }
+    return true;
+}
+
+int hexNibble(char c) {
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+void splitLogBlock(ColumnBlock& block, bool verbatim = false) {
+    const char* data = block.input.data();
+    size_t size = block.input.size();
+    block.streams.assign(logStreamCount, vector<char>());
+    unordered_map<string, size_t> templates;
+    unordered_map<uint64_t, int64_t> previous;
+    int64_t previousTime = 0;
+    string pattern;
+    vector<LogVariable> variables;
+
+    for (size_t start = 0; start < size;) {
+        const char* newline = static_cast<const char*>(memchr(data + start, '\n', size - start));
+        size_t end = newline ? static_cast<size_t>(newline - data) : size;
+        block.terminated = newline != nullptr;
+
+        if (verbatim || !splitLogLine(data + start, end - start, pattern, variables)) {
+            writeVarint(block.streams[logTemplateIds], 0);
+            appendColumnValue(block.streams[logVerbatim], data + start, end - start);
+            start = end + 1;
+            continue;
+        }
+        auto found = templates.find(pattern);
+        if (found == templates.end()) {
+            found = templates.emplace(pattern, templates.size() + 1).first;
+            appendColumnValue(block.streams[logDictionary], pattern.data(), pattern.size());
+        }
+        uint64_t id = found->second;
+        writeVarint(block.streams[logTemplateIds], id);
+
+        // Numbers are stored as deltas from the same slot of the previous line with this template.
+        for (size_t slot = 0; slot < variables.size(); ++slot) {
+            const LogVariable& variable = variables[slot];
+            switch (variable.type) {
+                case 'I':
+                case 'D': {
+                    int64_t& last = previous[(id << 16) | slot];
+                    writeVarint(block.streams[logIntegers], zigzag(variable.value - last));
+                    last = variable.value;
+                    break;
+                }
+                case 'T':
+                    writeVarint(block.streams[logTimestamps], zigzag(variable.value - previousTime));
+                    previousTime = variable.value;
+                    break;
+                case 'H':
+                    for (size_t i = 0; i < variable.text.size(); i += 2) {
+                        int high = hexNibble(variable.text[i]);
+                        int low = i + 1 < variable.text.size() ? hexNibble(variable.text[i + 1]) : 0;
+                        block.streams[logHex].push_back(static_cast<char>((high << 4) | low));
+                    }
+                    break;
+                default:
+                    appendColumnValue(block.streams[logText], variable.text.data(), variable.text.size());
+            }
+        }
+        start = end + 1;
+    }
+}
+
+bool joinLogBlock(const vector<vector<char>>& streams, bool terminated, vector<char>& out) {
+    if (streams.size() != logStreamCount) return false;
+    vector<const char*> cursors;
+    for (const auto& stream : streams) cursors.push_back(stream.data());
+    auto endOf = [&](size_t i) { return streams[i].data() + streams[i].size(); };
 
-void processFile(const string& inputPath, const string& outputPath, bool compress, int level = Z_DEFAULT_COMPRESSION) {
+    vector<string> templates(1);
+    while (cursors[logDictionary] < endOf(logDictionary)) {
+        templates.emplace_back();
+        if (!readColumnValue(cursors[logDictionary], endOf(logDictionary), templates.back())) return false;
+    }
+
+    unordered_map<uint64_t, int64_t> previous;
+    int64_t previousTime = 0;
+    string value;
+    char digits[32];
+    while (cursors[logTemplateIds] < endOf(logTemplateIds)) {
+        uint64_t id;
+        if (!readVarint(cursors[logTemplateIds], endOf(logTemplateIds), id) || id >= templates.size()) return false;
+        if (id == 0) {
+            value.clear();
+            if (!readColumnValue(cursors[logVerbatim], endOf(logVerbatim), value)) return false;
+            out.insert(out.end(), value.begin(), value.end());
+        } else {
+            const string& pattern = templates[id];
+            size_t slot = 0;
+            for (size_t i = 0; i < pattern.size(); ++i) {
+                if (pattern[i] != logMarker) {
+                    out.push_back(pattern[i]);
+                    continue;
+                }
+                if (++i >= pattern.size()) return false;
+                char type = pattern[i];
+                uint64_t encoded;
+                if (type == 'I' || type == 'D') {
+                    if (!readVarint(cursors[logIntegers], endOf(logIntegers), encoded)) return false;
+                    int64_t& last = previous[(id << 16) | slot];
+                    last += unzigzag(encoded);
+                    int width = type == 'D' && i + 1 < pattern.size() ? static_cast<unsigned char>(pattern[++i]) : 0;
+                    int n = snprintf(digits, sizeof(digits), "%0*lld", width, static_cast<long long>(last));
+                    out.insert(out.end(), digits, digits + n);
+                } else if (type == 'T') {
+                    if (i + 1 >= pattern.size() || !readVarint(cursors[logTimestamps], endOf(logTimestamps), encoded)) {
+                        return false;
+                    }
+                    previousTime += unzigzag(encoded);
+                    string text = renderLogTimestamp(previousTime, pattern[++i]);
+                    out.insert(out.end(), text.begin(), text.end());
+                } else if (type == 'H') {
+                    if (i + 2 >= pattern.size()) return false;
+                    size_t width = static_cast<unsigned char>(pattern[i + 1]);
+                    const char* alphabet = pattern[i + 2] == 'x' ? "0123456789abcdef" : "0123456789ABCDEF";
+                    i += 2;
+                    if (static_cast<size_t>(endOf(logHex) - cursors[logHex]) < (width + 1) / 2) return false;
+                    for (size_t k = 0; k < width; ++k) {
+                        uint8_t byte = static_cast<uint8_t>(cursors[logHex][k / 2]);
+                        out.push_back(alphabet[k % 2 ? byte & 15 : byte >> 4]);
+                    }
+                    cursors[logHex] += (width + 1) / 2;
+                } else {
+                    value.clear();
+                    if (!readColumnValue(cursors[logText], endOf(logText), value)) return false;
+                    out.insert(out.end(), value.begin(), value.end());
+                }
+                slot++;
+            }
+        }
+        if (cursors[logTemplateIds] < endOf(logTemplateIds) || terminated) out.push_back('\n');
+    }
+    return true;
+}
+
+// Guesses the format from the first line: NDJSON when it starts with '{', otherwise CSV
+// with whichever of , ; tab | occurs most often outside quotes.
+void detectColumnFormat(const char* data, size_t size, ColumnFormat& format, char& delimiter) {
+    size_t start = 0;
+    while (start < size && isspace(static_cast<unsigned char>(data[start]))) start++;
+    format = start < size && data[start] == '{' ? ColumnFormat::Ndjson : ColumnFormat::Csv;
+    delimiter = ',';
+
+    const char* newline = static_cast<const char*>(memchr(data, '\n', size));
+    size_t lineSize = newline ? static_cast<size_t>(newline - data) : size;
+    size_t best = 0;
+    for (char candidate : {',', ';', '\t', '|'}) {
+        const unsigned char targets[3] = {'"', '\\', static_cast<unsigned char>(candidate)};
+        size_t count = 0;
+        scanStructural(data, lineSize, targets, 3, false, [&](size_t) { count++; });
+        if (count > best) {
+            best = count;
+            delimiter = candidate;
+        }
+    }
+}
+
+// Reversible column separation for CSV and NDJSON: records are cut into blocks at record
+// boundaries, each block is split into per-column (or per-key) streams, and every stream
+// of a batch of blocks is deflated in parallel. With logTemplates, lines are split into
+// templates and typed variables instead.
+bool compressColumns(const string& inputPath, const string& outputPath, int level, int numThreads,
+                     bool logTemplates = false) {
     ifstream inFile(inputPath, ios::binary);
     if (!inFile) {
-        lock_guard<mutex> lock(mtx);
-        cerr << "Error opening input file: " << inputPath << endl;
-        return;
+        logMessage(LogLevel::Error, "Error opening input file: ", inputPath);
+        return false;
     }
-
     ofstream outFile(outputPath, ios::binary);
     if (!outFile) {
-        lock_guard<mutex> lock(mtx);
-        cerr << "Error opening output file: " << outputPath << endl;
-        return;
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return false;
     }
+    // A partial output would pass for a complete one.
+    auto fail = [&](const char* reason, const string& path) {
+        outFile.close();
+        error_code ec;
+        fs::remove(outputPath, ec);
+        logMessage(LogLevel::Error, reason, path);
+        return false;
+    };
 
-    vector<char> inBuffer(1024 * 1024); 
-    vector<char> outBuffer(1024 * 1024);
+    const size_t batchBlocks = static_cast<size_t>(max(1, numThreads));
+    vector<ColumnBlock> batch(batchBlocks);
+    vector<DeflateContextCache> contexts(max(1, numThreads));
+    vector<char> carry;
+    ColumnFormat format = ColumnFormat::Csv;
+    char delimiter = ',';
+    bool headerWritten = false;
+    uint64_t totalIn = 0, totalOut = 0, totalStreams = 0;
+    bool done = false;
 
-    z_stream zs = {0};
-    if (compress) {
-        deflateInit(&zs, level);
-    } else {
-        inflateInit(&zs);
-    }
+    while (!done) {
+        size_t filled = 0;
+        while (filled < batchBlocks && !done) {
+            ColumnBlock& block = batch[filled];
+            block.input.swap(carry);
+            size_t have = block.input.size();
+            block.input.resize(have + columnBlockSize);
+            inFile.read(block.input.data() + have, columnBlockSize);
+            block.input.resize(have + static_cast<size_t>(inFile.gcount()));
+            ioThrottle.onRead(static_cast<size_t>(inFile.gcount()));
+            done = inFile.peek() == ifstream::traits_type::eof();
 
-    while (true) {
-        inFile.read(inBuffer.data(), inBuffer.size());
-        size_t bytesRead = inFile.gcount();
-        if (bytesRead == 0) break;
+            if (!headerWritten) {
+                detectColumnFormat(block.input.data(), block.input.size(), format, delimiter);
+                if (logTemplates) format = ColumnFormat::Log;
+                outFile.write(columnMagic, sizeof(columnMagic));
+                writeRaw(outFile, columnVersion);
+                writeRaw(outFile, static_cast<uint8_t>(format));
+                writeRaw(outFile, delimiter);
+                headerWritten = true;
+            }
 
-        zs.next_in = reinterpret_cast<Bytef*>(inBuffer.data());
-        zs.avail_in = static_cast<uInt>(bytesRead);
+            // Later blocks start at a record boundary; the partial record waits for the next read.
+            size_t cut = block.input.size();
+            if (!done) {
+                size_t end = 0;
+                if (format == ColumnFormat::Csv) {
+                    end = csvRecordEnd(block.input.data(), block.input.size());
+                } else {
+                    const void* last = memrchr(block.input.data(), '\n', block.input.size());
+                    end = last ? static_cast<size_t>(static_cast<const char*>(last) - block.input.data()) + 1 : 0;
+                }
+                if (end > 0) cut = end;
+            }
+            carry.assign(block.input.begin() + cut, block.input.end());
+            block.input.resize(cut);
+            if (!block.input.empty()) filled++;
+        }
 
-        do {
-            zs.next_out = reinterpret_cast<Bytef*>(outBuffer.data());
-            zs.avail_out = static_cast<uInt>(outBuffer.size());
+        parallelFor(filled, numThreads, [&](size_t i, int) {
+            ColumnBlock& block = batch[i];
+            switch (format) {
+                case ColumnFormat::Csv: splitCsvBlock(block, delimiter); break;
+                case ColumnFormat::Ndjson: splitNdjsonBlock(block); break;
+                case ColumnFormat::Log: splitLogBlock(block); break;
+            }
+            if (block.streamBytes() > columnBlockStreamLimit) {
+                if (format == ColumnFormat::Ndjson) splitNdjsonBlock(block, true);
+                if (format == ColumnFormat::Log) splitLogBlock(block, true);
+            }
+        });
 
-            int ret;
-            if (compress) {
-                ret = deflate(&zs, inFile.eof() ? Z_FINISH : Z_NO_FLUSH);
-            } else {
-                ret = inflate(&zs, Z_NO_FLUSH);
+        vector<pair<size_t, size_t>> work;
+        for (size_t i = 0; i < filled; ++i) {
+            batch[i].packed.assign(batch[i].streams.size(), vector<char>());
+            batch[i].strategies.assign(batch[i].streams.size(), Z_DEFAULT_STRATEGY);
+            batch[i].ok = true;
+            for (size_t s = 0; s < batch[i].streams.size(); ++s) work.emplace_back(i, s);
+        }
+        // Streams are compressed largest first so a wide column does not finish last.
+        sort(work.begin(), work.end(), [&](const pair<size_t, size_t>& a, const pair<size_t, size_t>& b) {
+            return batch[a.first].streams[a.second].size() > batch[b.first].streams[b.second].size();
+        });
+        parallelFor(work.size(), numThreads, [&](size_t w, int workerId) {
+            ColumnBlock& block = batch[work[w].first];
+            size_t s = work[w].second;
+            if (!deflateIndependentBlock(contexts[workerId], level, block.streams[s].data(), block.streams[s].size(),
+                                         true, block.packed[s], block.strategies[s])) {
+                block.ok = false;
             }
+        });
 
-            if (ret == Z_STREAM_ERROR) {
-                lock_guard<mutex> lock(mtx);
-                cerr << "Error during compression/decompression" << endl;
-                return;
+        for (size_t i = 0; i < filled; ++i) {
+            ColumnBlock& block = batch[i];
+            if (!block.ok) return fail("Error during compression/decompression: ", inputPath);
+            // decompressColumns rejects anything larger, so such a block must never be written.
+            if (block.streamBytes() > columnBlockStreamLimit) {
+                return fail("Column block exceeds the stream limit: ", inputPath);
             }
+            writeRaw(outFile, static_cast<uint32_t>(block.streams.size()));
+            writeRaw(outFile, static_cast<uint8_t>(block.terminated));
+            size_t written = sizeof(uint32_t) + 1;
+            for (size_t s = 0; s < block.streams.size(); ++s) {
+                writeRaw(outFile, static_cast<uint32_t>(block.streams[s].size()));
+                writeRaw(outFile, static_cast<uint32_t>(block.packed[s].size()));
+                written += 2 * sizeof(uint32_t);
+            }
+            for (const auto& packed : block.packed) {
+                outFile.write(packed.data(), packed.size());
+                written += packed.size();
+            }
+            ioThrottle.onWrite(written);
+            totalIn += block.input.size();
+            totalOut += written;
+            totalStreams += block.streams.size();
+        }
+    }
+    writeRaw(outFile, static_cast<uint32_t>(0));
 
-            size_t bytesWritten = outBuffer.size() - zs.avail_out;
-            outFile.write(outBuffer.data(), bytesWritten);
+    if (!outFile.flush()) return fail("Error writing output file: ", outputPath);
+    logMessage(LogLevel::Info, "Processed: ", inputPath, " -> ", outputPath, " (",
+               format == ColumnFormat::Csv ? "csv" : format == ColumnFormat::Ndjson ? "ndjson" : "log", ", ", totalStreams, " streams, ratio ",
+               totalOut ? static_cast<double>(totalIn) / static_cast<double>(totalOut) : 0.0, ")");
+    return true;
+}
+
+bool inflateRawStream(const vector<char>& input, vector<char>& output) {
+    struct RawInflater {
+        z_stream zs = {};
+        bool ok = inflateInit2(&zs, -MAX_WBITS) == Z_OK;
+        ~RawInflater() { inflateEnd(&zs); }
+    };
+    thread_local RawInflater inflater;
+    if (!inflater.ok) return false;
+    inflateReset(&inflater.zs);
+    char empty;
+    inflater.zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    inflater.zs.avail_in = static_cast<uInt>(input.size());
+    inflater.zs.next_out = reinterpret_cast<Bytef*>(output.empty() ? &empty : output.data());
+    inflater.zs.avail_out = static_cast<uInt>(output.size());
+    int ret = inflate(&inflater.zs, Z_FINISH);
+    return ret == Z_STREAM_END && inflater.zs.avail_out == 0;
+}
 
-        } while (zs.avail_out == 0);
+bool decompressColumns(const string& inputPath, const string& outputPath, int numThreads) {
+    ifstream inFile(inputPath, ios::binary);
+    if (!inFile) {
+        logMessage(LogLevel::Error, "Error opening input file: ", inputPath);
+        return false;
+    }
+    char magic[4];
+    uint32_t version;
+    uint8_t format;
+    char delimiter;
+    if (!inFile.read(magic, sizeof(magic)) || memcmp(magic, columnMagic, sizeof(magic)) != 0 ||
+        !readRaw(inFile, version) || version != columnVersion || !readRaw(inFile, format) ||
+        !readRaw(inFile, delimiter)) {
+        logMessage(LogLevel::Error, "Not a column-split file: ", inputPath);
+        return false;
+    }
+    ofstream outFile(outputPath, ios::binary);
+    if (!outFile) {
+        logMessage(LogLevel::Error, "Error opening output file: ", outputPath);
+        return false;
     }
+    // A partial output would pass for a complete one.
+    auto fail = [&](const char* reason, const string& path) {
+        outFile.close();
+        error_code ec;
+        fs::remove(outputPath, ec);
+        logMessage(LogLevel::Error, reason, path);
+        return false;
+    };
 
-    if (compress) {
-        deflateEnd(&zs);
-    } else {
-        inflateEnd(&zs);
+    const size_t batchBlocks = static_cast<size_t>(max(1, numThreads));
+    vector<ColumnBlock> batch(batchBlocks);
+    bool done = false;
+
+    while (!done) {
+        size_t filled = 0;
+        vector<pair<size_t, size_t>> work;
+        while (filled < batchBlocks) {
+            ColumnBlock& block = batch[filled];
+            uint32_t streamCount;
+            uint8_t terminated;
+            if (!readRaw(inFile, streamCount)) return fail("Truncated column-split file (no end marker): ", inputPath);
+            if (streamCount == 0) {
+                done = true;
+                break;
+            }
+            if (!readRaw(inFile, terminated)) return fail("Truncated column-split block header: ", inputPath);
+            block.terminated = terminated != 0;
+            // Sizes come from the file, so nothing is allocated until the whole header has
+            // been read and checked against what the compressor can produce.
+            vector<pair<uint32_t, uint32_t>> sizes;
+            sizes.reserve(min<size_t>(streamCount, 4096));
+            size_t totalRaw = 0;
+            for (uint32_t s = 0; s < streamCount; ++s) {
+                uint32_t rawSize, packedSize;
+                if (!readRaw(inFile, rawSize) || !readRaw(inFile, packedSize)) {
+                    return fail("Truncated column-split block header: ", inputPath);
+                }
+                totalRaw += rawSize;
+                if (totalRaw > columnBlockStreamLimit || packedSize > rawSize + rawSize / 8 + 64) {
+                    return fail("Corrupt column-split block header: ", inputPath);
+                }
+                sizes.emplace_back(rawSize, packedSize);
+            }
+            block.streams.resize(streamCount);
+            block.packed.resize(streamCount);
+            for (uint32_t s = 0; s < streamCount; ++s) {
+                block.streams[s].resize(sizes[s].first);
+                block.packed[s].resize(sizes[s].second);
+            }
+            for (auto& packed : block.packed) {
+                if (!inFile.read(packed.data(), packed.size())) return fail("Truncated column-split block: ", inputPath);
+                ioThrottle.onRead(packed.size());
+            }
+            block.ok = true;
+            for (uint32_t s = 0; s < streamCount; ++s) work.emplace_back(filled, s);
+            filled++;
+        }
+
+        parallelFor(work.size(), numThreads, [&](size_t w, int) {
+            ColumnBlock& block = batch[work[w].first];
+            if (!inflateRawStream(block.packed[work[w].second], block.streams[work[w].second])) block.ok = false;
+        });
+        parallelFor(filled, numThreads, [&](size_t i, int) {
+            ColumnBlock& block = batch[i];
+            block.input.clear();
+            if (!block.ok) return;
+            switch (static_cast<ColumnFormat>(format)) {
+                case ColumnFormat::Csv:
+                    block.ok = joinCsvBlock(block.streams, block.terminated, delimiter, block.input);
+                    break;
+                case ColumnFormat::Ndjson:
+                    block.ok = joinNdjsonBlock(block.streams, block.terminated, block.input);
+                    break;
+                case ColumnFormat::Log:
+                    block.ok = joinLogBlock(block.streams, block.terminated, block.input);
+                    break;
+                default:
+                    block.ok = false;
+            }
+        });
+
+        for (size_t i = 0; i < filled; ++i) {
+            if (!batch[i].ok) return fail("Error during compression/decompression: ", inputPath);
+            ioThrottle.onWrite(batch[i].input.size());
+            outFile.write(batch[i].input.data(), batch[i].input.size());
+        }
     }
 
-    lock_guard<mutex> lock(mtx);
-    cout << "Processed: " << inputPath << " -> " << outputPath << endl;
+    if (!outFile.flush()) return fail("Error writing output file: ", outputPath);
+    logMessage(LogLevel::Info, "Processed: ", inputPath, " -> ", outputPath);
+    return true;
 }
 
-void processFiles(const vector<CompressionTask>& tasks, int numThreads) {
+void dispatchTasks(const TaskList& tasks, int numThreads) {
+    if (settings.blockMode && !tasks.empty() && tasks.compress(0)) {
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            CompressionTask task = tasks[i];
+            compressFileBlocks(task.inputPath, task.outputPath, task.level, numThreads);
+        }
+        logger.flush();
+        return;
+    }
+
+    if (settings.parallelInflate && !tasks.empty() && !tasks.compress(0)) {
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            CompressionTask task = tasks[i];
+            if (!decompressFileParallel(task.inputPath, task.outputPath, numThreads)) {
+                processFile(task.inputPath, task.outputPath, false);
+            }
+        }
+        logger.flush();
+        return;
+    }
+
+    if (settings.layoutOrdering) {
+        processFilesByLayout(tasks, numThreads);
+        logger.flush();
+        return;
+    }
+
     vector<thread> threads;
     size_t currentTask = 0;
     mutex taskMutex;
 
     auto worker = [&]() {
+        applyWorkerQos();
         while (true) {
             size_t taskIndex;
             {
@@ -101,46 +6411,578 @@ void processFiles(const vector<CompressionTask>& tasks, int numThreads) {
                 if (currentTask >= tasks.size()) return;
                 taskIndex = currentTask++;
             }
-            const auto& task = tasks[taskIndex];
+            CompressionTask task = tasks[taskIndex];
             processFile(task.inputPath, task.outputPath, task.compress, task.level);
         }
-    };
-
-    for (int i = 0; i < numThreads; ++i) {
-        threads.emplace_back(worker);
-    }
-
-    for (auto& t : threads) {
-        t.join();
-    }
-}
-
-template<typename Func>
-auto measureTime(Func f) {
-    auto start = high_resolution_clock::now();
-    f();
-    auto end = high_resolution_clock::now();
-    return duration_cast<milliseconds>(end - start);
-}
-
-
-void displayMenu() {
-    cout << "\n===== Multithreaded File Compression Tool =====" << endl;
-    cout << "1. Compress file(s)" << endl;
-    cout << "2. Decompress file(s)" << endl;
-    cout << "3. Benchmark (compare single vs multi-threaded)" << endl;
-    cout << "4. Exit" << endl;
-    cout << "Enter your choice: ";
+    };
+
+    for (int i = 0; i < numThreads; ++i) {
+        threads.emplace_back(worker);
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+    logger.flush();
+}
+
+// Workload trace: one record per batch job with its mode, level, thread count and
+// elapsed time, the input directory tree with names replaced by ids, and each file's
+// input and output size. Contents are never read.
+//
+//   ctrace 1
+//   job <compress> <level> <threads> <elapsed ms> <files>
+//   dir <id> <parent id>          (id 0 is the job's common input directory)
+//   file <dir id> <input bytes> <output bytes>
+bool appendWorkloadTrace(const string& tracePath, const TaskList& tasks, int numThreads, milliseconds elapsed) {
+    if (tasks.empty()) return true;
+
+    // Directories are numbered below the longest common prefix of the job's inputs.
+    string_view common = tasks.inputDir(0);
+    for (size_t i = 1; i < tasks.size() && !common.empty(); ++i) {
+        string_view dir = tasks.inputDir(i);
+        size_t n = 0;
+        while (n < common.size() && n < dir.size() && common[n] == dir[n]) n++;
+        common = common.substr(0, n);
+    }
+    common = common.substr(0, common.rfind('/') + 1);
+
+    ostringstream record;
+    map<string, size_t> dirIds = {{"", 0}};
+    auto dirId = [&](string_view dir) {
+        string relative(dir.substr(common.size()));
+        auto it = dirIds.find(relative);
+        if (it != dirIds.end()) return it->second;
+        // Register each missing ancestor first so parents precede their children.
+        size_t parent = 0;
+        for (size_t pos = relative.find('/'); pos != string::npos; pos = relative.find('/', pos + 1)) {
+            auto inserted = dirIds.emplace(relative.substr(0, pos + 1), dirIds.size());
+            if (inserted.second) record << "dir " << inserted.first->second << ' ' << parent << '\n';
+            parent = inserted.first->second;
+        }
+        return parent;
+    };
+
+    ostringstream files;
+    string inputPath, outputPath;
+    struct stat st;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        tasks.inputPath(i, inputPath);
+        tasks.outputPath(i, outputPath);
+        uint64_t inputBytes = stat(inputPath.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+        uint64_t outputBytes = stat(outputPath.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+        files << "file " << dirId(tasks.inputDir(i)) << ' ' << inputBytes << ' ' << outputBytes << '\n';
+    }
+
+    bool fresh = !fs::exists(tracePath);
+    ofstream out(tracePath, ios::app);
+    if (!out) {
+        logMessage(LogLevel::Error, "Error opening output file: ", tracePath);
+        return false;
+    }
+    if (fresh) out << "ctrace 1\n";
+    out << "job " << tasks.compress(0) << ' ' << tasks.level(0) << ' ' << numThreads << ' ' << elapsed.count() << ' '
+        << tasks.size() << '\n'
+        << record.str() << files.str();
+    return static_cast<bool>(out);
+}
+
+void processFiles(const TaskList& tasks, int numThreads) {
+    auto start = steady_clock::now();
+    dispatchTasks(tasks, numThreads);
+    if (!settings.tracePath.empty()) {
+        appendWorkloadTrace(settings.tracePath, tasks, numThreads,
+                            duration_cast<milliseconds>(steady_clock::now() - start));
+    }
+}
+
+struct TracedJob {
+    bool compress = true;
+    int level = Z_DEFAULT_COMPRESSION;
+    int threads = 1;
+    int64_t elapsedMs = 0;
+    vector<size_t> dirParents;     // parent id of each directory, dirParents[0] unused
+    struct File {
+        size_t dir;
+        uint64_t inputBytes;
+        uint64_t outputBytes;
+    };
+    vector<File> files;
+};
+
+vector<TracedJob> readWorkloadTrace(const string& tracePath) {
+    vector<TracedJob> jobs;
+    ifstream in(tracePath);
+    string kind;
+    while (in >> kind) {
+        if (kind == "job") {
+            size_t fileCount;
+            jobs.emplace_back();
+            in >> jobs.back().compress >> jobs.back().level >> jobs.back().threads >> jobs.back().elapsedMs >> fileCount;
+            jobs.back().dirParents.push_back(0);
+            jobs.back().files.reserve(fileCount);
+        } else if (kind == "dir" && !jobs.empty()) {
+            size_t id, parent;
+            in >> id >> parent;
+            if (id == jobs.back().dirParents.size() && parent < id) jobs.back().dirParents.push_back(parent);
+        } else if (kind == "file" && !jobs.empty()) {
+            TracedJob::File file;
+            in >> file.dir >> file.inputBytes >> file.outputBytes;
+            if (file.dir < jobs.back().dirParents.size()) jobs.back().files.push_back(file);
+        } else {
+            string rest;
+            getline(in, rest);
+        }
+    }
+    return jobs;
+}
+
+// Synthetic content whose compressibility is steered by one knob: mix 0..1 blends runs
+// of zeros into log-like text, and 1..2 blends text into random bytes. Segments are
+// chosen independently, so any prefix compresses like the whole.
+void synthesizeContent(char* out, size_t size, double mix, mt19937_64& rng) {
+    static const char* const words[] = {"GET", "POST", "/api/v1/items", "user", "session", "200", "404", "ms",
+                                        "INFO", "WARN", "request", "served", "cache", "miss", "hit", "id="};
+    const size_t segment = 512;
+    uniform_real_distribution<double> coin(0.0, 1.0);
+    for (size_t pos = 0; pos < size; pos += segment) {
+        size_t n = min(segment, size - pos);
+        char* seg = out + pos;
+        bool high = mix > 1.0;
+        double threshold = high ? mix - 1.0 : mix;
+        bool upper = coin(rng) < threshold;
+        if (high && upper) {
+            for (size_t i = 0; i < n; i += 8) {
+                uint64_t r = rng();
+                memcpy(seg + i, &r, min<size_t>(8, n - i));
+            }
+        } else if (!high && !upper) {
+            memset(seg, 0, n);
+        } else {
+            size_t i = 0;
+            while (i < n) {
+                string word = words[rng() % 16];
+                if (rng() % 4 == 0) word += to_string(rng() % 100000);
+                word += (rng() % 12 == 0) ? '\n' : ' ';
+                size_t m = min(word.size(), n - i);
+                memcpy(seg + i, word.data(), m);
+                i += m;
+            }
+        }
+    }
+}
+
+// Maps a target compressed/uncompressed ratio to a synthesizeContent mix by measuring
+// deflate on samples across the mix range and interpolating.
+class RatioCalibration {
+public:
+    explicit RatioCalibration(int level) {
+        vector<char> sample(256 * 1024);
+        vector<Bytef> packed(compressBound(static_cast<uLong>(sample.size())));
+        mt19937_64 rng(97);
+        for (int step = 0; step <= steps; ++step) {
+            double mix = 2.0 * step / steps;
+            synthesizeContent(sample.data(), sample.size(), mix, rng);
+            uLongf packedSize = static_cast<uLongf>(packed.size());
+            compress2(packed.data(), &packedSize, reinterpret_cast<const Bytef*>(sample.data()),
+                      static_cast<uLong>(sample.size()), level);
+            ratios[step] = static_cast<double>(packedSize) / sample.size();
+        }
+    }
+
+    double mixFor(double ratio) const {
+        if (ratio <= ratios[0]) return 0.0;
+        for (int step = 1; step <= steps; ++step) {
+            if (ratio <= ratios[step]) {
+                double span = ratios[step] - ratios[step - 1];
+                double within = span > 0 ? (ratio - ratios[step - 1]) / span : 0;
+                return 2.0 * (step - 1 + within) / steps;
+            }
+        }
+        return 2.0;
+    }
+
+private:
+    static constexpr int steps = 20;
+    double ratios[steps + 1];
+};
+
+// Rebuilds each traced job as a synthetic corpus with the same tree, sizes and
+// per-file ratios under `outputRoot`, runs it again and compares it with the trace.
+bool replayWorkloadTrace(const string& tracePath, const string& outputRoot, int numThreads) {
+    vector<TracedJob> jobs = readWorkloadTrace(tracePath);
+    if (jobs.empty()) {
+        logMessage(LogLevel::Error, "No jobs in workload trace: ", tracePath);
+        return false;
+    }
+
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        const TracedJob& job = jobs[j];
+        string root = outputRoot + "/job" + to_string(j);
+        string corpusRoot = root + (job.compress ? "/input/" : "/plain/");
+        vector<string> dirs(job.dirParents.size());
+        dirs[0] = corpusRoot;
+        for (size_t d = 1; d < dirs.size(); ++d) {
+            dirs[d] = dirs[job.dirParents[d]] + "d" + to_string(d) + "/";
+        }
+        for (const string& dir : dirs) fs::create_directories(dir);
+        fs::create_directories(root + "/output");
+
+        // Plain sizes and ratios follow from the mode: decompression jobs trace the
+        // compressed file as input.
+        RatioCalibration calibration(job.compress ? job.level : Z_DEFAULT_COMPRESSION);
+        atomic<bool> writeFailed{false};
+        parallelFor(job.files.size(), numThreads, [&](size_t i, int) {
+            const TracedJob::File& file = job.files[i];
+            uint64_t plainBytes = job.compress ? file.inputBytes : file.outputBytes;
+            uint64_t packedBytes = job.compress ? file.outputBytes : file.inputBytes;
+            double ratio = plainBytes ? static_cast<double>(packedBytes) / plainBytes : 1.0;
+            double mix = calibration.mixFor(ratio);
+
+            mt19937_64 rng(i * 0x9e3779b97f4a7c15ull + j);
+            ofstream out(dirs[file.dir] + "f" + to_string(i), ios::binary);
+            vector<char> buffer(1024 * 1024);
+            for (uint64_t written = 0; written < plainBytes;) {
+                size_t n = static_cast<size_t>(min<uint64_t>(buffer.size(), plainBytes - written));
+                synthesizeContent(buffer.data(), n, mix, rng);
+                out.write(buffer.data(), n);
+                written += n;
+            }
+            if (!out) writeFailed = true;
+        });
+        if (writeFailed) {
+            logMessage(LogLevel::Error, "Error writing replay corpus under: ", root);
+            return false;
+        }
+
+        TaskList tasks;
+        uint32_t outputDir = tasks.intern(root + "/output/");
+        if (job.compress) {
+            for (size_t i = 0; i < job.files.size(); ++i) {
+                tasks.add(dirs[job.files[i].dir] + "f" + to_string(i), outputDir, OutputName::AppendGz, true, job.level);
+            }
+        } else {
+            // Decompression replays need archives first; building them is not timed.
+            TaskList prepare;
+            uint32_t archiveDir = prepare.intern(root + "/archives/");
+            fs::create_directories(root + "/archives");
+            for (size_t i = 0; i < job.files.size(); ++i) {
+                prepare.add(dirs[job.files[i].dir] + "f" + to_string(i), archiveDir, OutputName::AppendGz, true,
+                            Z_DEFAULT_COMPRESSION);
+                tasks.add(root + "/archives/f" + to_string(i) + ".gz", outputDir, OutputName::StripExtension, false, 0);
+            }
+            dispatchTasks(prepare, numThreads);
+        }
+
+        auto start = steady_clock::now();
+        dispatchTasks(tasks, job.threads);
+        auto elapsed = duration_cast<milliseconds>(steady_clock::now() - start);
+
+        uint64_t tracedIn = 0, tracedOut = 0, replayIn = 0, replayOut = 0;
+        string inputPath, outputPath;
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            tracedIn += job.files[i].inputBytes;
+            tracedOut += job.files[i].outputBytes;
+            tasks.inputPath(i, inputPath);
+            tasks.outputPath(i, outputPath);
+            error_code ec;
+            replayIn += fs::file_size(inputPath, ec);
+            replayOut += fs::file_size(outputPath, ec);
+        }
+        auto ratio = [](uint64_t out, uint64_t in) { return in ? static_cast<double>(out) / in : 0.0; };
+        logMessage(LogLevel::Info, "Replayed job ", j, " (", job.compress ? "compress" : "decompress", ", ",
+                   job.files.size(), " files, ", job.threads, " threads): traced ", job.elapsedMs, " ms at ratio ",
+                   ratio(tracedOut, tracedIn), ", replay ", elapsed.count(), " ms at ratio ", ratio(replayOut, replayIn));
+    }
+    return true;
+}
+
+struct BatchResult {
+    vector<char> arena;
+    vector<size_t> offsets;   // message i occupies arena[offsets[i], offsets[i + 1])
+    vector<int> status;       // Z_OK, or the zlib error for that message
+};
+
+BatchResult compressBatch(const vector<string_view>& messages, int level, int numThreads) {
+    const size_t groupSize = 1024;
+    size_t groupCount = (messages.size() + groupSize - 1) / groupSize;
+
+    BatchResult result;
+    result.offsets.assign(messages.size() + 1, 0);
+    result.status.assign(messages.size(), Z_OK);
+
+    vector<vector<char>> groupOutput(groupCount);
+    vector<DeflateContextCache> contexts(max(1, numThreads));
+
+    parallelFor(groupCount, numThreads, [&](size_t group, int workerId) {
+        size_t first = group * groupSize;
+        size_t last = min(messages.size(), first + groupSize);
+        z_stream* zs = contexts[workerId].acquire(level);
+
+        size_t bound = 0;
+        for (size_t i = first; i < last; ++i) {
+            bound += compressBound(static_cast<uLong>(messages[i].size()));
+        }
+        vector<char>& out = groupOutput[group];
+        out.resize(bound);
+
+        size_t used = 0;
+        for (size_t i = first; i < last; ++i) {
+            if (!zs) {
+                result.status[i] = Z_MEM_ERROR;
+                result.offsets[i + 1] = used;
+                continue;
+            }
+            if (i != first) {
+                deflateReset(zs);
+            }
+            zs->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(messages[i].data()));
+            zs->avail_in = static_cast<uInt>(messages[i].size());
+            zs->next_out = reinterpret_cast<Bytef*>(out.data() + used);
+            zs->avail_out = static_cast<uInt>(out.size() - used);
+
+            int ret = deflate(zs, Z_FINISH);
+            if (ret == Z_STREAM_END) {
+                used = out.size() - zs->avail_out;
+            } else {
+                result.status[i] = ret == Z_OK ? Z_BUF_ERROR : ret;
+            }
+            result.offsets[i + 1] = used;
+        }
+        out.resize(used);
+    });
+
+    vector<size_t> groupBase(groupCount + 1, 0);
+    for (size_t g = 0; g < groupCount; ++g) {
+        groupBase[g + 1] = groupBase[g] + groupOutput[g].size();
+    }
+    result.arena.resize(groupBase[groupCount]);
+
+    parallelFor(groupCount, numThreads, [&](size_t group, int) {
+        size_t first = group * groupSize;
+        size_t last = min(messages.size(), first + groupSize);
+        for (size_t i = first; i < last; ++i) {
+            result.offsets[i + 1] += groupBase[group];
+        }
+        if (!groupOutput[group].empty()) {
+            memcpy(result.arena.data() + groupBase[group], groupOutput[group].data(), groupOutput[group].size());
+        }
+        vector<char>().swap(groupOutput[group]);
+    });
+
+    return result;
+}
+
+template<typename Func>
+auto measureTime(Func f) {
+    auto start = high_resolution_clock::now();
+    f();
+    auto end = high_resolution_clock::now();
+    return duration_cast<milliseconds>(end - start);
+}
+
+
+void displayMenu() {
+    cout << "\n===== Multithreaded File Compression Tool =====" << endl;
+    cout << "1. Compress file(s)" << endl;
+    cout << "2. Decompress file(s)" << endl;
+    cout << "3. Benchmark (compare single vs multi-threaded)" << endl;
+    cout << "4. Exit" << endl;
+    cout << "5. Settings" << endl;
+    cout << "6. Pipeline overhead benchmark" << endl;
+    cout << "7. SIMD kernel benchmark" << endl;
+    cout << "8. Extract byte range from indexed archive" << endl;
+    cout << "9. Stream compressed file through virtual reader" << endl;
+    cout << "10. Build seek index for compressed file(s)" << endl;
+    cout << "11. Merge compressed files without recompressing" << endl;
+    cout << "12. Create tar.gz from directory" << endl;
+    cout << "13. Extract tar.gz archive" << endl;
+    cout << "14. Column-split CSV/NDJSON or template-split logs" << endl;
+    cout << "15. Compressing/decompressing stream adapter benchmark" << endl;
+    cout << "16. Task list memory benchmark" << endl;
+    cout << "17. Create or repair archive parity" << endl;
+    cout << "18. Replay workload trace" << endl;
+    cout << "19. Search indexed archive" << endl;
+    cout << "20. Extract time range from indexed archive" << endl;
+    cout << "21. Small-file benchmark" << endl;
+    cout << "22. Batch small-message benchmark" << endl;
+    cout << "Enter your choice: ";
+}
+
+void settingsMenu() {
+    int choice;
+    do {
+        cout << "\n----- Settings -----" << endl;
+        cout << "1. Chunk-parallel block mode: " << (settings.blockMode ? "on" : "off") << endl;
+        cout << "2. Block size (KB): " << settings.blockSize / 1024 << endl;
+        cout << "3. Per-block strategy selection: " << (settings.autoStrategy ? "on" : "off") << endl;
+        cout << "4. Log level: " << static_cast<int>(logger.getMinLevel()) << " (0=debug, 1=info, 2=warn, 3=error)" << endl;
+        cout << "5. JSON-lines log output: " << (logger.isJson() ? "on" : "off") << endl;
+        cout << "6. Physical-layout read ordering: " << (settings.layoutOrdering ? "on" : "off") << endl;
+        cout << "7. Readers per device: " << settings.readersPerDevice << endl;
+        cout << "8. Read-ahead budget (MB): " << settings.readAheadBytes / (1024 * 1024) << endl;
+        cout << "9. Read limit (MB/s, 0=unlimited): " << ioThrottle.readBytes.getRate() / (1024 * 1024) << endl;
+        cout << "10. Write limit (MB/s, 0=unlimited): " << ioThrottle.writeBytes.getRate() / (1024 * 1024) << endl;
+        cout << "11. I/O operations limit (IOPS, 0=unlimited): " << ioThrottle.operations.getRate() << endl;
+        cout << "12. Worker QoS class: " << static_cast<int>(settings.qosClass) << " (0=normal, 1=low, 2=idle)" << endl;
+        cout << "13. SIMD kernels: " << simdLevelName(simd.level) << " (detected " << simdLevelName(detectSimdLevel()) << ")" << endl;
+        cout << "14. Block cache budget (MB): " << blockCache.budget() / (1024 * 1024) << endl;
+        cout << "15. Parallel single-stream inflate: " << (settings.parallelInflate ? "on" : "off") << endl;
+        cout << "16. Max inflate chunk size (KB): " << settings.inflateChunkSize / 1024 << endl;
+        cout << "17. Seek index span (KB): " << settings.indexSpan / 1024 << endl;
+        cout << "18. Block-mode parity shards per 16 (0=off): " << settings.parityShards << endl;
+        cout << "19. Workload trace file: " << (settings.tracePath.empty() ? "off" : settings.tracePath) << endl;
+        cout << "20. Block-mode token filters for search: " << (settings.tokenFilters ? "on" : "off") << endl;
+        cout << "21. Block-mode timestamp index: " << (settings.timeIndex ? "on" : "off") << endl;
+        cout << "22. Small-file fast path: " << (settings.smallFileFastPath ? "on" : "off") << endl;
+        string controlFile = ioThrottle.getControlFile();
+        cout << "23. I/O limit control file: " << (controlFile.empty() ? "off" : controlFile) << endl;
+        cout << "0. Back" << endl;
+        cout << "Enter your choice: ";
+        cin >> choice;
+
+        switch (choice) {
+            case 1:
+                settings.blockMode = !settings.blockMode;
+                break;
+            case 2: {
+                size_t kb;
+                cout << "Block size in KB (64-65536): ";
+                cin >> kb;
+                settings.blockSize = min<size_t>(65536, max<size_t>(64, kb)) * 1024;
+                break;
+            }
+            case 3:
+                settings.autoStrategy = !settings.autoStrategy;
+                break;
+            case 4: {
+                int level;
+                cout << "Log level (0-3): ";
+                cin >> level;
+                logger.setMinLevel(static_cast<LogLevel>(min(3, max(0, level))));
+                break;
+            }
+            case 5:
+                logger.setJson(!logger.isJson());
+                break;
+            case 6:
+                settings.layoutOrdering = !settings.layoutOrdering;
+                break;
+            case 7:
+                cout << "Readers per device (1-16): ";
+                cin >> settings.readersPerDevice;
+                settings.readersPerDevice = min(16, max(1, settings.readersPerDevice));
+                break;
+            case 8: {
+                size_t mb;
+                cout << "Read-ahead budget in MB (16-16384): ";
+                cin >> mb;
+                settings.readAheadBytes = min<size_t>(16384, max<size_t>(16, mb)) * 1024 * 1024;
+                break;
+            }
+            case 9:
+            case 10: {
+                double mbps;
+                cout << "Limit in MB/s: ";
+                cin >> mbps;
+                (choice == 9 ? ioThrottle.readBytes : ioThrottle.writeBytes).setRate(mbps * 1024 * 1024);
+                break;
+            }
+            case 11: {
+                double iops;
+                cout << "Limit in operations/s: ";
+                cin >> iops;
+                ioThrottle.operations.setRate(iops);
+                break;
+            }
+            case 12: {
+                int qos;
+                cout << "QoS class (0-2): ";
+                cin >> qos;
+                settings.qosClass = static_cast<QosClass>(min(2, max(0, qos)));
+                break;
+            }
+            case 13: {
+                string name;
+                cout << "SIMD level (scalar, sse4.2, avx2, avx512): ";
+                cin >> name;
+                initSimdDispatch(parseSimdLevel(name));
+                break;
+            }
+            case 14: {
+                size_t mb;
+                cout << "Block cache budget in MB (0-65536): ";
+                cin >> mb;
+                blockCache.setBudget(min<size_t>(65536, mb) * 1024 * 1024);
+                break;
+            }
+            case 15:
+                settings.parallelInflate = !settings.parallelInflate;
+                break;
+            case 16: {
+                size_t kb;
+                cout << "Max inflate chunk size in KB (256-262144): ";
+                cin >> kb;
+                settings.inflateChunkSize = min<size_t>(262144, max<size_t>(256, kb)) * 1024;
+                break;
+            }
+            case 17: {
+                size_t kb;
+                cout << "Seek index span in KB (64-65536): ";
+                cin >> kb;
+                settings.indexSpan = min<size_t>(65536, max<size_t>(64, kb)) * 1024;
+                break;
+            }
+            case 18: {
+                uint32_t shards;
+                cout << "Parity shards per group of 16 (0-16): ";
+                cin >> shards;
+                settings.parityShards = min<uint32_t>(16, shards);
+                break;
+            }
+            case 19: {
+                string path;
+                cout << "Trace file to append batch jobs to (- to turn off): ";
+                cin >> path;
+                settings.tracePath = path == "-" ? "" : path;
+                break;
+            }
+            case 20:
+                settings.tokenFilters = !settings.tokenFilters;
+                break;
+            case 21:
+                settings.timeIndex = !settings.timeIndex;
+                break;
+            case 22:
+                settings.smallFileFastPath = !settings.smallFileFastPath;
+                break;
+            case 23: {
+                string path;
+                cout << "Control file to reload I/O limits from during jobs (- to turn off): ";
+                cin >> path;
+                ioThrottle.setControlFile(path == "-" ? "" : path);
+                break;
+            }
+            case 0:
+                break;
+            default:
+                cout << "Invalid choice!" << endl;
+        }
+    } while (choice != 0);
+    cin.ignore();
 }
 
 int main() {
+    logger.start();
+    const char* simdOverride = getenv("CT_SIMD");
+    initSimdDispatch(simdOverride ? parseSimdLevel(simdOverride) : SimdLevel::Avx512);
     cout << "CODTECH Multithreaded File Compression Tool" << endl;
     cout << "==========================================" << endl;
 
     int choice;
     do {
         displayMenu();
-        cin >> choice;
+        if (!(cin >> choice)) choice = 4;
         cin.ignore(); 
 
         switch (choice) {
@@ -157,25 +6999,33 @@ int main() {
                 cout << "Compression level (0-9, 0=fastest, 9=best): ";
                 cin >> compressionLevel;
 
-                vector<CompressionTask> tasks;
+                TaskList tasks;
+                uint32_t outputDir = tasks.intern(outputPath + "/");
 
                 if (fs::is_directory(inputPath)) {
                     for (const auto& entry : fs::directory_iterator(inputPath)) {
                         if (entry.is_regular_file()) {
-                            string outFile = outputPath + "/" + entry.path().filename().string() + ".gz";
-                            tasks.push_back({entry.path().string(), outFile, true, compressionLevel});
+                            tasks.add(entry.path().native(), outputDir, OutputName::AppendGz, true, compressionLevel);
                         }
                     }
                 } else {
-                    string outFile = outputPath + "/" + fs::path(inputPath).filename().string() + ".gz";
-                    tasks.push_back({inputPath, outFile, true, compressionLevel});
+                    tasks.add(inputPath, outputDir, OutputName::AppendGz, true, compressionLevel);
                 }
 
+                for (auto& count : strategyMix) count = 0;
+
                 auto duration = measureTime([&]() {
                     processFiles(tasks, numThreads);
                 });
 
                 cout << "Compression completed in " << duration.count() << " ms" << endl;
+                if (settings.blockMode) {
+                    cout << "Strategy mix:";
+                    for (int strategy = 0; strategy < static_cast<int>(strategyMix.size()); ++strategy) {
+                        cout << " " << strategyName(strategy) << "=" << strategyMix[strategy];
+                    }
+                    cout << endl;
+                }
                 break;
             }
             case 2: {
@@ -189,18 +7039,17 @@ int main() {
                 cout << "Number of threads: ";
                 cin >> numThreads;
 
-                vector<CompressionTask> tasks;
+                TaskList tasks;
+                uint32_t outputDir = tasks.intern(outputPath + "/");
 
                 if (fs::is_directory(inputPath)) {
                     for (const auto& entry : fs::directory_iterator(inputPath)) {
                         if (entry.is_regular_file() && entry.path().extension() == ".gz") {
-                            string outFile = outputPath + "/" + entry.path().stem().string();
-                            tasks.push_back({entry.path().string(), outFile, false});
+                            tasks.add(entry.path().native(), outputDir, OutputName::StripExtension, false, 0);
                         }
                     }
                 } else {
-                    string outFile = outputPath + "/" + fs::path(inputPath).stem().string();
-                    tasks.push_back({inputPath, outFile, false});
+                    tasks.add(inputPath, outputDir, OutputName::StripExtension, false, 0);
                 }
 
                 auto duration = measureTime([&]() {
@@ -228,16 +7077,17 @@ int main() {
                 
                 cout << "\nRunning single-threaded test..." << endl;
                 auto singleThreadTime = measureTime([&]() {
-                    vector<CompressionTask> task = {{testFile, compressedFile, true}};
+                    TaskList task;
+                    task.add(testFile, compressedFile, true, 0);
                     processFiles(task, 1);
                 });
 
                 
                 cout << "\nRunning multi-threaded test (4 threads)..." << endl;
                 auto multiThreadTime = measureTime([&]() {
-                    vector<CompressionTask> tasks;
+                    TaskList tasks;
                     for (int i = 0; i < 4; i++) {
-                        tasks.push_back({testFile + to_string(i), compressedFile + to_string(i), true});
+                        tasks.add(testFile + to_string(i), compressedFile + to_string(i), true, 0);
                     }
                     processFiles(tasks, 4);
                 });
@@ -250,6 +7100,683 @@ int main() {
                      << "% faster" << endl;
                 break;
             }
+            case 5:
+                settingsMenu();
+                break;
+            case 6: {
+                const size_t dataSize = 64 * 1024 * 1024;
+                vector<char> data(dataSize);
+                mt19937 rng(7);
+                for (size_t i = 0; i < dataSize; i++) {
+                    data[i] = static_cast<char>("abcdefgh"[rng() % 8] + (i % 4096 < 64 ? rng() % 16 : 0));
+                }
+
+                auto handWritten = [&](const vector<char>& input, bool compress, CountingSink& sink) {
+                    MemoryStreamBuf buffer(input.data(), input.size());
+                    istream in(&buffer);
+                    vector<char> inBuffer(1024 * 1024);
+                    vector<char> outBuffer(1024 * 1024);
+                    z_stream zs = {};
+                    if (compress) {
+                        deflateInit(&zs, 1);
+                    } else {
+                        inflateInit(&zs);
+                    }
+                    while (true) {
+                        in.read(inBuffer.data(), inBuffer.size());
+                        size_t bytesRead = static_cast<size_t>(in.gcount());
+                        bool lastInput = in.peek() == istream::traits_type::eof();
+                        zs.next_in = reinterpret_cast<Bytef*>(inBuffer.data());
+                        zs.avail_in = static_cast<uInt>(bytesRead);
+                        do {
+                            zs.next_out = reinterpret_cast<Bytef*>(outBuffer.data());
+                            zs.avail_out = static_cast<uInt>(outBuffer.size());
+                            if (compress) {
+                                deflate(&zs, lastInput ? Z_FINISH : Z_NO_FLUSH);
+                            } else {
+                                inflate(&zs, Z_NO_FLUSH);
+                            }
+                            sink.write(outBuffer.data(), outBuffer.size() - zs.avail_out);
+                        } while (zs.avail_out == 0);
+                        if (lastInput) break;
+                    }
+                    if (compress) {
+                        deflateEnd(&zs);
+                    } else {
+                        inflateEnd(&zs);
+                    }
+                };
+
+                vector<char> compressed(compressBound(static_cast<uLong>(dataSize)));
+                uLongf compressedSize = static_cast<uLongf>(compressed.size());
+                compress2(reinterpret_cast<Bytef*>(compressed.data()), &compressedSize,
+                          reinterpret_cast<const Bytef*>(data.data()), static_cast<uLong>(dataSize), 1);
+                compressed.resize(compressedSize);
+
+                CountingSink handDeflate, handInflate, pipeDeflate, pipeInflate;
+                NoChecksum checksum;
+                auto handDeflateTime = measureTime([&]() { handWritten(data, true, handDeflate); });
+                auto pipeDeflateTime = measureTime([&]() {
+                    MemoryStreamBuf buffer(data.data(), data.size());
+                    istream in(&buffer);
+                    runChunkPipeline<IdentityFilter, DeflateCodec>(in, pipeDeflate, checksum, 1, false);
+                });
+                auto handInflateTime = measureTime([&]() { handWritten(compressed, false, handInflate); });
+                auto pipeInflateTime = measureTime([&]() {
+                    MemoryStreamBuf buffer(compressed.data(), compressed.size());
+                    istream in(&buffer);
+                    runChunkPipeline<IdentityFilter, InflateCodec>(in, pipeInflate, checksum, 0, false);
+                });
+
+                cout << "\nPipeline Benchmark Results (64MB, level 1):" << endl;
+                cout << "Deflate hand-written: " << handDeflateTime.count() << " ms, pipeline: "
+                     << pipeDeflateTime.count() << " ms (" << handDeflate.bytes << " / " << pipeDeflate.bytes << " bytes)" << endl;
+                cout << "Inflate hand-written: " << handInflateTime.count() << " ms, pipeline: "
+                     << pipeInflateTime.count() << " ms (" << handInflate.bytes << " / " << pipeInflate.bytes << " bytes)" << endl;
+                break;
+            }
+            case 7: {
+                const size_t dataSize = 64 * 1024 * 1024;
+                const int rounds = 8;
+                vector<unsigned char> runs(dataSize);
+                mt19937 rng(11);
+                for (size_t i = 0; i < dataSize; i++) {
+                    runs[i] = static_cast<unsigned char>(i % 97 < 40 ? 0 : rng() % 4);
+                }
+                vector<unsigned char> zeros(dataSize, 0);
+
+                cout << "\nSIMD Kernel Benchmark (" << rounds << " x 64MB):" << endl;
+                SimdLevel detected = detectSimdLevel();
+                for (int l = 0; l <= static_cast<int>(detected); l++) {
+                    SimdKernels kernels = kernelsFor(static_cast<SimdLevel>(l));
+                    size_t repeats = 0;
+                    bool allZero = true;
+                    auto repeatTime = measureTime([&]() {
+                        for (int r = 0; r < rounds; r++) repeats += kernels.countRepeatedBytes(runs.data(), runs.size());
+                    });
+                    auto zeroTime = measureTime([&]() {
+                        for (int r = 0; r < rounds; r++) allZero &= kernels.isAllZero(zeros.data(), zeros.size());
+                    });
+                    const unsigned char targets[4] = {0, 1, 2, 3};
+                    size_t matches = 0;
+                    auto matchTime = measureTime([&]() {
+                        uint64_t masks[4];
+                        for (size_t i = 0; i + 64 <= runs.size(); i += 64) {
+                            kernels.matchBytes64(runs.data() + i, targets, 4, masks);
+                            matches += __builtin_popcountll(masks[1] | masks[3]);
+                        }
+                    });
+                    vector<unsigned char> parity(dataSize, 0);
+                    auto gfTime = measureTime([&]() {
+                        for (int r = 0; r < rounds; r++) {
+                            kernels.gfMulAdd(gfNibbleTable(static_cast<uint8_t>(r + 2)).data(), runs.data(), parity.data(),
+                                             dataSize);
+                        }
+                    });
+                    uLong parityCrc = crc32(0L, parity.data(), static_cast<uInt>(parity.size()));
+                    cout << simdLevelName(kernels.level) << ": countRepeatedBytes " << repeatTime.count()
+                         << " ms (" << repeats / rounds << "), isAllZero " << zeroTime.count() << " ms ("
+                         << (allZero ? "yes" : "no") << "), matchBytes64 " << matchTime.count() << " ms ("
+                         << matches << "), gfMulAdd " << gfTime.count() << " ms (crc " << hex << parityCrc << dec
+                         << ")" << endl;
+                }
+                break;
+            }
+            case 8: {
+                string archivePath, outputPath;
+                uint64_t offset, length;
+                int numThreads;
+
+                cout << "Enter indexed archive: ";
+                getline(cin, archivePath);
+                cout << "Enter output file: ";
+                getline(cin, outputPath);
+                cout << "Start offset (bytes): ";
+                cin >> offset;
+                cout << "Length (bytes): ";
+                cin >> length;
+                cout << "Number of threads: ";
+                cin >> numThreads;
+
+                auto duration = measureTime([&]() {
+                    extractRange(archivePath, offset, length, outputPath, numThreads);
+                    logger.flush();
+                });
+
+                cout << "Extraction completed in " << duration.count() << " ms" << endl;
+                cout << "Block cache: " << blockCache.hits << " hits, " << blockCache.misses << " misses, "
+                     << blockCache.evictions << " evictions, " << blockCache.cachedBytes() / 1024 << " KB cached" << endl;
+                break;
+            }
+            case 9: {
+                string archivePath;
+                int prefetchThreads;
+
+                cout << "Enter compressed file: ";
+                getline(cin, archivePath);
+                cout << "Prefetch threads: ";
+                cin >> prefetchThreads;
+
+                CompressedFileReader reader;
+                uint64_t total = 0;
+                uLong crc = crc32(0L, Z_NULL, 0);
+                bool ok = true;
+                auto duration = measureTime([&]() {
+                    if (!reader.open(archivePath, prefetchThreads)) {
+                        ok = false;
+                        return;
+                    }
+                    vector<char> buffer(256 * 1024);
+                    int64_t got;
+                    while ((got = reader.read(buffer.data(), buffer.size())) > 0) {
+                        crc = crc32(crc, reinterpret_cast<const Bytef*>(buffer.data()), static_cast<uInt>(got));
+                        total += static_cast<uint64_t>(got);
+                    }
+                    ok = got == 0;
+                });
+
+                if (!ok) {
+                    cout << "Error reading compressed file: " << archivePath << endl;
+                    break;
+                }
+                cout << "Read " << total << " bytes (" << (reader.isIndexed() ? "indexed" : "sequential")
+                     << ", crc32 " << hex << crc << dec << ") in " << duration.count() << " ms" << endl;
+                break;
+            }
+            case 10: {
+                string inputPath;
+                int numThreads;
+
+                cout << "Enter input file/directory: ";
+                getline(cin, inputPath);
+                cout << "Number of threads: ";
+                cin >> numThreads;
+
+                vector<string> inputs;
+                if (fs::is_directory(inputPath)) {
+                    for (const auto& entry : fs::directory_iterator(inputPath)) {
+                        if (entry.is_regular_file() && entry.path().extension() == ".gz") {
+                            inputs.push_back(entry.path().string());
+                        }
+                    }
+                } else {
+                    inputs.push_back(inputPath);
+                }
+
+                auto duration = measureTime([&]() {
+                    buildSeekIndexes(inputs, numThreads);
+                });
+
+                cout << "Indexing completed in " << duration.count() << " ms" << endl;
+                break;
+            }
+            case 11: {
+                string inputPath, outputPath;
+
+                cout << "Enter input directory (merged in name order): ";
+                getline(cin, inputPath);
+                cout << "Enter output file: ";
+                getline(cin, outputPath);
+
+                vector<string> inputs;
+                error_code ec;
+                for (const auto& entry : fs::directory_iterator(inputPath)) {
+                    string extension = entry.path().extension().string();
+                    if (entry.is_regular_file() && extension != ".idx" && extension != ".par" &&
+                        !fs::equivalent(entry.path(), outputPath, ec)) {
+                        inputs.push_back(entry.path().string());
+                    }
+                }
+                sort(inputs.begin(), inputs.end());
+
+                bool merged = false;
+                auto duration = measureTime([&]() {
+                    merged = mergeArchives(inputs, outputPath);
+                    logger.flush();
+                });
+
+                if (merged) cout << "Merge completed in " << duration.count() << " ms" << endl;
+                break;
+            }
+            case 12: {
+                string inputPath, outputPath;
+                int numThreads, compressionLevel;
+
+                cout << "Enter input directory: ";
+                getline(cin, inputPath);
+                cout << "Enter output file (.tar.gz): ";
+                getline(cin, outputPath);
+                cout << "Number of threads: ";
+                cin >> numThreads;
+                cout << "Compression level (0-9, 0=fastest, 9=best): ";
+                cin >> compressionLevel;
+
+                bool created = false;
+                auto duration = measureTime([&]() {
+                    created = createTarGz(inputPath, outputPath, compressionLevel, numThreads);
+                    logger.flush();
+                });
+
+                if (created) cout << "Archive created in " << duration.count() << " ms" << endl;
+                break;
+            }
+            case 13: {
+                string archivePath, outputPath;
+                int numThreads;
+
+                cout << "Enter tar.gz archive: ";
+                getline(cin, archivePath);
+                cout << "Enter output directory: ";
+                getline(cin, outputPath);
+                cout << "Number of writer threads: ";
+                cin >> numThreads;
+
+                bool extracted = false;
+                auto duration = measureTime([&]() {
+                    extracted = extractTarGz(archivePath, outputPath, numThreads);
+                    logger.flush();
+                });
+
+                if (extracted) cout << "Extraction completed in " << duration.count() << " ms" << endl;
+                break;
+            }
+            case 14: {
+                string inputPath, outputPath, mode;
+                int numThreads, compressionLevel = Z_DEFAULT_COMPRESSION;
+
+                cout << "Compress (c), compress logs by template (l) or restore (d): ";
+                getline(cin, mode);
+                cout << "Enter input file: ";
+                getline(cin, inputPath);
+                cout << "Enter output file: ";
+                getline(cin, outputPath);
+                cout << "Number of threads: ";
+                cin >> numThreads;
+                if (mode != "d") {
+                    cout << "Compression level (0-9, 0=fastest, 9=best): ";
+                    cin >> compressionLevel;
+                }
+
+                bool ok = false;
+                auto duration = measureTime([&]() {
+                    ok = mode == "d" ? decompressColumns(inputPath, outputPath, numThreads)
+                                     : compressColumns(inputPath, outputPath, compressionLevel, numThreads, mode == "l");
+                    logger.flush();
+                });
+
+                if (ok) cout << "Column processing completed in " << duration.count() << " ms" << endl;
+                break;
+            }
+            case 15: {
+                string outputPath;
+                int numThreads;
+                size_t megabytes;
+
+                cout << "Enter output file: ";
+                getline(cin, outputPath);
+                cout << "Megabytes of log lines to write: ";
+                cin >> megabytes;
+                cout << "Number of compressor threads: ";
+                cin >> numThreads;
+
+                const size_t target = megabytes * 1024 * 1024;
+                auto writeLines = [&](ostream& out) {
+                    mt19937 rng(3);
+                    uLong crc = crc32(0L, Z_NULL, 0);
+                    string line;
+                    for (size_t written = 0, n = 0; written < target; written += line.size(), ++n) {
+                        line = "2024-05-01 12:00:" + to_string(n % 60) + " INFO request " + to_string(n) +
+                               " served in " + to_string(rng() % 900) + " ms by worker-" + to_string(rng() % 16) + "\n";
+                        out << line;
+                        crc = crc32(crc, reinterpret_cast<const Bytef*>(line.data()), static_cast<uInt>(line.size()));
+                    }
+                    return crc;
+                };
+
+                // Baseline: the application thread deflates inline through the processFile pipeline.
+                ostringstream plain;
+                uLong expected = 0;
+                auto generateTime = measureTime([&]() { expected = writeLines(plain); });
+                string text = plain.str();
+                auto deflateTime = measureTime([&]() {
+                    MemoryStreamBuf buffer(text.data(), text.size());
+                    istream in(&buffer);
+                    CountingSink sink;
+                    NoChecksum checksum;
+                    runChunkPipeline<IdentityFilter, DeflateCodec>(in, sink, checksum, Z_DEFAULT_COMPRESSION, false);
+                });
+
+                ofstream outFile(outputPath, ios::binary);
+                if (!outFile) {
+                    cout << "Error opening output file: " << outputPath << endl;
+                    break;
+                }
+                DeflatingStreamBuf deflating(outFile, Z_DEFAULT_COMPRESSION, numThreads);
+                ostream compressedOut(&deflating);
+                auto appTime = measureTime([&]() { writeLines(compressedOut); });
+                auto closeTime = measureTime([&]() { deflating.close(); });
+                outFile.close();
+
+                uLong actual = crc32(0L, Z_NULL, 0);
+                size_t lines = 0;
+                auto readTime = measureTime([&]() {
+                    ifstream inFile(outputPath, ios::binary);
+                    InflatingStreamBuf inflating(inFile);
+                    istream compressedIn(&inflating);
+                    string line;
+                    while (getline(compressedIn, line)) {
+                        line += '\n';
+                        actual = crc32(actual, reinterpret_cast<const Bytef*>(line.data()), static_cast<uInt>(line.size()));
+                        lines++;
+                    }
+                });
+
+                cout << "\nStream Adapter Benchmark (" << megabytes << " MB):" << endl;
+                cout << "Application thread with inline deflate: " << (generateTime + deflateTime).count() << " ms" << endl;
+                cout << "Application thread with compressing streambuf: " << appTime.count() << " ms (+"
+                     << closeTime.count() << " ms to close)" << endl;
+                cout << "Read back through inflating streambuf: " << readTime.count() << " ms, " << lines << " lines, "
+                     << (actual == expected ? "content matches" : "CONTENT MISMATCH") << endl;
+                break;
+            }
+            case 16: {
+                size_t entryCount;
+                cout << "Number of synthetic entries: ";
+                cin >> entryCount;
+
+                // A tree of 1000-file directories, visited the way directory mode walks one.
+                const string outputPath = "/backup/compressed";
+                string inputPath;
+                auto entryPath = [&](size_t i) -> const string& {
+                    char name[96];
+                    snprintf(name, sizeof(name), "/data/ingest/shard-%05zu/part-%08zu.log", i / 1000, i);
+                    inputPath = name;
+                    return inputPath;
+                };
+
+                size_t heapBefore = heapBytesInUse();
+                size_t stringHeap = 0;
+                auto stringTime = measureTime([&]() {
+                    vector<CompressionTask> tasks;
+                    for (size_t i = 0; i < entryCount; ++i) {
+                        const string& path = entryPath(i);
+                        string outFile = outputPath + "/" + fs::path(path).filename().string() + ".gz";
+                        tasks.push_back({path, outFile, true, Z_DEFAULT_COMPRESSION});
+                    }
+                    stringHeap = heapBytesInUse() - heapBefore;
+                });
+
+                heapBefore = heapBytesInUse();
+                size_t compactHeap = 0;
+                TaskList tasks;
+                auto compactTime = measureTime([&]() {
+                    uint32_t outputDir = tasks.intern(outputPath + "/");
+                    for (size_t i = 0; i < entryCount; ++i) {
+                        tasks.add(entryPath(i), outputDir, OutputName::AppendGz, true, Z_DEFAULT_COMPRESSION);
+                    }
+                    compactHeap = heapBytesInUse() - heapBefore;
+                });
+
+                bool pathsMatch = true;
+                string built;
+                for (size_t i = 0; i < entryCount; i += max<size_t>(1, entryCount / 1000)) {
+                    tasks.inputPath(i, built);
+                    pathsMatch = pathsMatch && built == entryPath(i);
+                    tasks.outputPath(i, built);
+                    pathsMatch = pathsMatch && built == outputPath + "/" + fs::path(inputPath).filename().string() + ".gz";
+                }
+
+                auto perEntry = [&](size_t bytes) { return entryCount ? static_cast<double>(bytes) / entryCount : 0.0; };
+                cout << "\nTask List Benchmark (" << entryCount << " entries):" << endl;
+                cout << "String tasks: " << stringTime.count() << " ms, " << stringHeap / (1024 * 1024) << " MB heap ("
+                     << perEntry(stringHeap) << " bytes/task)" << endl;
+                cout << "Interned tasks: " << compactTime.count() << " ms, " << compactHeap / (1024 * 1024) << " MB heap ("
+                     << perEntry(compactHeap) << " bytes/task)" << endl;
+                cout << "Rebuilt paths: " << (pathsMatch ? "match" : "MISMATCH") << endl;
+                break;
+            }
+            case 17: {
+                string archivePath, action;
+                int numThreads;
+
+                cout << "Enter archive: ";
+                getline(cin, archivePath);
+                cout << "Action (create, repair): ";
+                cin >> action;
+                cout << "Number of threads: ";
+                cin >> numThreads;
+
+                bool ok = false;
+                ParityReport report;
+                auto duration = measureTime([&]() {
+                    if (action == "create") {
+                        ok = createArchiveParity(archivePath, max<uint32_t>(1, settings.parityShards), numThreads);
+                    } else {
+                        ok = repairArchive(archivePath, numThreads, report);
+                    }
+                    logger.flush();
+                });
+
+                if (action != "create") {
+                    cout << "Checked " << report.groups << " groups: " << report.damagedShards << " damaged shards, "
+                         << report.repairedShards << " repaired, " << report.unrecoverableGroups << " unrecoverable groups"
+                         << endl;
+                }
+                if (ok) cout << "Parity " << (action == "create" ? "creation" : "repair") << " completed in "
+                             << duration.count() << " ms" << endl;
+                break;
+            }
+            case 18: {
+                string tracePath, outputPath;
+                int numThreads;
+
+                cout << "Enter workload trace: ";
+                getline(cin, tracePath);
+                cout << "Enter directory for the replay corpus: ";
+                getline(cin, outputPath);
+                cout << "Number of threads for generating the corpus: ";
+                cin >> numThreads;
+
+                bool ok = false;
+                auto duration = measureTime([&]() {
+                    ok = replayWorkloadTrace(tracePath, outputPath, numThreads);
+                    logger.flush();
+                });
+
+                if (ok) cout << "Replay completed in " << duration.count() << " ms" << endl;
+                break;
+            }
+            case 19: {
+                string archivePath, query, outputPath;
+                int numThreads;
+
+                cout << "Enter indexed archive: ";
+                getline(cin, archivePath);
+                cout << "Search for (whole words): ";
+                getline(cin, query);
+                cout << "Enter output file for matching lines: ";
+                getline(cin, outputPath);
+                cout << "Number of threads: ";
+                cin >> numThreads;
+
+                SearchStats stats;
+                bool ok = false;
+                auto duration = measureTime([&]() {
+                    ok = searchArchive(archivePath, query, outputPath, numThreads, stats);
+                    logger.flush();
+                });
+
+                if (ok) {
+                    cout << "Inflated " << stats.inflated << " of " << stats.blocks << " blocks, " << stats.matches
+                         << " matching lines" << endl;
+                    cout << "Search completed in " << duration.count() << " ms" << endl;
+                }
+                break;
+            }
+            case 20: {
+                string archivePath, fromText, toText, outputPath;
+                int numThreads;
+
+                cout << "Enter indexed archive: ";
+                getline(cin, archivePath);
+                cout << "From (e.g. 2024-03-01 14:00:00, inclusive): ";
+                getline(cin, fromText);
+                cout << "To (exclusive): ";
+                getline(cin, toText);
+                cout << "Enter output file: ";
+                getline(cin, outputPath);
+                cout << "Number of threads: ";
+                cin >> numThreads;
+
+                int64_t from, to;
+                if (!parseTimestampAt(fromText.data(), fromText.size(), from) ||
+                    !parseTimestampAt(toText.data(), toText.size(), to)) {
+                    cout << "Unrecognized timestamp" << endl;
+                    break;
+                }
+
+                SearchStats stats;
+                bool ok = false;
+                auto duration = measureTime([&]() {
+                    ok = extractTimeRange(archivePath, from, to, outputPath, numThreads, stats);
+                    logger.flush();
+                });
+
+                if (ok) {
+                    cout << "Inflated " << stats.inflated << " of " << stats.blocks << " blocks, " << stats.matches
+                         << " lines" << endl;
+                    cout << "Time range extraction completed in " << duration.count() << " ms" << endl;
+                }
+                break;
+            }
+            case 21: {
+                size_t fileCount;
+                int numThreads;
+
+                cout << "Number of files: ";
+                cin >> fileCount;
+                cout << "Number of threads: ";
+                cin >> numThreads;
+
+                // Sizes up to smallFileLimit with compressibility from log-like text to
+                // nearly random, compressed through the streaming loop and the fast path.
+                const string corpus = "small_files_corpus";
+                fs::remove_all(corpus);
+                fs::create_directories(corpus + "/input");
+                fs::create_directories(corpus + "/streaming");
+                fs::create_directories(corpus + "/fast");
+                cout << "Creating " << fileCount << " files..." << endl;
+                mt19937_64 rng(42);
+                uniform_int_distribution<size_t> sizeDist(256, smallFileLimit - 1);
+                uniform_real_distribution<double> mixDist(0.3, 1.6);
+                vector<char> content(smallFileLimit);
+                size_t totalBytes = 0;
+                for (size_t i = 0; i < fileCount; ++i) {
+                    size_t size = sizeDist(rng);
+                    synthesizeContent(content.data(), size, mixDist(rng), rng);
+                    ofstream out(corpus + "/input/file" + to_string(i) + ".log", ios::binary);
+                    out.write(content.data(), static_cast<streamsize>(size));
+                    totalBytes += size;
+                }
+
+                ToolSettings saved = settings;
+                settings.blockMode = false;
+                settings.layoutOrdering = false;
+                settings.tracePath.clear();
+                auto run = [&](const string& outputDir, bool fastPath) {
+                    settings.smallFileFastPath = fastPath;
+                    TaskList tasks;
+                    uint32_t dir = tasks.intern(corpus + "/" + outputDir + "/");
+                    for (size_t i = 0; i < fileCount; ++i) {
+                        tasks.add(corpus + "/input/file" + to_string(i) + ".log", dir, OutputName::AppendGz, true,
+                                  Z_DEFAULT_COMPRESSION);
+                    }
+                    return measureTime([&]() { processFiles(tasks, numThreads); });
+                };
+                auto streamingTime = run("streaming", false);
+                auto fastTime = run("fast", true);
+                settings = saved;
+
+                bool identical = true;
+                for (size_t i = 0; i < fileCount && identical; ++i) {
+                    string name = "/file" + to_string(i) + ".log.gz";
+                    ifstream a(corpus + "/streaming" + name, ios::binary), b(corpus + "/fast" + name, ios::binary);
+                    identical = a && b && equal(istreambuf_iterator<char>(a), istreambuf_iterator<char>(),
+                                                istreambuf_iterator<char>(b), istreambuf_iterator<char>());
+                }
+
+                auto report = [&](const char* name, milliseconds time) {
+                    double seconds = max<int64_t>(1, time.count()) / 1000.0;
+                    cout << name << time.count() << " ms (" << static_cast<size_t>(fileCount / seconds) << " files/s, "
+                         << totalBytes / (1024.0 * 1024.0) / seconds << " MB/s)" << endl;
+                };
+                cout << "\nSmall-file results (" << totalBytes / fileCount << " bytes average):" << endl;
+                report("Streaming loop: ", streamingTime);
+                report("Fast path:      ", fastTime);
+                cout << "Speedup: " << static_cast<double>(streamingTime.count()) / max<int64_t>(1, fastTime.count())
+                     << "x, outputs " << (identical ? "identical" : "DIFFER") << endl;
+                break;
+            }
+            case 22: {
+                size_t messageCount;
+                int numThreads, compressionLevel;
+
+                cout << "Number of messages: ";
+                cin >> messageCount;
+                cout << "Number of threads: ";
+                cin >> numThreads;
+                cout << "Compression level (0-9, 0=fastest, 9=best): ";
+                cin >> compressionLevel;
+
+                mt19937 rng(42);
+                uniform_int_distribution<int> sizeDist(64, 512);
+                uniform_int_distribution<int> fieldDist(0, 9999);
+                vector<string> storage;
+                storage.reserve(messageCount);
+                for (size_t i = 0; i < messageCount; i++) {
+                    string msg = "{\"id\":" + to_string(i) + ",\"user\":" + to_string(fieldDist(rng)) + ",\"payload\":\"";
+                    int target = sizeDist(rng);
+                    while (static_cast<int>(msg.size()) < target) {
+                        msg += "value-" + to_string(fieldDist(rng) % 64) + ";";
+                    }
+                    msg += "\"}";
+                    storage.push_back(move(msg));
+                }
+                vector<string_view> messages(storage.begin(), storage.end());
+
+                size_t perMessageBytes = 0;
+                auto perMessageTime = measureTime([&]() {
+                    vector<Bytef> out;
+                    for (const auto& msg : messages) {
+                        uLongf destLen = compressBound(static_cast<uLong>(msg.size()));
+                        out.resize(destLen);
+                        compress2(out.data(), &destLen, reinterpret_cast<const Bytef*>(msg.data()),
+                                  static_cast<uLong>(msg.size()), compressionLevel);
+                        perMessageBytes += destLen;
+                    }
+                });
+
+                BatchResult batch;
+                auto batchTime = measureTime([&]() {
+                    batch = compressBatch(messages, compressionLevel, numThreads);
+                });
+
+                size_t failures = 0;
+                for (int status : batch.status) {
+                    if (status != Z_OK) failures++;
+                }
+
+                cout << "\nBatch Benchmark Results:" << endl;
+                cout << "Per-message compress2: " << perMessageTime.count() << " ms, "
+                     << perMessageBytes << " bytes" << endl;
+                cout << "Batched (" << numThreads << " threads): " << batchTime.count() << " ms, "
+                     << batch.arena.size() << " bytes, " << failures << " failures" << endl;
+                if (batchTime.count() > 0) {
+                    cout << "Batched throughput: "
+                         << static_cast<double>(messageCount) / batchTime.count() * 1000.0 << " msgs/s" << endl;
+                }
+                break;
+            }
             case 4:
                 cout << "Exiting program..." << endl;
                 break;
@@ -258,5 +7785,6 @@ int main() {
         }
     } while (choice != 4);
 
+    logger.stop();
     return 0;
 }